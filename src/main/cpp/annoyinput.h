@@ -0,0 +1,461 @@
+// Copyright (c) 2016 pishen
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ANNOYINPUT_H
+#define ANNOYINPUT_H
+
+#include "annoylib.h"
+
+#include <string>
+#include <sstream>
+#include <locale>
+#include <cctype>
+
+// Loaders for the input files of Annoy.create. Both memory-map the file, make
+// room for all its items with reserve_items, then parse it in chunks on a
+// WorkStealingPool, every chunk adding its own items without locking.
+//
+// The text format has one item per line, "<id> <v_1> ... <v_f>", separated by
+// spaces. The binary format is .fvecs: for every item a little-endian int32
+// holding f, followed by f little-endian float32 values. It has no ids; items
+// are numbered in file order.
+
+class MappedInputFile {
+public:
+  explicit MappedInputFile(const char* filename) : _fd(-1), _data(NULL), _size(0) {
+    _fd = open(filename, O_RDONLY, (int)0400);
+    if (_fd == -1) {
+      showUpdate("Unable to open %s: %s (%d)\n", filename, strerror(errno), errno);
+      return;
+    }
+    off_t size = lseek_getsize(_fd);
+    if (size == -1) {
+      showUpdate("Unable to get size of %s: %s (%d)\n", filename, strerror(errno), errno);
+      return;
+    }
+    _size = (size_t)size;
+    if (_size > 0) {
+      void* data = mmap(0, _size, PROT_READ, MAP_SHARED, _fd, 0);
+      if (data == MAP_FAILED) {
+        showUpdate("Unable to mmap %s: %s (%d)\n", filename, strerror(errno), errno);
+        _size = 0;
+        return;
+      }
+      _data = (const char*)data;
+    }
+  }
+
+  ~MappedInputFile() {
+    if (_data)
+      munmap((void*)_data, _size);
+    if (_fd != -1)
+      close(_fd);
+  }
+
+  bool ok() const {
+    return _fd != -1 && (_data != NULL || _size == 0);
+  }
+
+  const char* data() const {
+    return _data;
+  }
+
+  size_t size() const {
+    return _size;
+  }
+
+private:
+  int _fd;
+  const char* _data;
+  size_t _size;
+  MappedInputFile(const MappedInputFile&);
+  MappedInputFile& operator=(const MappedInputFile&);
+};
+
+inline bool is_input_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool is_decimal(const std::string& token) {
+  // Whether token is a decimal number, with an optional exponent
+  size_t i = 0, n_digits = 0;
+  if (i < token.size() && (token[i] == '-' || token[i] == '+'))
+    i++;
+  for (; i < token.size() && isdigit((unsigned char)token[i]); i++)
+    n_digits++;
+  if (i < token.size() && token[i] == '.') {
+    for (i++; i < token.size() && isdigit((unsigned char)token[i]); i++)
+      n_digits++;
+  }
+  if (n_digits == 0)
+    return false;
+  if (i < token.size() && (token[i] == 'e' || token[i] == 'E')) {
+    i++;
+    if (i < token.size() && (token[i] == '-' || token[i] == '+'))
+      i++;
+    if (i == token.size() || !isdigit((unsigned char)token[i]))
+      return false;
+    while (i < token.size() && isdigit((unsigned char)token[i]))
+      i++;
+  }
+  return i == token.size();
+}
+
+inline bool parse_float_slow(const char* begin, const char* end, float* out) {
+  // Locale-independent fallback (the JVM sets the process locale, which would
+  // change the decimal separator of strtof)
+  std::string token(begin, end);
+  if (token == "NaN") {
+    *out = numeric_limits<float>::quiet_NaN();
+    return true;
+  } else if (token == "Infinity" || token == "+Infinity") {
+    *out = numeric_limits<float>::infinity();
+    return true;
+  } else if (token == "-Infinity") {
+    *out = -numeric_limits<float>::infinity();
+    return true;
+  }
+  std::istringstream in(token);
+  in.imbue(std::locale::classic());
+  in >> *out;
+  if (in.fail() && is_decimal(token)) {
+    // Out of the range of floats, which the stream fails on. Like strtof,
+    // keep the zero or subnormal it rounded to, or the infinity beyond its
+    // largest value.
+    if (fabsf(*out) == numeric_limits<float>::max())
+      *out = *out > 0 ? numeric_limits<float>::infinity() : -numeric_limits<float>::infinity();
+    return true;
+  }
+  return !in.fail() && in.peek() == EOF;
+}
+
+inline bool parse_float(const char* begin, const char* end, float* out) {
+  // Fast path for plain decimals: up to 19 significant digits are accumulated
+  // exactly and scaled by an exact power of ten in double precision, which is
+  // correctly rounded (Clinger's fast path). Rounding that double to float
+  // gives the correctly rounded float unless the double sits exactly halfway
+  // between two floats. Everything else takes the slow path.
+  static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const char* p = begin;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+  uint64_t mantissa = 0;
+  int n_significant = 0, exponent = 0;
+  bool any_digit = false;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    any_digit = true;
+    if (mantissa == 0 && *p == '0')
+      continue;
+    if (++n_significant > 19)
+      return parse_float_slow(begin, end, out);
+    mantissa = mantissa * 10 + (*p - '0');
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      any_digit = true;
+      exponent--;
+      if (mantissa == 0 && *p == '0')
+        continue;
+      if (++n_significant > 19)
+        return parse_float_slow(begin, end, out);
+      mantissa = mantissa * 10 + (*p - '0');
+    }
+  }
+  if (!any_digit)
+    return parse_float_slow(begin, end, out);
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    bool negative_exponent = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+      negative_exponent = (*p == '-');
+      p++;
+    }
+    if (p == end || *p < '0' || *p > '9')
+      return parse_float_slow(begin, end, out);
+    int e = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+      if (e > 1000)
+        return parse_float_slow(begin, end, out);
+      e = e * 10 + (*p - '0');
+    }
+    exponent += negative_exponent ? -e : e;
+  }
+  if (p != end)
+    return parse_float_slow(begin, end, out);
+  if (mantissa == 0) {
+    *out = negative ? -0.0f : 0.0f;
+    return true;
+  }
+  if (mantissa > ((uint64_t)1 << 53) || exponent < -22 || exponent > 22)
+    return parse_float_slow(begin, end, out);
+
+  double d = (double)mantissa;
+  d = exponent < 0 ? d / powers_of_ten[-exponent] : d * powers_of_ten[exponent];
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  const uint64_t low_bits = ((uint64_t)1 << 29) - 1;
+  if ((bits & low_bits) == ((uint64_t)1 << 28))
+    return parse_float_slow(begin, end, out);
+  *out = negative ? -(float)d : (float)d;
+  return true;
+}
+
+inline int text_input_dimension(const char* filename) {
+  // Number of values on the first non-empty line, or -1 if there is none
+  MappedInputFile file(filename);
+  if (!file.ok())
+    return -1;
+  const char* p = file.data();
+  const char* end = p + file.size();
+  while (p < end) {
+    const char* line_end = (const char*)memchr(p, '\n', end - p);
+    if (!line_end)
+      line_end = end;
+    int n_tokens = 0;
+    for (const char* q = p; q < line_end;) {
+      while (q < line_end && is_input_space(*q))
+        q++;
+      if (q == line_end)
+        break;
+      n_tokens++;
+      while (q < line_end && !is_input_space(*q))
+        q++;
+    }
+    if (n_tokens > 0)
+      return n_tokens - 1;
+    p = line_end + 1;
+  }
+  return -1;
+}
+
+inline int fvecs_input_dimension(const char* filename) {
+  MappedInputFile file(filename);
+  if (!file.ok() || file.size() < sizeof(int32_t))
+    return -1;
+  int32_t f;
+  memcpy(&f, file.data(), sizeof(f));
+  return f;
+}
+
+template<typename S, typename T>
+class TextInputLoader {
+  // Parses the text format into an index. The file is cut into chunks at line
+  // boundaries; a first parallel pass counts the lines of every chunk, which
+  // gives each chunk its first item id, and a second one parses the chunks.
+public:
+  TextInputLoader(AnnoyIndexInterface<S, T>* index, int f) : _index(index), _f(f), _error(false) {}
+
+  // Returns the number of items, or -1 if the file can't be read or parsed.
+  // The ids are written to ids, one per line in item order.
+  S load(const char* filename, int n_threads, std::string* ids) {
+    MappedInputFile file(filename);
+    if (!file.ok())
+      return -1;
+    _begin = file.data();
+    _end = file.data() + file.size();
+
+    size_t n_chunks = std::max((size_t)1, (file.size() + chunk_bytes - 1) / chunk_bytes);
+    _chunks.assign(n_chunks + 1, _begin);
+    for (size_t c = 1; c < n_chunks; c++) {
+      const char* p = std::max(_chunks[c - 1], _begin + c * chunk_bytes);
+      const char* newline = p < _end ? (const char*)memchr(p, '\n', _end - p) : NULL;
+      _chunks[c] = newline ? newline + 1 : _end;
+    }
+    _chunks[n_chunks] = _end;
+    _first_items.assign(n_chunks + 1, 0);
+    _ids.assign(n_chunks, std::string());
+
+    if (n_threads == -1)
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    WorkStealingPool pool(n_threads);
+    _run(pool, n_chunks, &TextInputLoader::_count_lines);
+    for (size_t c = 0; c < n_chunks; c++)
+      _first_items[c + 1] += _first_items[c];
+    if (!_index->reserve_items(_first_items[n_chunks]))
+      return -1;
+    _run(pool, n_chunks, &TextInputLoader::_parse_chunk);
+    if (_error)
+      return -1;
+
+    ids->clear();
+    for (size_t c = 0; c < n_chunks; c++)
+      ids->append(_ids[c]);
+    return _first_items[n_chunks];
+  }
+
+private:
+  static const size_t chunk_bytes = 8 << 20;
+
+  AnnoyIndexInterface<S, T>* _index;
+  int _f;
+  const char* _begin;
+  const char* _end;
+  vector<const char*> _chunks;
+  vector<S> _first_items; // Before the prefix sum: number of items in chunk c - 1
+  vector<std::string> _ids;
+  std::atomic<bool> _error;
+
+  void _run(WorkStealingPool& pool, size_t n_chunks, void (TextInputLoader::*fn)(size_t)) {
+    std::deque<WorkStealingPool::Task> tasks;
+    for (size_t c = 0; c < n_chunks; c++) {
+      tasks.emplace_back(std::bind(fn, this, c));
+      pool.spawn(&tasks.back());
+    }
+    for (size_t c = 0; c < n_chunks; c++)
+      pool.wait(&tasks[c]);
+  }
+
+  template<typename Visitor>
+  static void _for_each_line(const char* p, const char* end, Visitor visit) {
+    // Calls visit(begin, end) for every line that isn't blank
+    while (p < end) {
+      const char* line_end = (const char*)memchr(p, '\n', end - p);
+      if (!line_end)
+        line_end = end;
+      const char* q = p;
+      while (q < line_end && is_input_space(*q))
+        q++;
+      if (q < line_end)
+        visit(q, line_end);
+      p = line_end + 1;
+    }
+  }
+
+  void _count_lines(size_t c) {
+    S n = 0;
+    _for_each_line(_chunks[c], _chunks[c + 1], [&](const char*, const char*) { n++; });
+    _first_items[c + 1] = n;
+  }
+
+  void _parse_chunk(size_t c) {
+    S first_item = _first_items[c];
+    vector<T> v(_f);
+    std::string& ids = _ids[c];
+    S row = 0;
+    bool error = false;
+    _for_each_line(_chunks[c], _chunks[c + 1], [&](const char* p, const char* line_end) {
+      if (error)
+        return;
+      const char* id_end = p;
+      while (id_end < line_end && !is_input_space(*id_end))
+        id_end++;
+      ids.append(p, id_end);
+      ids.push_back('\n');
+
+      int z = 0;
+      for (p = id_end; p < line_end;) {
+        while (p < line_end && is_input_space(*p))
+          p++;
+        if (p == line_end)
+          break;
+        const char* token_end = p;
+        while (token_end < line_end && !is_input_space(*token_end))
+          token_end++;
+        float value;
+        if (z >= _f || !parse_float(p, token_end, &value)) {
+          error = true;
+          break;
+        }
+        v[z++] = value;
+        p = token_end;
+      }
+      if (error || z != _f) {
+        showUpdate("Unable to parse item %ld of the input: expected an id and %d values\n",
+                   (long)(first_item + row), _f);
+        error = true;
+      } else if (!_index->add_item(first_item + row, &v[0])) {
+        error = true;
+      }
+      row++;
+    });
+    if (error)
+      _error = true;
+  }
+};
+
+template<typename S, typename T>
+class FvecsInputLoader {
+  // Adds the vectors of an .fvecs file to an index straight from the mapped
+  // file, chunk_items items per task
+public:
+  FvecsInputLoader(AnnoyIndexInterface<S, T>* index, int f) : _index(index), _f(f), _error(false) {}
+
+  // Returns the number of items, or -1 if the file can't be read or isn't an .fvecs file with dimension f
+  S load(const char* filename, int n_threads) {
+    MappedInputFile file(filename);
+    if (!file.ok())
+      return -1;
+    _data = file.data();
+    _record_size = sizeof(int32_t) + (size_t)_f * sizeof(float);
+    if (file.size() % _record_size) {
+      showUpdate("Size of %s is not a multiple of the record size %zu\n", filename, _record_size);
+      return -1;
+    }
+    _n_items = (S)(file.size() / _record_size);
+    if (!_index->reserve_items(_n_items))
+      return -1;
+
+    if (n_threads == -1)
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    WorkStealingPool pool(n_threads);
+    size_t n_chunks = ((size_t)_n_items + chunk_items - 1) / chunk_items;
+    std::deque<WorkStealingPool::Task> tasks;
+    for (size_t c = 0; c < n_chunks; c++) {
+      tasks.emplace_back(std::bind(&FvecsInputLoader::_copy_chunk, this, c));
+      pool.spawn(&tasks.back());
+    }
+    for (size_t c = 0; c < n_chunks; c++)
+      pool.wait(&tasks[c]);
+    return _error ? -1 : _n_items;
+  }
+
+private:
+  static const size_t chunk_items = 65536;
+
+  AnnoyIndexInterface<S, T>* _index;
+  int _f;
+  const char* _data;
+  size_t _record_size;
+  S _n_items;
+  std::atomic<bool> _error;
+
+  void _copy_chunk(size_t c) {
+    // The values follow the dimension of every record, aligned for floats
+    S first_item = (S)(c * chunk_items);
+    S n = std::min((S)chunk_items, _n_items - first_item);
+    bool error = false;
+    for (S i = 0; i < n && !error; i++) {
+      const char* record = _data + (size_t)(first_item + i) * _record_size;
+      int32_t f;
+      memcpy(&f, record, sizeof(f));
+      if (f != _f) {
+        showUpdate("Item %d of the input has dimension %d, expected %d\n", first_item + i, f, _f);
+        error = true;
+      } else if (!_index->add_item(first_item + i, (const T*)(record + sizeof(int32_t)))) {
+        error = true;
+      }
+    }
+    if (error)
+      _error = true;
+  }
+};
+
+#endif
+// vim: tabstop=2 shiftwidth=2
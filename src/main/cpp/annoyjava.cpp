@@ -13,8 +13,20 @@
 // limitations under the License.
 
 #include "annoylib.h"
+#include "annoyinput.h"
 #include "kissrandom.h"
 
+static int copyToBuffers(const vector<int32_t> &resultV, const vector<float> &distancesV,
+                         int **result, float **distances) {
+  // malloc'ed so that freeBuffer can release them; at least one byte so
+  // that an empty result isn't NULL
+  *result = (int *)malloc(std::max<size_t>(resultV.size() * sizeof(int), 1));
+  *distances = (float *)malloc(std::max<size_t>(distancesV.size() * sizeof(float), 1));
+  std::copy(resultV.begin(), resultV.end(), *result);
+  std::copy(distancesV.begin(), distancesV.end(), *distances);
+  return (int)resultV.size();
+}
+
 extern "C" {
 AnnoyIndexInterface<int32_t, float> *createAngular(int f) {
   return new AnnoyIndex<int32_t, float, Angular, Kiss64Random>(f);
@@ -32,6 +44,30 @@ AnnoyIndexInterface<int32_t, float> *createHamming(int f) {
   return new HammingWrapper<Kiss64Random>(f);
 }
 
+AnnoyIndexInterface<int32_t, float> *createAngularF16(int f) {
+  return new AnnoyIndex<int32_t, float, Angular, Kiss64Random, Float16>(f);
+}
+
+AnnoyIndexInterface<int32_t, float> *createEuclideanF16(int f) {
+  return new AnnoyIndex<int32_t, float, Euclidean, Kiss64Random, Float16>(f);
+}
+
+AnnoyIndexInterface<int32_t, float> *createManhattanF16(int f) {
+  return new AnnoyIndex<int32_t, float, Manhattan, Kiss64Random, Float16>(f);
+}
+
+AnnoyIndexInterface<int32_t, float> *createAngularBF16(int f) {
+  return new AnnoyIndex<int32_t, float, Angular, Kiss64Random, BFloat16>(f);
+}
+
+AnnoyIndexInterface<int32_t, float> *createEuclideanBF16(int f) {
+  return new AnnoyIndex<int32_t, float, Euclidean, Kiss64Random, BFloat16>(f);
+}
+
+AnnoyIndexInterface<int32_t, float> *createManhattanBF16(int f) {
+  return new AnnoyIndex<int32_t, float, Manhattan, Kiss64Random, BFloat16>(f);
+}
+
 void deleteIndex(AnnoyIndexInterface<int32_t, float> *ptr) {
   delete ptr;
 }
@@ -40,12 +76,55 @@ void addItem(AnnoyIndexInterface<int32_t, float> *ptr, int item, float *w) {
   ptr->add_item(item, w);
 }
 
-void build(AnnoyIndexInterface<int32_t, float> *ptr, int q) {
-  ptr->build(q);
+bool addItems(AnnoyIndexInterface<int32_t, float> *ptr, int start_item, int n, float *w) {
+  return ptr->add_items(start_item, n, w);
+}
+
+int textInputDimension(char *filename) {
+  return text_input_dimension(filename);
+}
+
+int fvecsInputDimension(char *filename) {
+  return fvecs_input_dimension(filename);
+}
+
+int loadTextInput(AnnoyIndexInterface<int32_t, float> *ptr, int f, char *filename, int n_threads,
+                  char **ids, int64_t *ids_size) {
+  // The ids are returned newline-separated in a buffer to be released with freeBuffer
+  std::string ids_string;
+  TextInputLoader<int32_t, float> loader(ptr, f);
+  int n = loader.load(filename, n_threads, &ids_string);
+  *ids = (char *)malloc(ids_string.size() + 1);
+  memcpy(*ids, ids_string.c_str(), ids_string.size() + 1);
+  *ids_size = (int64_t)ids_string.size();
+  return n;
+}
+
+int loadFvecsInput(AnnoyIndexInterface<int32_t, float> *ptr, int f, char *filename, int n_threads) {
+  FvecsInputLoader<int32_t, float> loader(ptr, f);
+  return loader.load(filename, n_threads);
+}
+
+void freeBuffer(void *buffer) {
+  free(buffer);
+}
+
+bool onDiskBuild(AnnoyIndexInterface<int32_t, float> *ptr, char *filename, char **error) {
+  // On failure error is set to a message, to free with freeBuffer
+  return ptr->on_disk_build(filename, error);
+}
+
+bool onDiskUpdate(AnnoyIndexInterface<int32_t, float> *ptr, char *filename) {
+  return ptr->on_disk_update(filename);
+}
+
+bool build(AnnoyIndexInterface<int32_t, float> *ptr, int q, int n_threads) {
+  return ptr->build(q, n_threads);
 }
 
-bool save(AnnoyIndexInterface<int32_t, float> *ptr, char *filename) {
-  return ptr->save(filename);
+bool save(AnnoyIndexInterface<int32_t, float> *ptr, char *filename, char **error) {
+  // On failure error is set to a message, to free with freeBuffer
+  return ptr->save(filename, false, error);
 }
 
 void unload(AnnoyIndexInterface<int32_t, float> *ptr) {
@@ -56,26 +135,194 @@ bool load(AnnoyIndexInterface<int32_t, float> *ptr, char *filename) {
   return ptr->load(filename);
 }
 
+bool verify(AnnoyIndexInterface<int32_t, float> *ptr) {
+  return ptr->verify();
+}
+
+bool saveAligned(AnnoyIndexInterface<int32_t, float> *ptr, char *filename) {
+  return ptr->save_aligned(filename);
+}
+
+bool indexHeader(char *filename, int *dimension, char *metric, char *vectorType) {
+  // Describes an index file from its header, metric and vectorType need 16
+  // bytes. Files of earlier versions have no header.
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return false;
+  IndexHeader header;
+  bool found = read_index_header(fd, &header);
+  close(fd);
+  if (!found)
+    return false;
+  *dimension = header.dimension;
+  memcpy(metric, header.metric, sizeof(header.metric));
+  metric[sizeof(header.metric) - 1] = 0;
+  memcpy(vectorType, header.vector_type, sizeof(header.vector_type));
+  vectorType[sizeof(header.vector_type) - 1] = 0;
+  return true;
+}
+
+bool deleteItem(AnnoyIndexInterface<int32_t, float> *ptr, int item) {
+  return ptr->delete_item(item);
+}
+
+int getNDeleted(AnnoyIndexInterface<int32_t, float> *ptr) {
+  return ptr->get_n_deleted();
+}
+
+bool compact(AnnoyIndexInterface<int32_t, float> *ptr) {
+  return ptr->compact();
+}
+
+bool saveDeleted(AnnoyIndexInterface<int32_t, float> *ptr, char *filename) {
+  return ptr->save_deleted(filename);
+}
+
+bool loadDeleted(AnnoyIndexInterface<int32_t, float> *ptr, char *filename) {
+  return ptr->load_deleted(filename);
+}
+
 float getDistance(AnnoyIndexInterface<int32_t, float> *ptr, int i, int j) {
   return ptr->get_distance(i, j);
 }
 
 void getNnsByItem(AnnoyIndexInterface<int32_t, float> *ptr, int item, int n,
                   int search_k, int *result, float *distances) {
-  vector<int32_t> resultV;
-  vector<float> distancesV;
-  ptr->get_nns_by_item(item, n, search_k, &resultV, &distancesV);
-  std::copy(resultV.begin(), resultV.end(), result);
-  std::copy(distancesV.begin(), distancesV.end(), distances);
+  // The slots past the results are left as they are
+  ptr->get_nns_by_item_into(item, n, search_k, result, distances);
 }
 
 void getNnsByVector(AnnoyIndexInterface<int32_t, float> *ptr, float *w, int n,
                     int search_k, int *result, float *distances) {
-  vector<int32_t> resultV;
-  vector<float> distancesV;
-  ptr->get_nns_by_vector(w, n, search_k, &resultV, &distancesV);
+  ptr->get_nns_by_vector_into(w, n, search_k, result, distances);
+}
+
+int getNnsByItemInto(AnnoyIndexInterface<int32_t, float> *ptr, int item, int n, int search_k,
+                     int *result, float *distances) {
+  // Writes straight into the caller's buffers and returns the number of results
+  return (int)ptr->get_nns_by_item_into(item, n, search_k, result, distances);
+}
+
+int getNnsByVectorInto(AnnoyIndexInterface<int32_t, float> *ptr, float *w, int n, int search_k,
+                       int *result, float *distances) {
+  return (int)ptr->get_nns_by_vector_into(w, n, search_k, result, distances);
+}
+
+bool getNnsByItemLimited(AnnoyIndexInterface<int32_t, float> *ptr, int item, int n, int search_k,
+                         int64_t timeout_us, int max_distances, int *result, float *distances) {
+  // Returns whether the timeout or the distance budget stopped the search early
+  static thread_local vector<int32_t> resultV;
+  static thread_local vector<float> distancesV;
+  resultV.clear();
+  distancesV.clear();
+  bool stopped = ptr->get_nns_by_item_limited(item, n, search_k, timeout_us, max_distances, &resultV, &distancesV);
+  std::copy(resultV.begin(), resultV.end(), result);
+  std::copy(distancesV.begin(), distancesV.end(), distances);
+  return stopped;
+}
+
+bool getNnsByVectorLimited(AnnoyIndexInterface<int32_t, float> *ptr, float *w, int n, int search_k,
+                           int64_t timeout_us, int max_distances, int *result, float *distances) {
+  static thread_local vector<int32_t> resultV;
+  static thread_local vector<float> distancesV;
+  resultV.clear();
+  distancesV.clear();
+  bool stopped = ptr->get_nns_by_vector_limited(w, n, search_k, timeout_us, max_distances, &resultV, &distancesV);
   std::copy(resultV.begin(), resultV.end(), result);
   std::copy(distancesV.begin(), distancesV.end(), distances);
+  return stopped;
+}
+
+void getNnsByItemFiltered(AnnoyIndexInterface<int32_t, float> *ptr, int item, int n, int search_k,
+                          int64_t *filter, int filter_words, int filter_marked, bool allow,
+                          int *result, float *distances) {
+  // filter is a bitmap over the items, an allowlist or a denylist, with filter_marked bits set
+  static thread_local vector<int32_t> resultV;
+  static thread_local vector<float> distancesV;
+  resultV.clear();
+  distancesV.clear();
+  ptr->get_nns_by_item_filtered(item, n, search_k, ItemFilter((const uint64_t *)filter, filter_words, allow, filter_marked),
+                                &resultV, &distancesV);
+  std::copy(resultV.begin(), resultV.end(), result);
+  std::copy(distancesV.begin(), distancesV.end(), distances);
+}
+
+void getNnsByVectorFiltered(AnnoyIndexInterface<int32_t, float> *ptr, float *w, int n, int search_k,
+                            int64_t *filter, int filter_words, int filter_marked, bool allow,
+                            int *result, float *distances) {
+  static thread_local vector<int32_t> resultV;
+  static thread_local vector<float> distancesV;
+  resultV.clear();
+  distancesV.clear();
+  ptr->get_nns_by_vector_filtered(w, n, search_k, ItemFilter((const uint64_t *)filter, filter_words, allow, filter_marked),
+                                  &resultV, &distancesV);
+  std::copy(resultV.begin(), resultV.end(), result);
+  std::copy(distancesV.begin(), distancesV.end(), distances);
+}
+
+int getNnsByItemRadius(AnnoyIndexInterface<int32_t, float> *ptr, int item, float radius, int search_k,
+                       int **result, float **distances) {
+  // Returns the number of items found, in buffers to be released with freeBuffer
+  static thread_local vector<int32_t> resultV;
+  static thread_local vector<float> distancesV;
+  resultV.clear();
+  distancesV.clear();
+  ptr->get_nns_by_item_radius(item, radius, search_k, &resultV, &distancesV);
+  return copyToBuffers(resultV, distancesV, result, distances);
+}
+
+int getNnsByVectorRadius(AnnoyIndexInterface<int32_t, float> *ptr, float *w, float radius, int search_k,
+                         int **result, float **distances) {
+  static thread_local vector<int32_t> resultV;
+  static thread_local vector<float> distancesV;
+  resultV.clear();
+  distancesV.clear();
+  ptr->get_nns_by_vector_radius(w, radius, search_k, &resultV, &distancesV);
+  return copyToBuffers(resultV, distancesV, result, distances);
+}
+
+void getNnsByItemBatch(AnnoyIndexInterface<int32_t, float> *ptr, int *items, int nq, int n,
+                       int search_k, int *results, float *distances, int threads) {
+  ptr->get_nns_by_items(items, nq, n, search_k, results, distances, threads);
+}
+
+void getNnsByVectorBatch(AnnoyIndexInterface<int32_t, float> *ptr, float *queries, int nq, int n,
+                         int search_k, int *results, float *distances, int threads) {
+  ptr->get_nns_by_vectors(queries, nq, n, search_k, results, distances, threads);
+}
+
+bool quantize(AnnoyIndexInterface<int32_t, float> *ptr, int rerank_multiple) {
+  return ptr->quantize(rerank_multiple);
+}
+
+bool pqQuantize(AnnoyIndexInterface<int32_t, float> *ptr, int n_subvectors, int rerank_multiple, int n_threads) {
+  return ptr->pq_quantize(n_subvectors, rerank_multiple, n_threads);
+}
+
+bool savePq(AnnoyIndexInterface<int32_t, float> *ptr, char *filename) {
+  return ptr->save_pq(filename);
+}
+
+bool loadPq(AnnoyIndexInterface<int32_t, float> *ptr, char *filename) {
+  return ptr->load_pq(filename);
+}
+
+void unquantize(AnnoyIndexInterface<int32_t, float> *ptr) {
+  ptr->unquantize();
+}
+
+void setResultCacheSize(AnnoyIndexInterface<int32_t, float> *ptr, int max_entries) {
+  ptr->set_result_cache_size(max_entries);
+}
+
+void getResultCacheStats(AnnoyIndexInterface<int32_t, float> *ptr, int64_t *stats) {
+  // Hits, misses and entries
+  uint64_t hits, misses;
+  size_t entries;
+  ptr->get_result_cache_stats(&hits, &misses, &entries);
+  stats[0] = (int64_t)hits;
+  stats[1] = (int64_t)misses;
+  stats[2] = (int64_t)entries;
 }
 
 int getNItems(AnnoyIndexInterface<int32_t, float> *ptr) {
@@ -86,6 +333,14 @@ void verbose(AnnoyIndexInterface<int32_t, float> *ptr, bool v) {
   ptr->verbose(v);
 }
 
+void setTreeOrder(AnnoyIndexInterface<int32_t, float> *ptr, int order) {
+  ptr->set_tree_order((TreeOrder)order);
+}
+
+void setLeafSize(AnnoyIndexInterface<int32_t, float> *ptr, int leafSize) {
+  ptr->set_leaf_size(leafSize);
+}
+
 void getItem(AnnoyIndexInterface<int32_t, float> *ptr, int item, float *v) {
   ptr->get_item(item, v);
 }
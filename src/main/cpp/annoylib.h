@@ -26,6 +26,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <assert.h>
 #include "kissrandom.h"
 
 #if defined(_MSC_VER) && _MSC_VER == 1500
@@ -59,6 +60,17 @@ typedef signed __int64    int64_t;
 #include <algorithm>
 #include <queue>
 #include <limits>
+#include <deque>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <type_traits>
 
 #ifdef _MSC_VER
 // Needed for Visual Studio to disable runtime checks for mempcy
@@ -144,6 +156,197 @@ inline void* remap_memory(void* _ptr, int _fd, size_t old_size, size_t new_size)
   return _ptr;
 }
 
+class WorkStealingPool {
+  /*
+   * Fork-join pool used for building trees and answering batches of queries.
+   * Every worker owns a deque of tasks:
+   * it pushes and pops its own work at the back, and workers that run out of
+   * work steal from the front of the other deques, which is where the oldest
+   * (and therefore largest) subtrees are. Threads outside the pool, such as
+   * the one that creates it, work as worker 0, so a pool of n_threads starts
+   * n_threads - 1 threads. Several threads can share a pool this way, and any
+   * of them waiting for a task keeps running other tasks.
+   */
+public:
+  class Task {
+  public:
+    explicit Task(const std::function<void()>& fn) : _fn(fn), _done(false) {}
+    bool done() const { return _done.load(std::memory_order_acquire); }
+  private:
+    friend class WorkStealingPool;
+    std::function<void()> _fn;
+    std::atomic<bool> _done;
+  };
+
+  explicit WorkStealingPool(int n_threads) : _queues(std::max(1, n_threads)), _stop(false), _n_queued(0) {
+    for (size_t i = 1; i < _queues.size(); i++)
+      _threads.push_back(std::thread(&WorkStealingPool::_work, this, i));
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(_idle_mutex);
+      _stop = true;
+    }
+    _idle.notify_all();
+    for (size_t i = 0; i < _threads.size(); i++)
+      _threads[i].join();
+  }
+
+  size_t size() const {
+    return _queues.size();
+  }
+
+  void spawn(Task* task) {
+    Queue& queue = _queues[_own_index()];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(task);
+    }
+    _n_queued++;
+    {
+      std::lock_guard<std::mutex> lock(_idle_mutex);
+    }
+    _idle.notify_one();
+  }
+
+  void wait(Task* task) {
+    size_t index = _own_index();
+    while (!task->done()) {
+      Task* other = _take(index);
+      if (other)
+        _run(other);
+      else
+        std::this_thread::yield();
+    }
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task*> tasks;
+  };
+
+  vector<Queue> _queues;
+  vector<std::thread> _threads;
+  bool _stop;
+  std::atomic<int> _n_queued;
+  std::mutex _idle_mutex;
+  std::condition_variable _idle;
+
+  static WorkStealingPool*& _current_pool() {
+    static thread_local WorkStealingPool* pool = NULL;
+    return pool;
+  }
+
+  static size_t& _current_index() {
+    static thread_local size_t index = 0;
+    return index;
+  }
+
+  size_t _own_index() const {
+    return _current_pool() == this ? _current_index() : 0;
+  }
+
+  Task* _take(size_t index) {
+    for (size_t k = 0; k < _queues.size(); k++) {
+      Queue& queue = _queues[(index + k) % _queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty())
+        continue;
+      Task* task;
+      if (k == 0) {
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+      } else {
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+      }
+      _n_queued--;
+      return task;
+    }
+    return NULL;
+  }
+
+  void _run(Task* task) {
+    task->_fn();
+    task->_done.store(true, std::memory_order_release);
+  }
+
+  void _work(size_t index) {
+    _current_pool() = this;
+    _current_index() = index;
+    while (1) {
+      Task* task = _take(index);
+      if (task) {
+        _run(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(_idle_mutex);
+      _idle.wait(lock, [this]() { return _stop || _n_queued > 0; });
+      if (_stop)
+        return;
+    }
+  }
+};
+
+class ReadWriteLock {
+  /*
+   * Lets in any number of readers, or a single writer. A reader only changes
+   * an atomic counter unless a writer holds or waits for the lock, so
+   * readers don't contend on a mutex. A waiting writer goes first: readers
+   * that come after it wait until it is done.
+   */
+public:
+  ReadWriteLock() : _readers(0), _writer(false) {}
+
+  void lock_shared() {
+    while (1) {
+      _readers.fetch_add(1);
+      if (!_writer.load())
+        return;
+      unlock_shared();
+      std::unique_lock<std::mutex> lock(_mutex);
+      _changed.wait(lock, [this]() { return !_writer.load(); });
+    }
+  }
+
+  void unlock_shared() {
+    if (_readers.fetch_sub(1) == 1 && _writer.load()) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _changed.notify_all();
+    }
+  }
+
+  void lock() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _changed.wait(lock, [this]() { return !_writer.load(); });
+    _writer = true;
+    _changed.wait(lock, [this]() { return _readers.load() == 0; });
+  }
+
+  void unlock() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _writer = false;
+    _changed.notify_all();
+  }
+
+private:
+  std::atomic<int> _readers;
+  std::atomic<bool> _writer;
+  std::mutex _mutex;
+  std::condition_variable _changed;
+};
+
+class SharedLock {
+  // Holds a ReadWriteLock as a reader for its lifetime, as std::lock_guard does as a writer
+public:
+  explicit SharedLock(ReadWriteLock& lock) : _lock(lock) { _lock.lock_shared(); }
+  ~SharedLock() { _lock.unlock_shared(); }
+private:
+  ReadWriteLock& _lock;
+};
+
 namespace {
 
 template<typename S, typename Node>
@@ -151,6 +354,14 @@ inline Node* get_node_ptr(const void* _nodes, const size_t _s, const S i) {
   return (Node*)((uint8_t *)_nodes + (_s * i));
 }
 
+inline void prefetch_node(const void* node, size_t s) {
+  // Starts loading the s bytes of a node into the cache without waiting for them
+#ifdef __GNUC__
+  for (size_t offset = 0; offset < s; offset += 64)
+    __builtin_prefetch((const uint8_t*)node + offset);
+#endif
+}
+
 template<typename T>
 inline T dot(const T* x, const T* y, int f) {
   T s = 0;
@@ -341,282 +552,887 @@ inline float euclidean_distance<float>(const float* x, const float* y, int f) {
 #endif
 
 
-template<typename T>
-inline T get_norm(T* v, int f) {
-  return sqrt(dot(v, v, f));
+// 16-bit floats to store vectors in, at half the size of floats: IEEE 754 half
+// precision, and bfloat16, the top half of a float. They turn into floats when
+// read, and the distance functions below sum them as floats.
+inline uint16_t float_to_float16_bits(float x) {
+  uint32_t b;
+  memcpy(&b, &x, sizeof(b));
+  uint32_t sign = (b >> 16) & 0x8000, a = b & 0x7fffffff;
+  if (a >= 0x7f800000)
+    return sign | 0x7c00 | (a > 0x7f800000 ? 0x200 : 0); // Infinity or NaN
+  if (a >= 0x477ff000)
+    return sign | 0x7c00; // Rounds to more than 65504
+  uint32_t h, rest, tie;
+  if (a >= 0x38800000) {
+    h = (a - 0x38000000) >> 13;
+    rest = a & 0x1fff;
+    tie = 0x1000;
+  } else if (a >= 0x33000000) {
+    // Subnormal
+    uint32_t shift = 126 - (a >> 23), m = (a & 0x7fffff) | 0x800000;
+    h = m >> shift;
+    rest = m & ((1u << shift) - 1);
+    tie = 1u << (shift - 1);
+  } else {
+    return sign;
+  }
+  if (rest > tie || (rest == tie && (h & 1)))
+    h++; // To nearest, ties to even. A carry into the exponent is right.
+  return sign | h;
 }
 
-template<typename T, typename Random, typename Distance, typename Node>
-inline void two_means(const vector<Node*>& nodes, int f, Random& random, bool cosine, Node* p, Node* q) {
-  /*
-    This algorithm is a huge heuristic. Empirically it works really well, but I
-    can't motivate it well. The basic idea is to keep two centroids and assign
-    points to either one of them. We weight each centroid by the number of points
-    assigned to it, so to balance it.
-  */
-  static int iteration_steps = 200;
-  size_t count = nodes.size();
+inline float float16_bits_to_float(uint16_t h) {
+  // Moves the exponent and mantissa into place and rebiases the exponent with a
+  // multiply, which also normalizes subnormals. No branches, so loops over it
+  // vectorize.
+  uint32_t b = (uint32_t)(h & 0x7fff) << 13;
+  float x, scale = 5.192296858534828e33f; // 2^112
+  memcpy(&x, &b, sizeof(x));
+  x *= scale;
+  memcpy(&b, &x, sizeof(b));
+  if (x >= 65536.0f)
+    b |= 0x7f800000; // Infinity or NaN
+  b |= (uint32_t)(h & 0x8000) << 16;
+  memcpy(&x, &b, sizeof(x));
+  return x;
+}
 
-  size_t i = random.index(count);
-  size_t j = random.index(count-1);
-  j += (j >= i); // ensure that i != j
+struct ANNOY_NODE_ATTRIBUTE Float16 {
+  uint16_t bits;
+  Float16() {}
+  Float16(float x) : bits(float_to_float16_bits(x)) {}
+  operator float() const { return float16_bits_to_float(bits); }
+};
 
-  Distance::template copy_node<T, Node>(p, nodes[i], f);
-  Distance::template copy_node<T, Node>(q, nodes[j], f);
+struct ANNOY_NODE_ATTRIBUTE BFloat16 {
+  uint16_t bits;
+  BFloat16() {}
+  BFloat16(float x) {
+    uint32_t b;
+    memcpy(&b, &x, sizeof(b));
+    if ((b & 0x7fffffff) > 0x7f800000)
+      bits = (uint16_t)((b >> 16) | 0x40); // Keeps NaN a NaN
+    else
+      bits = (uint16_t)((b + 0x7fff + ((b >> 16) & 1)) >> 16); // To nearest, ties to even
+  }
+  operator float() const {
+    uint32_t b = (uint32_t)bits << 16;
+    float x;
+    memcpy(&x, &b, sizeof(x));
+    return x;
+  }
+};
 
-  if (cosine) { Distance::template normalize<T, Node>(p, f); Distance::template normalize<T, Node>(q, f); }
-  Distance::init_node(p, f);
-  Distance::init_node(q, f);
+// Whether the finite value x overflows to infinity when stored as a V
+template<typename V>
+inline bool overflows(float) {
+  return false;
+}
 
-  int ic = 1, jc = 1;
-  for (int l = 0; l < iteration_steps; l++) {
-    size_t k = random.index(count);
-    T di = ic * Distance::distance(p, nodes[k], f),
-      dj = jc * Distance::distance(q, nodes[k], f);
-    T norm = cosine ? get_norm(nodes[k]->v, f) : 1;
-    if (!(norm > T(0))) {
-      continue;
+template<>
+inline bool overflows<Float16>(float x) {
+  return fabsf(x) >= 65520.0f && fabsf(x) < numeric_limits<float>::infinity(); // Rounds to more than 65504
+}
+
+#if defined(USE_AVX512)
+inline __m512 load16_ps(const float* x) {
+  return _mm512_loadu_ps(x);
+}
+
+inline __m512 load16_ps(const Float16* x) {
+  return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)x));
+}
+
+inline __m512 load16_ps(const BFloat16* x) {
+  return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)x)), 16));
+}
+#elif defined(USE_AVX) && defined(__AVX2__) && defined(__F16C__)
+inline __m256 load8_ps(const float* x) {
+  return _mm256_loadu_ps(x);
+}
+
+inline __m256 load8_ps(const Float16* x) {
+  return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)x));
+}
+
+inline __m256 load8_ps(const BFloat16* x) {
+  return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)x)), 16));
+}
+#endif
+
+// Without the instructions above, converts 16 at a time into floats first, in
+// a loop that vectorizes, rather than one by one in the sum
+template<typename X>
+inline const float* widen16(const X* x, float* buffer) {
+  for (int z = 0; z < 16; z++)
+    buffer[z] = x[z];
+  return buffer;
+}
+
+inline const float* widen16(const float* x, float*) {
+  return x;
+}
+
+// The distance functions for vectors of 16-bit floats, or one of those and
+// one of floats
+template<typename X, typename Y>
+inline float widened_dot(const X* x, const Y* y, int f) {
+  float result = 0;
+#if defined(USE_AVX512)
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      d = _mm512_fmadd_ps(load16_ps(x), load16_ps(y), d);
+      x += 16;
+      y += 16;
     }
-    if (di < dj) {
-      for (int z = 0; z < f; z++)
-        p->v[z] = (p->v[z] * ic + nodes[k]->v[z] / norm) / (ic + 1);
-      Distance::init_node(p, f);
-      ic++;
-    } else if (dj < di) {
-      for (int z = 0; z < f; z++)
-        q->v[z] = (q->v[z] * jc + nodes[k]->v[z] / norm) / (jc + 1);
-      Distance::init_node(q, f);
-      jc++;
+    result = _mm512_reduce_add_ps(d);
+  }
+#elif defined(USE_AVX) && defined(__AVX2__) && defined(__F16C__)
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      d = _mm256_add_ps(d, _mm256_mul_ps(load8_ps(x), load8_ps(y)));
+      x += 8;
+      y += 8;
     }
+    result = hsum256_ps_avx(d);
+  }
+#else
+  float xs[16], ys[16];
+  for (; f > 15; f -= 16) {
+    const float* xw = widen16(x, xs);
+    const float* yw = widen16(y, ys);
+    for (int z = 0; z < 16; z++)
+      result += xw[z] * yw[z];
+    x += 16;
+    y += 16;
   }
+#endif
+  for (; f > 0; f--)
+    result += (float)*x++ * (float)*y++;
+  return result;
 }
-} // namespace
 
-struct Base {
-  template<typename T, typename S, typename Node>
-  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
-    // Override this in specific metric structs below if you need to do any pre-processing
-    // on the entire set of nodes passed into this index.
+template<typename X, typename Y>
+inline float widened_manhattan_distance(const X* x, const Y* y, int f) {
+  float result = 0;
+#if defined(USE_AVX512)
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      d = _mm512_add_ps(d, _mm512_abs_ps(_mm512_sub_ps(load16_ps(x), load16_ps(y))));
+      x += 16;
+      y += 16;
+    }
+    result = _mm512_reduce_add_ps(d);
   }
-
-  template<typename Node>
-  static inline void zero_value(Node* dest) {
-    // Initialize any fields that require sane defaults within this node.
+#elif defined(USE_AVX) && defined(__AVX2__) && defined(__F16C__)
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    const __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    for (; f > 7; f -= 8) {
+      d = _mm256_add_ps(d, _mm256_andnot_ps(minus_zero, _mm256_sub_ps(load8_ps(x), load8_ps(y))));
+      x += 8;
+      y += 8;
+    }
+    result = hsum256_ps_avx(d);
   }
-
-  template<typename T, typename Node>
-  static inline void copy_node(Node* dest, const Node* source, const int f) {
-    memcpy(dest->v, source->v, f * sizeof(T));
+#else
+  float xs[16], ys[16];
+  for (; f > 15; f -= 16) {
+    const float* xw = widen16(x, xs);
+    const float* yw = widen16(y, ys);
+    for (int z = 0; z < 16; z++)
+      result += fabsf(xw[z] - yw[z]);
+    x += 16;
+    y += 16;
   }
+#endif
+  for (; f > 0; f--)
+    result += fabsf((float)*x++ - (float)*y++);
+  return result;
+}
 
-  template<typename T, typename Node>
-  static inline void normalize(Node* node, int f) {
-    T norm = get_norm(node->v, f);
-    if (norm > 0) {
-      for (int z = 0; z < f; z++)
-        node->v[z] /= norm;
+template<typename X, typename Y>
+inline float widened_euclidean_distance(const X* x, const Y* y, int f) {
+  float result = 0;
+#if defined(USE_AVX512)
+  if (f > 15) {
+    __m512 d = _mm512_setzero_ps();
+    for (; f > 15; f -= 16) {
+      const __m512 diff = _mm512_sub_ps(load16_ps(x), load16_ps(y));
+      d = _mm512_fmadd_ps(diff, diff, d);
+      x += 16;
+      y += 16;
     }
+    result = _mm512_reduce_add_ps(d);
   }
-};
-
-struct Angular : Base {
-  template<typename S, typename T>
-  struct ANNOY_NODE_ATTRIBUTE Node {
-    /*
-     * We store a binary tree where each node has two things
-     * - A vector associated with it
-     * - Two children
-     * All nodes occupy the same amount of memory
-     * All nodes with n_descendants == 1 are leaf nodes.
-     * A memory optimization is that for nodes with 2 <= n_descendants <= K,
-     * we skip the vector. Instead we store a list of all descendants. K is
-     * determined by the number of items that fits in the space of the vector.
-     * For nodes with n_descendants == 1 the vector is a data point.
-     * For nodes with n_descendants > K the vector is the normal of the split plane.
-     * Note that we can't really do sizeof(node<T>) because we cheat and allocate
-     * more memory to be able to fit the vector outside
-     */
-    S n_descendants;
-    union {
-      S children[2]; // Will possibly store more than 2
-      T norm;
-    };
-    T v[1]; // We let this one overflow intentionally. Need to allocate at least 1 to make GCC happy
-  };
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    // want to calculate (a/|a| - b/|b|)^2
-    // = a^2 / a^2 + b^2 / b^2 - 2ab/|a||b|
-    // = 2 - 2cos
-    T pp = x->norm ? x->norm : dot(x->v, x->v, f); // For backwards compatibility reasons, we need to fall back and compute the norm here
-    T qq = y->norm ? y->norm : dot(y->v, y->v, f);
-    T pq = dot(x->v, y->v, f);
-    T ppqq = pp * qq;
-    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
-    else return 2.0; // cos is 0
-  }
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return dot(n->v, y, f);
+#elif defined(USE_AVX) && defined(__AVX2__) && defined(__F16C__)
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      const __m256 diff = _mm256_sub_ps(load8_ps(x), load8_ps(y));
+      d = _mm256_add_ps(d, _mm256_mul_ps(diff, diff));
+      x += 8;
+      y += 8;
+    }
+    result = hsum256_ps_avx(d);
   }
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
-    if (dot != 0)
-      return (dot > 0);
-    else
-      return (bool)random.flip();
+#else
+  float xs[16], ys[16];
+  for (; f > 15; f -= 16) {
+    const float* xw = widen16(x, xs);
+    const float* yw = widen16(y, ys);
+    for (int z = 0; z < 16; z++)
+      result += (xw[z] - yw[z]) * (xw[z] - yw[z]);
+    x += 16;
+    y += 16;
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Angular, Node<S, T> >(nodes, f, random, true, p, q);
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
+#endif
+  for (; f > 0; f--) {
+    float tmp = (float)*x++ - (float)*y++;
+    result += tmp * tmp;
   }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    // Used when requesting distances from Python layer
-    // Turns out sometimes the squared distance is -0.0
-    // so we have to make sure it's a positive number.
-    return sqrt(std::max(distance, T(0)));
+  return result;
+}
+
+inline float dot(const Float16* x, const Float16* y, int f) {
+  return widened_dot(x, y, f);
+}
+
+inline float dot(const Float16* x, const float* y, int f) {
+  return widened_dot(x, y, f);
+}
+
+inline float manhattan_distance(const Float16* x, const Float16* y, int f) {
+  return widened_manhattan_distance(x, y, f);
+}
+
+inline float euclidean_distance(const Float16* x, const Float16* y, int f) {
+  return widened_euclidean_distance(x, y, f);
+}
+
+inline float dot(const BFloat16* x, const BFloat16* y, int f) {
+  return widened_dot(x, y, f);
+}
+
+inline float dot(const BFloat16* x, const float* y, int f) {
+  return widened_dot(x, y, f);
+}
+
+inline float manhattan_distance(const BFloat16* x, const BFloat16* y, int f) {
+  return widened_manhattan_distance(x, y, f);
+}
+
+inline float euclidean_distance(const BFloat16* x, const BFloat16* y, int f) {
+  return widened_euclidean_distance(x, y, f);
+}
+
+// From a query kept as float to a stored vector
+inline float dot(const float* x, const Float16* y, int f) {
+  return widened_dot(x, y, f);
+}
+
+inline float manhattan_distance(const float* x, const Float16* y, int f) {
+  return widened_manhattan_distance(x, y, f);
+}
+
+inline float euclidean_distance(const float* x, const Float16* y, int f) {
+  return widened_euclidean_distance(x, y, f);
+}
+
+inline float dot(const float* x, const BFloat16* y, int f) {
+  return widened_dot(x, y, f);
+}
+
+inline float manhattan_distance(const float* x, const BFloat16* y, int f) {
+  return widened_manhattan_distance(x, y, f);
+}
+
+inline float euclidean_distance(const float* x, const BFloat16* y, int f) {
+  return widened_euclidean_distance(x, y, f);
+}
+
+template<typename T>
+inline void copy_vector(T* dest, const T* source, int f) {
+  memcpy(dest, source, f * sizeof(T));
+}
+
+template<typename V, typename T>
+inline void copy_vector(V* dest, const T* source, int f) {
+  // Into a vector of another type, such as one of 16-bit floats
+  for (int z = 0; z < f; z++)
+    dest[z] = source[z];
+}
+
+// The vector and the children of a node, got from offsets rather than by
+// taking the address of a member of the packed node, which GCC warns about.
+// Nodes are aligned and their fields are all S and T, so these are aligned.
+template<typename Node>
+inline auto node_vector(Node* n) -> decltype(&n->v[0]) {
+  return (decltype(&n->v[0]))((const char*)n + offsetof(typename std::remove_const<Node>::type, v));
+}
+
+template<typename Node>
+inline auto node_children(Node* n) -> decltype(&n->children[0]) {
+  return (decltype(&n->children[0]))((const char*)n + offsetof(typename std::remove_const<Node>::type, children));
+}
+
+// Distances to int8 codes. A code c stands for the vector whose z-th
+// component is offset[z] + scale[z] * c[z]. The offsets are taken out of the
+// query beforehand: x is the query minus the offsets, or the query times the
+// scales for the dot product.
+template<typename T>
+inline T quantized_dot(const T* x, const int8_t* c, int f) {
+  T d = 0;
+  for (int z = 0; z < f; z++)
+    d += x[z] * c[z];
+  return d;
+}
+
+template<typename T>
+inline T quantized_manhattan_distance(const T* x, const T* scale, const int8_t* c, int f) {
+  T d = 0;
+  for (int z = 0; z < f; z++)
+    d += fabs(x[z] - scale[z] * c[z]);
+  return d;
+}
+
+template<typename T>
+inline T quantized_euclidean_distance(const T* x, const T* scale, const int8_t* c, int f) {
+  T d = 0;
+  for (int z = 0; z < f; z++) {
+    const T tmp = x[z] - scale[z] * c[z];
+    d += tmp * tmp;
   }
-  template<typename T>
-  static inline T pq_distance(T distance, T margin, int child_nr) {
-    if (child_nr == 0)
-      margin = -margin;
-    return std::min(distance, margin);
+  return d;
+}
+
+#if (defined(USE_AVX) && defined(__AVX2__)) || defined(USE_AVX512)
+// Eight int8 codes as floats
+inline __m256 load_codes256_ps(const int8_t* c) {
+  return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)c)));
+}
+
+inline float hsum256_codes_ps(__m256 v) {
+  const __m128 x128 = _mm_add_ps(_mm256_extractf128_ps(v, 1), _mm256_castps256_ps128(v));
+  const __m128 x64 = _mm_add_ps(x128, _mm_movehl_ps(x128, x128));
+  const __m128 x32 = _mm_add_ss(x64, _mm_shuffle_ps(x64, x64, 0x55));
+  return _mm_cvtss_f32(x32);
+}
+
+template<>
+inline float quantized_dot<float>(const float* x, const int8_t* c, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_loadu_ps(x), load_codes256_ps(c)));
+      x += 8;
+      c += 8;
+    }
+    result = hsum256_codes_ps(d);
   }
-  template<typename T>
-  static inline T pq_initial_value() {
-    return numeric_limits<T>::infinity();
+  for (; f > 0; f--)
+    result += *x++ * *c++;
+  return result;
+}
+
+template<>
+inline float quantized_manhattan_distance<float>(const float* x, const float* scale, const int8_t* c, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    __m256 minus_zero = _mm256_set1_ps(-0.0f);
+    for (; f > 7; f -= 8) {
+      const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), _mm256_mul_ps(_mm256_loadu_ps(scale), load_codes256_ps(c)));
+      d = _mm256_add_ps(d, _mm256_andnot_ps(minus_zero, diff));
+      x += 8;
+      scale += 8;
+      c += 8;
+    }
+    result = hsum256_codes_ps(d);
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
-    n->norm = dot(n->v, n->v, f);
+  for (; f > 0; f--)
+    result += fabsf(*x++ - *scale++ * *c++);
+  return result;
+}
+
+template<>
+inline float quantized_euclidean_distance<float>(const float* x, const float* scale, const int8_t* c, int f) {
+  float result = 0;
+  if (f > 7) {
+    __m256 d = _mm256_setzero_ps();
+    for (; f > 7; f -= 8) {
+      const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), _mm256_mul_ps(_mm256_loadu_ps(scale), load_codes256_ps(c)));
+      d = _mm256_add_ps(d, _mm256_mul_ps(diff, diff));
+      x += 8;
+      scale += 8;
+      c += 8;
+    }
+    result = hsum256_codes_ps(d);
   }
-  static const char* name() {
-    return "angular";
+  for (; f > 0; f--) {
+    float tmp = *x++ - *scale++ * *c++;
+    result += tmp * tmp;
   }
-};
+  return result;
+}
+#endif
 
 
-struct DotProduct : Angular {
-  template<typename S, typename T>
-  struct ANNOY_NODE_ATTRIBUTE Node {
-    /*
-     * This is an extension of the Angular node with an extra attribute for the scaled norm.
-     */
-    S n_descendants;
-    S children[2]; // Will possibly store more than 2
-    T dot_factor;
-    T v[1]; // We let this one overflow intentionally. Need to allocate at least 1 to make GCC happy
-  };
+template<typename T>
+inline auto get_norm(T* v, int f) -> decltype(dot(v, v, f)) {
+  return sqrt(dot(v, v, f));
+}
 
-  static const char* name() {
-    return "dot";
+template<typename S, typename Node>
+class IndexedNodes {
+  // The nodes at indices[0], ..., indices[n-1] of a node array, accessed like a vector<Node*>
+public:
+  IndexedNodes(const void* nodes, size_t s, const S* indices, size_t n) : _nodes(nodes), _s(s), _indices(indices), _n(n) {}
+  size_t size() const {
+    return _n;
   }
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return -dot(x->v, y->v, f);
+  Node* operator[](size_t i) const {
+    return get_node_ptr<S, Node>(_nodes, _s, _indices[i]);
   }
+private:
+  const void* _nodes;
+  size_t _s;
+  const S* _indices;
+  size_t _n;
+};
 
-  template<typename Node>
-  static inline void zero_value(Node* dest) {
-    dest->dot_factor = 0;
+template<typename T, typename Random, typename Distance, typename Node, typename Nodes>
+inline void two_means(const Nodes& nodes, int f, Random& random, bool cosine, Node* p, Node* q) {
+  /*
+    This algorithm is a huge heuristic. Empirically it works really well, but I
+    can't motivate it well. The basic idea is to keep two centroids and assign
+    points to either one of them. We weight each centroid by the number of points
+    assigned to it, so to balance it.
+  */
+  static int iteration_steps = 200;
+  size_t count = nodes.size();
+
+  size_t i = random.index(count);
+  size_t j = random.index(count-1);
+  j += (j >= i); // ensure that i != j
+
+  Distance::template copy_node<T, Node>(p, nodes[i], f);
+  Distance::template copy_node<T, Node>(q, nodes[j], f);
+
+  if (cosine) { Distance::template normalize<T, Node>(p, f); Distance::template normalize<T, Node>(q, f); }
+  Distance::init_node(p, f);
+  Distance::init_node(q, f);
+
+  int ic = 1, jc = 1;
+  for (int l = 0; l < iteration_steps; l++) {
+    size_t k = random.index(count);
+    T di = ic * Distance::distance(p, nodes[k], f),
+      dj = jc * Distance::distance(q, nodes[k], f);
+    T norm = cosine ? get_norm(nodes[k]->v, f) : 1;
+    if (!(norm > T(0))) {
+      continue;
+    }
+    if (di < dj) {
+      for (int z = 0; z < f; z++)
+        p->v[z] = (p->v[z] * ic + nodes[k]->v[z] / norm) / (ic + 1);
+      Distance::init_node(p, f);
+      ic++;
+    } else if (dj < di) {
+      for (int z = 0; z < f; z++)
+        q->v[z] = (q->v[z] * jc + nodes[k]->v[z] / norm) / (jc + 1);
+      Distance::init_node(q, f);
+      jc++;
+    }
   }
+}
+} // namespace
 
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+template<typename T>
+struct QuantizedQuery {
+  // A query as the Distance::quantized_distance functions take it, see
+  // quantized_dot
+  const T* scale;
+  vector<T> shifted; // The query minus the offsets
+  vector<T> scaled; // The query times the scales
+  T offset_dot; // Dot product of the query and the offsets
+  T norm; // Squared norm of the query
+  vector<T> table; // Distance::adc_term summed over every PQ centroid, see pq_quantize
+};
+
+struct Base {
+  template<typename T, typename S, typename Node>
+  static inline void preprocess(void*, size_t, const S, const int) {
+    // Override this in specific metric structs below if you need to do any pre-processing
+    // on the entire set of nodes passed into this index.
   }
 
-  template<typename T, typename Node>
-  static inline void copy_node(Node* dest, const Node* source, const int f) {
-    memcpy(dest->v, source->v, f * sizeof(T));
-    dest->dot_factor = source->dot_factor;
+  template<typename Node>
+  static inline void zero_value(Node*) {
+    // Initialize any fields that require sane defaults within this node.
   }
 
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    DotProduct::zero_value(p);
-    DotProduct::zero_value(q);
-    two_means<T, Random, DotProduct, Node<S, T> >(nodes, f, random, true, p, q);
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    n->dot_factor = p->dot_factor - q->dot_factor;
-    DotProduct::normalize<T, Node<S, T> >(n, f);
+  template<typename T, typename Node>
+  static inline void copy_node(Node* dest, const Node* source, const int f) {
+    copy_vector(node_vector(dest), node_vector(source), f);
   }
 
   template<typename T, typename Node>
   static inline void normalize(Node* node, int f) {
-    T norm = sqrt(dot(node->v, node->v, f) + pow(node->dot_factor, 2));
+    T norm = get_norm(node->v, f);
     if (norm > 0) {
       for (int z = 0; z < f; z++)
-        node->v[z] /= norm;
-      node->dot_factor /= norm;
+        node->v[z] = node->v[z] / norm;
     }
   }
 
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
-    return dot(n->v, y, f) + (n->dot_factor * n->dot_factor);
+  template<typename Node, typename T>
+  static inline T pq_distance_bound(const Node*, T) {
+    // A lower bound on the normalized distance from the query to every item
+    // under a node queued with this priority, used to prune range queries.
+    // Override this in metrics whose splits give one.
+    return 0;
   }
 
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
-    T dot = margin(n, y, f);
-    if (dot != 0)
-      return (dot > 0);
-    else
-      return (bool)random.flip();
+  static inline bool quantizable() {
+    // Whether candidates can be scored on int8 codes with quantized_distance.
+    // Override both in metrics that support it.
+    return false;
   }
 
   template<typename T>
-  static inline T normalized_distance(T distance) {
-    return -distance;
+  static inline T quantized_distance(const QuantizedQuery<T>&, const int8_t*, T, int) {
+    return 0;
   }
 
-  template<typename T, typename S, typename Node>
-  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
-    // This uses a method from Microsoft Research for transforming inner product spaces to cosine/angular-compatible spaces.
-    // (Bachrach et al., 2014, see https://www.microsoft.com/en-us/research/wp-content/uploads/2016/02/XboxInnerProduct.pdf)
+  template<typename T>
+  static inline T adc_term(T, T) {
+    // What a dimension of the query and of a PQ centroid add to the sum that
+    // adc_distance turns into a distance. Metrics that are quantizable
+    // override both.
+    return 0;
+  }
 
-    // Step one: compute the norm of each vector and store that in its extra dimension (f-1)
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      T norm = sqrt(dot(node->v, node->v, f));
-      if (isnan(norm)) norm = 0;
-      node->dot_factor = norm;
-    }
+  template<typename T>
+  static inline T adc_distance(T sum, T, T) {
+    return sum;
+  }
 
-    // Step two: find the maximum norm
-    T max_norm = 0;
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      if (node->dot_factor > max_norm) {
-        max_norm = node->dot_factor;
-      }
-    }
+  static inline bool alignable() {
+    // Whether the index can be saved in the aligned layout, where the vectors
+    // are rows of a matrix without the rest of the nodes. Metrics that
+    // support it override the three functions below.
+    return false;
+  }
 
-    // Step three: set each vector's extra dimension to sqrt(max_norm^2 - norm^2)
-    for (S i = 0; i < node_count; i++) {
-      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
-      T node_norm = node->dot_factor;
+  template<typename T, typename Node>
+  static inline T split_aux(const Node*) {
+    // The scalar that the aligned layout keeps with a split, apart from its row
+    return 0;
+  }
 
-      T dot_factor = sqrt(pow(max_norm, static_cast<T>(2.0)) - pow(node_norm, static_cast<T>(2.0)));
-      if (isnan(dot_factor)) dot_factor = 0;
+  static inline bool aligned_norms() {
+    // Whether aligned_distance needs the squared norms of the items, which
+    // save_aligned then keeps in a section of their own
+    return false;
+  }
 
-      node->dot_factor = dot_factor;
-    }
+  template<typename Node, typename V, typename T>
+  static inline T aligned_distance(const Node*, const V*, T, int) {
+    // As distance, to the item with row v and squared norm norm, or 0 when
+    // the norms aren't kept
+    return 0;
+  }
+
+  template<typename V, typename T, typename U>
+  static inline T aligned_margin(const V*, T, const U*, int) {
+    // As margin, for the split with row v and split_aux aux
+    return 0;
   }
 };
 
-struct Hamming : Base {
-  template<typename S, typename T>
+struct Angular : Base {
+  template<typename S, typename T, typename V = T>
+  struct ANNOY_NODE_ATTRIBUTE Node {
+    /*
+     * We store a binary tree where each node has two things
+     * - A vector associated with it
+     * - Two children
+     * All nodes occupy the same amount of memory
+     * All nodes with n_descendants == 1 are leaf nodes.
+     * A memory optimization is that for nodes with 2 <= n_descendants <= K,
+     * we skip the vector. Instead we store a list of all descendants. K is
+     * determined by the number of items that fits in the space of the vector.
+     * For nodes with n_descendants == 1 the vector is a data point.
+     * For nodes with n_descendants > K the vector is the normal of the split plane.
+     * Note that we can't really do sizeof(node<T>) because we cheat and allocate
+     * more memory to be able to fit the vector outside
+     */
+    S n_descendants;
+    union {
+      S children[2]; // Will possibly store more than 2
+      T norm;
+    };
+    V v[1]; // We let this one overflow intentionally. Need to allocate at least 1 to make GCC happy
+  };
+  template<typename S, typename T, typename U, typename V>
+  static inline T distance(const Node<S, T, U>* x, const Node<S, T, V>* y, int f) {
+    // want to calculate (a/|a| - b/|b|)^2
+    // = a^2 / a^2 + b^2 / b^2 - 2ab/|a||b|
+    // = 2 - 2cos
+    T pp = x->norm ? x->norm : dot(x->v, x->v, f); // For backwards compatibility reasons, we need to fall back and compute the norm here
+    T qq = y->norm ? y->norm : dot(y->v, y->v, f);
+    T pq = dot(x->v, y->v, f);
+    T ppqq = pp * qq;
+    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
+    else return 2.0; // cos is 0
+  }
+  template<typename S, typename T, typename V, typename U>
+  static inline T margin(const Node<S, T, V>* n, const U* y, int f) {
+    return dot(n->v, y, f);
+  }
+  template<typename S, typename T, typename V, typename U, typename Random>
+  static inline bool side(const Node<S, T, V>* n, const U* y, int f, Random& random) {
+    T dot = margin(n, y, f);
+    if (dot != 0)
+      return (dot > 0);
+    else
+      return (bool)random.flip();
+  }
+  template<typename S, typename T, typename V, typename Nodes, typename Random>
+  static inline void create_split(const Nodes& nodes, int f, size_t s, Random& random, Node<S, T, V>* n) {
+    Node<S, T, V>* p = (Node<S, T, V>*)alloca(s);
+    Node<S, T, V>* q = (Node<S, T, V>*)alloca(s);
+    two_means<T, Random, Angular, Node<S, T, V>, Nodes>(nodes, f, random, true, p, q);
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T, V> >(n, f);
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    // Used when requesting distances from Python layer
+    // Turns out sometimes the squared distance is -0.0
+    // so we have to make sure it's a positive number.
+    return sqrt(std::max(distance, T(0)));
+  }
+  template<typename T>
+  static inline T pq_distance(T distance, T margin, int child_nr) {
+    if (child_nr == 0)
+      margin = -margin;
+    return std::min(distance, margin);
+  }
+  template<typename T>
+  static inline T pq_initial_value() {
+    return numeric_limits<T>::infinity();
+  }
+  static inline bool quantizable() {
+    return true;
+  }
+  template<typename T>
+  static inline T quantized_distance(const QuantizedQuery<T>& query, const int8_t* code, T code_norm, int f) {
+    // As distance, with code_norm the squared norm of the vector the code stands for
+    T pq = query.offset_dot + quantized_dot(&query.scaled[0], code, f);
+    T ppqq = query.norm * code_norm;
+    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
+    else return 2.0;
+  }
+  template<typename T>
+  static inline T adc_term(T x, T centroid) {
+    return x * centroid;
+  }
+  template<typename T>
+  static inline T adc_distance(T sum, T query_norm, T code_norm) {
+    T ppqq = query_norm * code_norm;
+    if (ppqq > 0) return 2.0 - 2.0 * sum / sqrt(ppqq);
+    else return 2.0;
+  }
+  template<typename S, typename T, typename V>
+  static inline T pq_distance_bound(const Node<S, T, V>* query, T pq_distance) {
+    // The split planes go through the origin and have unit normals, so a
+    // query at margin -pq_distance from one is at an angle of at least
+    // asin(-pq_distance / |query|) from every item on its other side.
+    if (!(pq_distance < 0) || !(query->norm > 0))
+      return 0;
+    T sin_angle = std::min(-pq_distance / sqrt(query->norm), T(1));
+    return sqrt(std::max(T(2) - T(2) * sqrt(T(1) - sin_angle * sin_angle), T(0)));
+  }
+  static inline bool alignable() {
+    return true;
+  }
+  static inline bool aligned_norms() {
+    return true;
+  }
+  template<typename S, typename T, typename U, typename V>
+  static inline T aligned_distance(const Node<S, T, U>* query, const V* v, T norm, int f) {
+    // Files saved without the norms are scored on the norm of the row,
+    // which is the one init_node stored
+    T pp = query->norm ? query->norm : dot(node_vector(query), node_vector(query), f);
+    T qq = norm ? norm : dot(v, v, f);
+    T pq = dot(node_vector(query), v, f);
+    T ppqq = pp * qq;
+    if (ppqq > 0) return 2.0 - 2.0 * pq / sqrt(ppqq);
+    else return 2.0;
+  }
+  template<typename V, typename T, typename U>
+  static inline T aligned_margin(const V* v, T, const U* y, int f) {
+    return dot(v, y, f);
+  }
+  template<typename S, typename T, typename V>
+  static inline void init_node(Node<S, T, V>* n, int f) {
+    n->norm = dot(n->v, n->v, f);
+  }
+  static const char* name() {
+    return "angular";
+  }
+};
+
+
+struct DotProduct : Angular {
+  template<typename S, typename T, typename V = T>
+  struct ANNOY_NODE_ATTRIBUTE Node {
+    /*
+     * This is an extension of the Angular node with an extra attribute for the scaled norm.
+     */
+    S n_descendants;
+    S children[2]; // Will possibly store more than 2
+    T dot_factor;
+    V v[1]; // We let this one overflow intentionally. Need to allocate at least 1 to make GCC happy
+  };
+
+  static const char* name() {
+    return "dot";
+  }
+  template<typename S, typename T, typename U, typename V>
+  static inline T distance(const Node<S, T, U>* x, const Node<S, T, V>* y, int f) {
+    return -dot(x->v, y->v, f);
+  }
+
+  template<typename Node>
+  static inline void zero_value(Node* dest) {
+    dest->dot_factor = 0;
+  }
+
+  template<typename S, typename T, typename V>
+  static inline void init_node(Node<S, T, V>* n, int f) {
+  }
+
+  template<typename T, typename Node>
+  static inline void copy_node(Node* dest, const Node* source, const int f) {
+    copy_vector(dest->v, source->v, f);
+    dest->dot_factor = source->dot_factor;
+  }
+
+  template<typename S, typename T, typename V, typename Nodes, typename Random>
+  static inline void create_split(const Nodes& nodes, int f, size_t s, Random& random, Node<S, T, V>* n) {
+    Node<S, T, V>* p = (Node<S, T, V>*)alloca(s);
+    Node<S, T, V>* q = (Node<S, T, V>*)alloca(s);
+    DotProduct::zero_value(p);
+    DotProduct::zero_value(q);
+    two_means<T, Random, DotProduct, Node<S, T, V>, Nodes>(nodes, f, random, true, p, q);
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    n->dot_factor = p->dot_factor - q->dot_factor;
+    DotProduct::normalize<T, Node<S, T, V> >(n, f);
+  }
+
+  template<typename T, typename Node>
+  static inline void normalize(Node* node, int f) {
+    T norm = sqrt(dot(node->v, node->v, f) + pow(node->dot_factor, 2));
+    if (norm > 0) {
+      for (int z = 0; z < f; z++)
+        node->v[z] = node->v[z] / norm;
+      node->dot_factor /= norm;
+    }
+  }
+
+  template<typename S, typename T, typename V, typename U>
+  static inline T margin(const Node<S, T, V>* n, const U* y, int f) {
+    return dot(n->v, y, f) + (n->dot_factor * n->dot_factor);
+  }
+
+  template<typename S, typename T, typename V, typename U, typename Random>
+  static inline bool side(const Node<S, T, V>* n, const U* y, int f, Random& random) {
+    T dot = margin(n, y, f);
+    if (dot != 0)
+      return (dot > 0);
+    else
+      return (bool)random.flip();
+  }
+
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return -distance;
+  }
+
+  template<typename S, typename T, typename V>
+  static inline T pq_distance_bound(const Node<S, T, V>* query, T pq_distance) {
+    return 0;
+  }
+
+  static inline bool quantizable() {
+    return false;
+  }
+
+  template<typename T, typename S, typename V>
+  static inline T split_aux(const Node<S, T, V>* split) {
+    return split->dot_factor;
+  }
+
+  static inline bool aligned_norms() {
+    return false;
+  }
+
+  template<typename S, typename T, typename U, typename V>
+  static inline T aligned_distance(const Node<S, T, U>* query, const V* v, T, int f) {
+    return -dot(query->v, v, f);
+  }
+
+  template<typename V, typename T, typename U>
+  static inline T aligned_margin(const V* v, T aux, const U* y, int f) {
+    return dot(v, y, f) + (aux * aux);
+  }
+
+  template<typename T, typename S, typename Node>
+  static inline void preprocess(void* nodes, size_t _s, const S node_count, const int f) {
+    // This uses a method from Microsoft Research for transforming inner product spaces to cosine/angular-compatible spaces.
+    // (Bachrach et al., 2014, see https://www.microsoft.com/en-us/research/wp-content/uploads/2016/02/XboxInnerProduct.pdf)
+
+    // Step one: compute the norm of each vector and store that in its extra dimension (f-1)
+    for (S i = 0; i < node_count; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      T norm = sqrt(dot(node->v, node->v, f));
+      if (isnan(norm)) norm = 0;
+      node->dot_factor = norm;
+    }
+
+    // Step two: find the maximum norm
+    T max_norm = 0;
+    for (S i = 0; i < node_count; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      if (node->dot_factor > max_norm) {
+        max_norm = node->dot_factor;
+      }
+    }
+
+    // Step three: set each vector's extra dimension to sqrt(max_norm^2 - norm^2)
+    for (S i = 0; i < node_count; i++) {
+      Node* node = get_node_ptr<S, Node>(nodes, _s, i);
+      T node_norm = node->dot_factor;
+
+      T dot_factor = sqrt(pow(max_norm, static_cast<T>(2.0)) - pow(node_norm, static_cast<T>(2.0)));
+      if (isnan(dot_factor)) dot_factor = 0;
+
+      node->dot_factor = dot_factor;
+    }
+  }
+};
+
+struct Hamming : Base {
+  template<typename S, typename T, typename V = T> // Vectors are always stored as T
   struct ANNOY_NODE_ATTRIBUTE Node {
     S n_descendants;
     S children[2];
@@ -663,8 +1479,8 @@ struct Hamming : Base {
   static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
     return margin(n, y, f);
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
+  template<typename S, typename T, typename Nodes, typename Random>
+  static inline void create_split(const Nodes& nodes, int f, size_t, Random& random, Node<S, T>* n) {
     size_t cur_size = 0;
     size_t i = 0;
     int dim = f * 8 * sizeof(T);
@@ -672,8 +1488,8 @@ struct Hamming : Base {
       // choose random position to split at
       n->v[0] = random.index(dim);
       cur_size = 0;
-      for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
-        if (margin(n, (*it)->v, f)) {
+      for (size_t k = 0; k < nodes.size(); k++) {
+        if (margin(n, node_vector(nodes[k]), f)) {
           cur_size++;
         }
       }
@@ -687,8 +1503,8 @@ struct Hamming : Base {
       for (; j < dim; j++) {
         n->v[0] = j;
         cur_size = 0;
-        for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
-          if (margin(n, (*it)->v, f)) {
+        for (size_t k = 0; k < nodes.size(); k++) {
+          if (margin(n, node_vector(nodes[k]), f)) {
             cur_size++;
           }
         }
@@ -712,19 +1528,23 @@ struct Hamming : Base {
 
 
 struct Minkowski : Base {
-  template<typename S, typename T>
+  template<typename S, typename T, typename V = T>
   struct ANNOY_NODE_ATTRIBUTE Node {
     S n_descendants;
     T a; // need an extra constant term to determine the offset of the plane
     S children[2];
-    T v[1];
+    V v[1];
   };
-  template<typename S, typename T>
-  static inline T margin(const Node<S, T>* n, const T* y, int f) {
+  template<typename S, typename T, typename V, typename U>
+  static inline T margin(const Node<S, T, V>* n, const U* y, int f) {
     return n->a + dot(n->v, y, f);
   }
-  template<typename S, typename T, typename Random>
-  static inline bool side(const Node<S, T>* n, const T* y, int f, Random& random) {
+  template<typename Node>
+  static inline void zero_value(Node* dest) {
+    dest->a = 0;
+  }
+  template<typename S, typename T, typename V, typename U, typename Random>
+  static inline bool side(const Node<S, T, V>* n, const U* y, int f, Random& random) {
     T dot = margin(n, y, f);
     if (dot != 0)
       return (dot > 0);
@@ -741,574 +1561,3563 @@ struct Minkowski : Base {
   static inline T pq_initial_value() {
     return numeric_limits<T>::infinity();
   }
+  template<typename Node, typename T>
+  static inline T pq_distance_bound(const Node*, T pq_distance) {
+    // The split planes have unit normals, so the margin is the distance to
+    // the plane, and neither the Euclidean nor the Manhattan distance to an
+    // item on its other side can be smaller
+    return std::max(-pq_distance, T(0));
+  }
+  template<typename T, typename S, typename V>
+  static inline T split_aux(const Node<S, T, V>* split) {
+    return split->a;
+  }
+  template<typename V, typename T, typename U>
+  static inline T aligned_margin(const V* v, T aux, const U* y, int f) {
+    return aux + dot(v, y, f);
+  }
+};
+
+
+struct Euclidean : Minkowski {
+  template<typename S, typename T, typename U, typename V>
+  static inline T distance(const Node<S, T, U>* x, const Node<S, T, V>* y, int f) {
+    return euclidean_distance(x->v, y->v, f);
+  }
+  static inline bool quantizable() {
+    return true;
+  }
+  static inline bool alignable() {
+    return true;
+  }
+  template<typename S, typename T, typename U, typename V>
+  static inline T aligned_distance(const Node<S, T, U>* query, const V* v, T, int f) {
+    return euclidean_distance(node_vector(query), v, f);
+  }
+  template<typename T>
+  static inline T quantized_distance(const QuantizedQuery<T>& query, const int8_t* code, T, int f) {
+    return quantized_euclidean_distance(&query.shifted[0], query.scale, code, f);
+  }
+  template<typename T>
+  static inline T adc_term(T x, T centroid) {
+    return (x - centroid) * (x - centroid);
+  }
+  template<typename S, typename T, typename V, typename Nodes, typename Random>
+  static inline void create_split(const Nodes& nodes, int f, size_t s, Random& random, Node<S, T, V>* n) {
+    Node<S, T, V>* p = (Node<S, T, V>*)alloca(s);
+    Node<S, T, V>* q = (Node<S, T, V>*)alloca(s);
+    two_means<T, Random, Euclidean, Node<S, T, V>, Nodes>(nodes, f, random, false, p, q);
+
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T, V> >(n, f);
+    n->a = 0.0;
+    for (int z = 0; z < f; z++)
+      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return sqrt(std::max(distance, T(0)));
+  }
+  template<typename S, typename T, typename V>
+  static inline void init_node(Node<S, T, V>*, int) {
+  }
+  static const char* name() {
+    return "euclidean";
+  }
+
 };
 
+struct Manhattan : Minkowski {
+  template<typename S, typename T, typename U, typename V>
+  static inline T distance(const Node<S, T, U>* x, const Node<S, T, V>* y, int f) {
+    return manhattan_distance(x->v, y->v, f);
+  }
+  static inline bool quantizable() {
+    return true;
+  }
+  static inline bool alignable() {
+    return true;
+  }
+  template<typename S, typename T, typename U, typename V>
+  static inline T aligned_distance(const Node<S, T, U>* query, const V* v, T, int f) {
+    return manhattan_distance(node_vector(query), v, f);
+  }
+  template<typename T>
+  static inline T quantized_distance(const QuantizedQuery<T>& query, const int8_t* code, T, int f) {
+    return quantized_manhattan_distance(&query.shifted[0], query.scale, code, f);
+  }
+  template<typename T>
+  static inline T adc_term(T x, T centroid) {
+    return fabs(x - centroid);
+  }
+  template<typename S, typename T, typename V, typename Nodes, typename Random>
+  static inline void create_split(const Nodes& nodes, int f, size_t s, Random& random, Node<S, T, V>* n) {
+    Node<S, T, V>* p = (Node<S, T, V>*)alloca(s);
+    Node<S, T, V>* q = (Node<S, T, V>*)alloca(s);
+    two_means<T, Random, Manhattan, Node<S, T, V>, Nodes>(nodes, f, random, false, p, q);
+
+    for (int z = 0; z < f; z++)
+      n->v[z] = p->v[z] - q->v[z];
+    Base::normalize<T, Node<S, T, V> >(n, f);
+    n->a = 0.0;
+    for (int z = 0; z < f; z++)
+      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  }
+  template<typename T>
+  static inline T normalized_distance(T distance) {
+    return std::max(distance, T(0));
+  }
+  template<typename S, typename T, typename V>
+  static inline void init_node(Node<S, T, V>*, int) {
+  }
+  static const char* name() {
+    return "manhattan";
+  }
+};
+
+struct AtomicWord {
+  // A word of a bitmap whose bits are set while queries read it. Copies,
+  // which a vector makes as it grows, are only made while nothing else
+  // reads or writes the bitmap.
+  std::atomic<uint64_t> bits;
+  AtomicWord(uint64_t b=0) : bits(b) {}
+  AtomicWord(const AtomicWord& w) : bits(w.bits.load(std::memory_order_relaxed)) {}
+  AtomicWord& operator=(const AtomicWord& w) {
+    bits.store(w.bits.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return *this;
+  }
+};
+
+class ItemFilter {
+  // A bitmap over item ids that queries keep their results to. Item i is
+  // marked by bit i % 64 of words[i / 64], and ids past the bitmap are
+  // unmarked. An allowlist lets only the marked items through, a denylist
+  // all the others. The bitmap is not copied, and marks are expected only
+  // below the number of items.
+public:
+  ItemFilter(const uint64_t* words, size_t n_words, bool allow) : _words(words), _n_words(n_words), _allow(allow) {
+    _n_marked = 0;
+    for (size_t w = 0; w < n_words; w++)
+      _n_marked += popcount(words[w]);
+  }
+
+  // For callers that keep the bitmap across queries and counted its marks once
+  ItemFilter(const uint64_t* words, size_t n_words, bool allow, size_t n_marked) :
+    _words(words), _n_words(n_words), _allow(allow), _n_marked(n_marked) {}
+
+  template<typename S>
+  bool passes(S item) const {
+    size_t w = (size_t)item / 64;
+    bool marked = w < _n_words && (_words[w] >> (item % 64)) & 1;
+    return marked == _allow;
+  }
+
+  bool allow() const {
+    return _allow;
+  }
+
+  const uint64_t* words() const {
+    return _words;
+  }
+
+  size_t n_words(size_t n_items) const {
+    return std::min(_n_words, (n_items + 63) / 64);
+  }
+
+  size_t count(size_t n_items) const {
+    // Number of items below n_items that pass
+    size_t n_marked = std::min(_n_marked, n_items);
+    return _allow ? n_marked : n_items - n_marked;
+  }
+
+private:
+  const uint64_t* _words;
+  size_t _n_words;
+  bool _allow;
+  size_t _n_marked;
+};
+
+template<typename S, typename T>
+class ResultCache {
+  // The results of item queries, keyed by (item, n, search_k). Only the
+  // max_entries most recently used are kept, and none while max_entries is 0.
+  // Safe to use from several threads: a result is only inserted if the cache
+  // wasn't cleared since the generation taken before computing it, and
+  // changes to the results clear it once they are done.
+public:
+  ResultCache() : _max_entries(0), _generation(0), _hits(0), _misses(0) {}
+
+  bool enabled() const {
+    return _max_entries > 0;
+  }
+
+  void resize(size_t max_entries) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _max_entries = max_entries;
+    _evict();
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries.clear();
+    _positions.clear();
+    _generation++;
+  }
+
+  uint64_t generation() const {
+    return _generation;
+  }
+
+  class ClearOnExit {
+    // Clears the cache once the change to the results in its scope is done,
+    // so that nothing computed before or during the change stays cached
+  public:
+    ClearOnExit(ResultCache& cache) : _cache(cache) {}
+    ~ClearOnExit() {
+      _cache.clear();
+    }
+
+  private:
+    ResultCache& _cache;
+  };
+
+  template<typename Copy>
+  bool lookup(S item, size_t n, size_t search_k, const Copy& copy) {
+    // Calls copy(result, distances) and returns true if the query is cached
+    std::lock_guard<std::mutex> lock(_mutex);
+    typename Positions::iterator it = _positions.find(Key(item, n, search_k));
+    if (it == _positions.end()) {
+      _misses++;
+      return false;
+    }
+    _hits++;
+    _entries.splice(_entries.begin(), _entries, it->second);
+    copy(it->second->result, it->second->distances);
+    return true;
+  }
+
+  void insert(S item, size_t n, size_t search_k, uint64_t generation, const vector<S>& result, const vector<T>& distances) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    Key key(item, n, search_k);
+    if (_max_entries == 0 || generation != _generation || _positions.count(key))
+      return;
+    _entries.push_front(Entry());
+    _entries.front().key = key;
+    _entries.front().result = result;
+    _entries.front().distances = distances;
+    _positions[key] = _entries.begin();
+    _evict();
+  }
+
+  void get_stats(uint64_t* hits, uint64_t* misses, size_t* entries) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    *hits = _hits;
+    *misses = _misses;
+    *entries = _entries.size();
+  }
+
+private:
+  struct Key {
+    S item;
+    size_t n;
+    size_t search_k;
+    Key() : item(0), n(0), search_k(0) {}
+    Key(S item, size_t n, size_t search_k) : item(item), n(n), search_k(search_k) {}
+    bool operator==(const Key& other) const {
+      return item == other.item && n == other.n && search_k == other.search_k;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      size_t h = std::hash<S>()(key.item);
+      h = h * 31 + std::hash<size_t>()(key.n);
+      return h * 31 + std::hash<size_t>()(key.search_k);
+    }
+  };
+  struct Entry {
+    Key key;
+    vector<S> result;
+    vector<T> distances;
+  };
+  typedef std::list<Entry> Entries;
+  typedef std::unordered_map<Key, typename Entries::iterator, KeyHash> Positions;
+
+  void _evict() {
+    while (_entries.size() > _max_entries) {
+      _positions.erase(_entries.back().key);
+      _entries.pop_back();
+    }
+  }
+
+  mutable std::mutex _mutex;
+  std::atomic<size_t> _max_entries;
+  std::atomic<uint64_t> _generation; // Bumped by every clear
+  Entries _entries; // Most recently used first
+  Positions _positions;
+  uint64_t _hits;
+  uint64_t _misses;
+};
+
+// Index files start with an IndexHeader, padded to index_header_bytes, then
+// hold the nodes, then the sections the header lists, such as the roots of
+// the trees. Readers skip the sections they don't know, so adding one doesn't
+// need a new version; the version only changes when older readers can't use
+// the file any more. Files without the header are the plain array of nodes of
+// earlier versions, which load() still reads.
+//
+// Files in the aligned layout (version 2, see save_aligned) have no nodes
+// after the header. Their vectors and the rest of the nodes are in sections
+// instead, every one starting at a multiple of index_alignment bytes.
+//
+// Files whose leaves hold another number of items than fits in a node, or
+// in the aligned layout with packed leaves, are version 3, see set_leaf_size.
+const char index_magic[8] = {'A', 'N', 'N', 'O', 'Y', 'I', 'D', 'X'};
+const uint32_t index_version = 3; // The newest this reads, files in the node layout are still version 1
+const uint32_t index_version_nodes = 1;
+const uint32_t index_version_aligned = 2;
+const uint32_t index_version_leaves = 3;
+const uint32_t index_layout_nodes = 0;
+const uint32_t index_layout_aligned = 1;
+const size_t index_header_bytes = 4096;
+const size_t index_max_sections = 32;
+const size_t index_alignment = 64;
+const uint32_t index_section_roots = 1; // The roots of the trees, as S
+const uint32_t index_section_item_rows = 2; // The vectors of the items, as rows of V padded to index_alignment bytes
+const uint32_t index_section_item_bitmap = 3; // Bit i % 64 of word i / 64 (uint64) is set if item i has a vector
+const uint32_t index_section_tree_nodes = 4; // A LayoutNode for every node after the items
+const uint32_t index_section_split_rows = 5; // The split planes, as rows like the items
+const uint32_t index_section_leaf_items = 6; // The items of all the leaves, as S
+const uint32_t index_section_leaf_gaps = 7; // The gaps between the sorted items of packed leaves, as uint16
+const uint32_t index_section_item_norms = 8; // The squared norms of the items, as T, empty unless D::aligned_norms
+
+struct IndexSection {
+  uint32_t tag;
+  uint32_t reserved;
+  uint64_t offset; // From the start of the file
+  uint64_t size; // In bytes
+};
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_bytes; // Where the nodes start
+  char metric[16]; // D::name()
+  char vector_type[16]; // See vector_type_name
+  uint32_t index_bytes; // sizeof(S)
+  uint32_t node_bytes;
+  int32_t f;
+  int32_t dimension; // Of the vectors added, which is f unless they are packed, see HammingWrapper
+  uint64_t n_items;
+  uint64_t n_nodes;
+  uint64_t n_trees;
+  uint64_t checksum; // Of the nodes and the sections, see checksum64, 0 for none
+  uint32_t n_sections;
+  uint32_t layout; // index_layout_nodes or index_layout_aligned
+  IndexSection sections[index_max_sections];
+  uint32_t leaf_size; // The most items of a leaf, 0 for as many as fit in a node
+  uint32_t reserved;
+};
+
+template<typename S, typename T>
+struct LayoutNode {
+  // A tree node of the aligned layout. Nodes with more than K descendants
+  // split on row offset of the split planes, with D::split_aux aux, the
+  // others are leaves holding the n_descendants items from offset on in the
+  // leaf items. Packed leaves, with children[0] set, hold their first item in
+  // children[1] and the n_descendants - 1 gaps up to the next ones from
+  // offset on in the leaf gaps.
+  S n_descendants;
+  S children[2];
+  S offset;
+  T aux;
+};
+
+template<typename V>
+inline const char* vector_type_name() {
+  return ""; // Not checked on load
+}
+
+template<>
+inline const char* vector_type_name<float>() {
+  return "float32";
+}
+
+template<>
+inline const char* vector_type_name<double>() {
+  return "float64";
+}
+
+template<>
+inline const char* vector_type_name<Float16>() {
+  return "float16";
+}
+
+template<>
+inline const char* vector_type_name<BFloat16>() {
+  return "bfloat16";
+}
+
+template<>
+inline const char* vector_type_name<uint64_t>() {
+  return "uint64";
+}
+
+inline uint64_t checksum64(const void* data, size_t size, uint64_t h = 0xcbf29ce484222325ULL) {
+  // FNV-1a over 64-bit words rather than bytes, which is fast enough to go
+  // over a whole index when it is saved. A changed word always changes it.
+  const unsigned char* p = (const unsigned char*)data;
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    h = (h ^ word) * 0x100000001b3ULL;
+  }
+  for (; size > 0; size--, p++)
+    h = (h ^ *p) * 0x100000001b3ULL;
+  return h;
+}
+
+inline bool read_index_header(int fd, IndexHeader* header) {
+  // Whether the file starts with a header, which is then in *header
+  return lseek(fd, 0, SEEK_SET) == 0 &&
+    read(fd, header, sizeof(IndexHeader)) == (int)sizeof(IndexHeader) &&
+    memcmp(header->magic, index_magic, sizeof(index_magic)) == 0;
+}
+
+// How build numbers the nodes of every tree, see AnnoyIndex::set_tree_order
+enum TreeOrder {
+  tree_order_post = 0, // Children before their parent, the smaller child first, as in earlier versions
+  tree_order_bfs = 1, // Level by level from the root
+  tree_order_blocked = 2 // The top levels of every subtree in page-sized blocks, see _blocked_order
+};
+
+template<typename S, typename T>
+class AnnoyIndexInterface {
+ public:
+  // Note that the methods with an **error argument will allocate memory and write the pointer to that string if error is non-NULL
+  virtual ~AnnoyIndexInterface() {};
+  virtual bool add_item(S item, const T* w, char** error=NULL) = 0;
+  virtual bool add_items(S first_item, S n, const T* w, char** error=NULL) = 0;
+  virtual bool reserve_items(S n, char** error=NULL) = 0;
+  virtual bool build(int q, int n_threads=1, char** error=NULL) = 0;
+  virtual bool unbuild(char** error=NULL) = 0;
+  virtual bool save(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  virtual void unload() = 0;
+  virtual bool load(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  virtual bool verify(char** error=NULL) const = 0;
+  virtual bool save_aligned(const char* filename, char** error=NULL) const = 0;
+  virtual T get_distance(S i, S j) const = 0;
+  virtual void get_nns_by_item(S item, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const = 0;
+  virtual void get_nns_by_vector(const T* w, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const = 0;
+  virtual bool get_nns_by_item_limited(S item, size_t n, size_t search_k, int64_t timeout_us, size_t max_distances,
+                                       vector<S>* result, vector<T>* distances) const = 0;
+  virtual bool get_nns_by_vector_limited(const T* w, size_t n, size_t search_k, int64_t timeout_us, size_t max_distances,
+                                         vector<S>* result, vector<T>* distances) const = 0;
+  virtual void get_nns_by_item_filtered(S item, size_t n, size_t search_k, const ItemFilter& filter,
+                                        vector<S>* result, vector<T>* distances) const = 0;
+  virtual void get_nns_by_vector_filtered(const T* w, size_t n, size_t search_k, const ItemFilter& filter,
+                                          vector<S>* result, vector<T>* distances) const = 0;
+  virtual size_t get_nns_by_item_into(S item, size_t n, size_t search_k, S* result, T* distances) const = 0;
+  virtual size_t get_nns_by_vector_into(const T* w, size_t n, size_t search_k, S* result, T* distances) const = 0;
+  virtual void get_nns_by_item_radius(S item, T radius, size_t search_k, vector<S>* result, vector<T>* distances) const = 0;
+  virtual void get_nns_by_vector_radius(const T* w, T radius, size_t search_k, vector<S>* result, vector<T>* distances) const = 0;
+  virtual void get_nns_by_items(const S* items, size_t n_queries, size_t n, size_t search_k, S* result, T* distances, int n_threads=1) const = 0;
+  virtual void get_nns_by_vectors(const T* w, size_t n_queries, size_t n, size_t search_k, S* result, T* distances, int n_threads=1) const = 0;
+  virtual S get_n_items() const = 0;
+  virtual S get_n_trees() const = 0;
+  virtual void verbose(bool v) = 0;
+  virtual void get_item(S item, T* v) const = 0;
+  virtual void set_seed(int q) = 0;
+  virtual void set_tree_order(TreeOrder order) = 0;
+  virtual void set_leaf_size(S leaf_size) = 0;
+  virtual bool on_disk_build(const char* filename, char** error=NULL) = 0;
+  virtual bool on_disk_update(const char* filename, char** error=NULL) = 0;
+  virtual bool delete_item(S item, char** error=NULL) = 0;
+  virtual bool is_deleted(S item) const = 0;
+  virtual S get_n_deleted() const = 0;
+  virtual bool compact(char** error=NULL) = 0;
+  virtual bool save_deleted(const char* filename, char** error=NULL) const = 0;
+  virtual bool load_deleted(const char* filename, char** error=NULL) = 0;
+  virtual void set_result_cache_size(size_t max_entries) = 0;
+  virtual void get_result_cache_stats(uint64_t* hits, uint64_t* misses, size_t* entries) const = 0;
+  virtual bool quantize(size_t rerank_multiple=4, char** error=NULL) = 0;
+  virtual bool pq_quantize(size_t n_subvectors, size_t rerank_multiple=4, int n_threads=1, char** error=NULL) = 0;
+  virtual bool save_pq(const char* filename, char** error=NULL) const = 0;
+  virtual bool load_pq(const char* filename, char** error=NULL) = 0;
+  virtual void unquantize() = 0;
+};
+
+template<typename S, typename T, typename Distance, typename Random, typename V = T>
+  class AnnoyIndex : public AnnoyIndexInterface<S, T> {
+  /*
+   * We use random projection to build a forest of binary trees of all items.
+   * Basically just split the hyperspace into two sides by a hyperplane,
+   * then recursively split each of those subtrees etc.
+   * We create a tree like this q times. The default q is determined automatically
+   * in such a way that we at most use 2x as much memory as the vectors take.
+   * Vectors are stored as V, which may be a Float16 or BFloat16 to halve the
+   * index, and everything computed from them is a T.
+   */
+public:
+  typedef Distance D;
+  typedef typename D::template Node<S, T, V> Node;
+  typedef typename D::template Node<S, T, T> QueryNode; // Keeps the query as T, whatever V the vectors are stored as
+  typedef typename ResultCache<S, T>::ClearOnExit ClearCacheOnExit;
+
+protected:
+  // Nodes of a single tree while it is being built. Split and leaf nodes are
+  // numbered locally so that trees can be built independently of each other
+  // and of _nodes. Parents refer to them as _n_items + local id until
+  // _layout_tree moves the whole tree into _nodes. Nodes live in fixed-size
+  // blocks that never move, so concurrent subtrees can allocate them with a
+  // single atomic increment.
+  struct TreeArena {
+    static const size_t block_bits = 10;
+    vector<std::atomic<void*> > blocks;
+    std::atomic<size_t> n_nodes;
+    explicit TreeArena(size_t n_indices) : blocks(((2 * n_indices + 2) >> block_bits) + 1), n_nodes(0) {
+      // A tree over n items has at most n leaves and n - 1 split nodes
+      for (size_t i = 0; i < blocks.size(); i++)
+        blocks[i].store(NULL);
+    }
+    ~TreeArena() {
+      for (size_t i = 0; i < blocks.size(); i++)
+        free(blocks[i].load());
+    }
+  private:
+    TreeArena(const TreeArena&);
+    TreeArena& operator=(const TreeArena&);
+  };
+
+  // A tree being built as a task of a WorkStealingPool.
+  struct TreeBuild {
+    TreeArena arena;
+    Random random;
+    S root;
+    WorkStealingPool::Task task;
+    TreeBuild(size_t n_indices, const Random& random, const std::function<void(TreeBuild*)>& make_tree)
+      : arena(n_indices), random(random), root(0), task(std::bind(make_tree, this)) {}
+  };
+
+  // Buffers of _get_all_nns. Every thread keeps one and reuses it from query
+  // to query, so queries stop allocating once it has grown to their size.
+  struct QueryScratch {
+    vector<pair<T, S> > queue; // Heap of the nodes to visit
+    vector<uint64_t> visited; // Bitset of the candidates seen, cleared through nns after every query
+    vector<S> nns; // Distinct candidates
+    vector<pair<T, S> > top; // Max-heap of the n nearest candidates
+    vector<uint64_t> query; // Node of the query vector, for interleaved queries
+    QuantizedQuery<T> quantized; // The query for scoring codes, see quantize
+    vector<S> leaf; // The items of a packed leaf, see _tree_node
+  };
+
+  // Where one of the queries answered together by _get_all_nns_interleaved
+  // stands. It first walks the trees a node per step, collecting the distinct
+  // candidates in its scratch nns, then scores them a few per step.
+  struct InterleavedQuery {
+    size_t query; // Position in the batch, (size_t)-1 for none
+    const T* v;
+    size_t n_candidates;
+    size_t n_scored;
+    bool traversing;
+  };
+
+  // Subtrees with at least this many items are built as separate tasks when
+  // building with several threads, and nodes with at least
+  // parallel_side_min_items items assign sides in chunks of
+  // parallel_side_chunk_items in parallel.
+  static const size_t parallel_subtree_min_items = 4096;
+  static const size_t parallel_side_min_items = 131072;
+  static const size_t parallel_side_chunk_items = 32768;
+
+  // An index built on disk grows its file by at least this many bytes (or by
+  // its current size, whichever is larger) at a time. build() truncates the
+  // file to its final size.
+  static const size_t on_disk_growth_bytes = (size_t) 1 << 28;
+
+  // Adding items to a built index moves the tree nodes in the way of the new
+  // item ids, which takes a pass over all tree nodes. To make that rare, the
+  // room for items grows by at least 1/64 of its size or this many items.
+  static const size_t insert_min_item_slots = 1024;
+
+  // Deleted items stay in the trees, where queries skip them, until more than
+  // 1/compaction_ratio of the items have been deleted since the last
+  // compaction. delete_item then compacts the index on a thread of its own.
+  static const size_t compaction_ratio = 10;
+
+  // Batches of queries are answered in tasks of this many queries
+  static const size_t batch_chunk_queries = 16;
+
+  // Queries with a timeout look at the clock every this many nodes and distances
+  static const size_t timeout_check_steps = 64;
+
+  // Each thread answering a batch keeps this many of its queries going at
+  // once, and scores their candidates this many at a time.
+  static const size_t interleaved_queries = 8;
+  static const size_t interleaved_score_step = 8;
+
+  // The PQ codebook of every subvector has pq_centroids centroids, trained
+  // by pq_train_iterations rounds of k-means on up to pq_train_items items.
+  // Items are trained on and coded in tasks of pq_chunk_items.
+  static const size_t pq_centroids = 256;
+  static const size_t pq_train_items = 32768;
+  static const size_t pq_train_iterations = 10;
+  static const size_t pq_chunk_items = 4096;
+
+  // save_aligned copies the rows of vectors this many at a time
+  static const size_t layout_chunk_rows = 4096;
+
+  // tree_order_blocked fills blocks of this many bytes, a page
+  static const size_t tree_block_bytes = 4096;
+
+  const int _f;
+  size_t _s;
+  size_t _query_s; // Size of a QueryNode
+  S _n_items;
+  Random _random;
+  void* _nodes; // Could either be mmapped, or point to a memory buffer that we reallocate
+  size_t _data_offset; // Where _nodes start in the mmapped file: after its header, or 0 for files without one
+  S _n_nodes;
+  S _nodes_size;
+  vector<S> _roots;
+  int _dimension; // Recorded in the header, see IndexHeader
+  bool _aligned; // Loaded from a file in the aligned layout, see save_aligned. _nodes is NULL then.
+  void* _layout_map;
+  size_t _layout_bytes;
+  const V* _layout_items; // Rows of _row_words V's, see index_section_item_rows
+  const uint64_t* _layout_item_bitmap;
+  const LayoutNode<S, T>* _layout_tree_nodes; // Tree node i at i - _n_items
+  const V* _layout_splits;
+  const S* _layout_leaf_items;
+  const uint16_t* _layout_leaf_gaps; // NULL in files without packed leaves
+  const T* _layout_item_norms; // NULL in files without them, see index_section_item_norms
+  S _n_splits;
+  size_t _n_leaf_items;
+  size_t _n_leaf_gaps;
+  size_t _row_words;
+  uint64_t _checksum; // Of the index file as saved or loaded, 0 once the trees change
+  S _K; // The most items of a leaf, splits have more descendants
+  S _leaf_size; // As set by set_leaf_size, 0 for the default
+  bool _loaded;
+  bool _verbose;
+  TreeOrder _tree_order;
+  int _fd;
+  bool _on_disk;
+  bool _built;
+  bool _updating; // The trees have been changed since the index was built or loaded
+  S _n_item_slots; // While _updating, the nodes below this are reserved for items
+  vector<S> _free_nodes; // While _updating, unused nodes among the tree nodes
+  vector<AtomicWord> _deleted; // Bitmap of the deleted items, with a bit for every item once built, see _size_deleted
+  std::atomic<S> _n_deleted;
+  std::atomic<S> _n_uncompacted; // Deleted items that are still in the trees
+  mutable ReadWriteLock _tree_lock; // Held by queries as readers, and by changes to a built index as writers
+  std::thread _compaction; // Started by delete_item, see _join_compaction
+  mutable std::mutex _query_pool_mutex;
+  mutable std::shared_ptr<WorkStealingPool> _query_pool; // See _batch_pool
+  std::atomic<bool> _compacting;
+  mutable ResultCache<S, T> _result_cache; // Cleared whenever the results have changed
+  vector<T> _codes; // Rows of _code_words: squared norm (-1 for no item) then the int8 codes, see quantize
+  size_t _code_words;
+  vector<T> _code_offset;
+  vector<T> _code_scale;
+  size_t _pq_m; // Subvectors of the PQ codes, 0 without them, see pq_quantize
+  vector<int> _pq_bounds; // Subvector k covers dimensions [_pq_bounds[k], _pq_bounds[k + 1])
+  vector<T> _pq_centroids; // Dimension z of centroid c at pq_centroids * z + c
+  vector<uint8_t> _pq_codes; // _pq_m per item
+  vector<T> _pq_norms; // Squared norm of what each code stands for, -1 for no item
+  size_t _rerank_multiple;
+public:
+
+   AnnoyIndex(int f) : _f(f), _random(), _dimension(f) {
+    _s = offsetof(Node, v) + _f * sizeof(V); // Size of each node
+    _query_s = offsetof(QueryNode, v) + _f * sizeof(T);
+    _row_words = ((size_t)_f * sizeof(V) + index_alignment - 1) / index_alignment * index_alignment / sizeof(V);
+    _verbose = false;
+    _built = false;
+    _tree_order = tree_order_post;
+    _leaf_size = 0;
+    _compacting = false;
+    reinitialize(); // Reset everything
+  }
+  ~AnnoyIndex() {
+    unload();
+  }
+
+  int get_f() const {
+    return _f;
+  }
+
+  void set_dimension(int dimension) {
+    // The dimension recorded in index files, when the vectors added are packed
+    // into fewer than f values
+    _dimension = dimension;
+  }
+
+  bool add_item(S item, const T* w, char** error=NULL) {
+    if (!_storable(w, 1, error))
+      return false;
+    return add_item_impl(item, w, error);
+  }
+
+  bool add_items(S first_item, S n, const T* w, char** error=NULL) {
+    // Adds the n row-major vectors in w as items first_item, ..., first_item + n - 1,
+    // growing the node array only once.
+    if (_loaded) {
+      set_error_from_string(error, "You can't add an item to a loaded index");
+      return false;
+    }
+    if (!_storable(w, n, error))
+      return false;
+    if (_built)
+      return _insert_items(first_item, n, w, error);
+    if (!_allocate_size(first_item + n, error))
+      return false;
+    for (S i = 0; i < n; i++) {
+      if (!add_item_impl(first_item + i, w + (size_t)i * _f, error))
+        return false;
+    }
+    return true;
+  }
+
+  bool _storable(const T* w, S n, char** error) const {
+    // Whether the n vectors in w can be stored as V without values turning
+    // into infinity
+    for (size_t z = 0; z < (size_t)n * _f; z++) {
+      if (overflows<V>(w[z])) {
+        set_error_from_string(error, "Item has a value out of the range of the vector type");
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool reserve_items(S n, char** error=NULL) {
+    // Makes room for the items below n at once, so that add_item and
+    // add_items can then be called from several threads on different items
+    // below n
+    if (_loaded || _built) {
+      set_error_from_string(error, "You can't reserve items in a built index");
+      return false;
+    }
+    if (!_allocate_size(n, error))
+      return false;
+    _n_items = std::max(_n_items, n);
+    return true;
+  }
+
+  template<typename W>
+  bool add_item_impl(S item, const W& w, char** error=NULL) {
+    if (_loaded) {
+      set_error_from_string(error, "You can't add an item to a loaded index");
+      return false;
+    }
+    if (_built)
+      return _insert_items(item, 1, &w[0], error);
+    if (!_allocate_size(item + 1, error))
+      return false;
+    _set_item(item, w);
+    return true;
+  }
+
+  template<typename W>
+  void _set_item(S item, const W& w) {
+    Node* n = _get(item);
+
+    D::zero_value(n);
+
+    n->children[0] = 0;
+    n->children[1] = 0;
+    n->n_descendants = 1;
+
+    for (int z = 0; z < _f; z++)
+      n->v[z] = w[z];
+
+    D::init_node(n, _f);
+
+    if (item >= _n_items)
+      _n_items = item + 1;
+  }
+
+  bool on_disk_build(const char* file, char** error=NULL) {
+    _fd = open(file, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
+    if (_fd == -1) {
+      set_error_from_errno(error, "Unable to open");
+      _fd = 0;
+      return false;
+    }
+    // Every failure after this closes the file again, and leaves the index
+    // in memory
+    auto fail = [&]() {
+      close(_fd);
+      _fd = 0;
+      return false;
+    };
+    if (ftruncate(_fd, index_header_bytes + _s) == -1) {
+      set_error_from_errno(error, "Unable to truncate");
+      return fail();
+    }
+    // The header is written once the trees are built, see _truncate_on_disk
+#ifdef MAP_POPULATE
+    void* mapped = mmap(0, index_header_bytes + _s, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, 0);
+#else
+    void* mapped = mmap(0, index_header_bytes + _s, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+#endif
+    if (mapped == MAP_FAILED) {
+      set_error_from_errno(error, "Unable to mmap");
+      return fail();
+    }
+    _on_disk = true;
+    _nodes_size = 1;
+    _nodes = (char*)mapped + index_header_bytes;
+    _data_offset = index_header_bytes;
+    return true;
+  }
+
+  bool on_disk_update(const char* filename, char** error=NULL) {
+    // Maps a saved index for reading and writing, so that items can be added
+    // to it in place. The file only grows at the end.
+    if (!_map_index(filename, true, false, error))
+      return false;
+    _on_disk = true;
+    _nodes_size = _n_nodes;
+    _built = true;
+    _size_deleted();
+    return true;
+  }
+
+  bool build(int q, int n_threads=1, char** error=NULL) {
+    // Trees are built one after another when n_threads is 1, which keeps the
+    // single random stream (and therefore the index) of earlier versions.
+    // With more threads, trees and large subtrees are built as tasks on a
+    // work-stealing pool. Every tree, and every subtree that could run as a
+    // task, gets its own random stream derived from _random, so the result is
+    // reproducible for a given seed whatever the number of threads.
+    // n_threads=-1 uses all available cores.
+    if (_loaded) {
+      set_error_from_string(error, "You can't build a loaded index");
+      return false;
+    }
+
+    if (_built) {
+      set_error_from_string(error, "You can't build a built index");
+      return false;
+    }
+
+    D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
+
+    _K = _leaf_size ? std::min(_leaf_size, _node_K()) : _node_K();
+    if (n_threads == -1)
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    vector<S> indices;
+    for (S i = 0; i < _n_items; i++) {
+      if (_get(i)->n_descendants >= 1 && !_is_deleted(i)) // Issue #223
+        indices.push_back(i);
+    }
+
+    _n_nodes = _n_items;
+    if (n_threads <= 1) {
+      vector<S> work;
+      while (1) {
+        if (q == -1 && _n_nodes >= _n_items * 2)
+          break;
+        if (q != -1 && _roots.size() >= (size_t)q)
+          break;
+        if (_verbose) showUpdate("pass %zd...\n", _roots.size());
+
+        TreeArena arena(indices.size());
+        S root = _layout_tree(arena, _make_root(indices, work, _random, arena, NULL), error);
+        if (root == -1)
+          return false;
+        _roots.push_back(root);
+      }
+    } else if (!_build_trees_threaded(q, n_threads, indices, error)) {
+      return false;
+    }
+
+    // Also, copy the roots into the last segment of the array
+    // This way we can load them faster without reading the whole file
+    if (!_allocate_size(_n_nodes + (S)_roots.size(), error))
+      return false;
+    for (size_t i = 0; i < _roots.size(); i++)
+      memcpy(_get(_n_nodes + (S)i), _get(_roots[i]), _s);
+    _n_nodes += _roots.size();
+
+    if (_verbose) showUpdate("has %d nodes\n", _n_nodes);
+
+    _checksum = 0;
+    if (_on_disk && !_truncate_on_disk(false, error)) {
+      // TODO: this probably creates an index in a corrupt state... not sure what to do
+      return false;
+    }
+    _built = true;
+    _n_uncompacted = 0;
+    _size_deleted();
+    _result_cache.clear();
+    return true;
+  }
+
+  bool unbuild(char** error=NULL) {
+    if (_loaded) {
+      set_error_from_string(error, "You can't unbuild a loaded index");
+      return false;
+    }
+    _join_compaction();
+    unquantize();
+
+    _roots.clear();
+    _n_nodes = _n_items;
+    _built = false;
+    _updating = false;
+    _free_nodes.clear();
+    _result_cache.clear();
+
+    return true;
+  }
+
+  bool save(const char* filename, bool prefault=false, char** error=NULL) {
+    _join_compaction();
+    if (!_built) {
+      set_error_from_string(error, "You can't save an index that hasn't been built");
+      return false;
+    }
+    if (_aligned) {
+      set_error_from_string(error, "You can't save an index loaded in the aligned layout, only convert it with save_aligned");
+      return false;
+    }
+    if (_on_disk) {
+      // Items added since the file was last truncated may have grown it
+      return _truncate_on_disk(true, error);
+    } else {
+      // Delete file if it already exists (See issue #335)
+      unlink(filename);
+
+      FILE *f = fopen(filename, "wb");
+      if (f == NULL) {
+        set_error_from_errno(error, "Unable to open");
+        return false;
+      }
+
+      IndexHeader header;
+      _fill_header(&header, index_header_bytes, _file_checksum());
+      vector<char> padding(index_header_bytes - sizeof(header), 0);
+      if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+          fwrite(&padding[0], 1, padding.size(), f) != padding.size() ||
+          fwrite(_nodes, _s, _n_nodes, f) != (size_t) _n_nodes ||
+          (!_roots.empty() && fwrite(&_roots[0], sizeof(S), _roots.size(), f) != _roots.size())) {
+        set_error_from_errno(error, "Unable to write");
+        fclose(f);
+        return false;
+      }
+
+      if (fclose(f) == EOF) {
+        set_error_from_errno(error, "Unable to close");
+        return false;
+      }
+
+      // Deleted items are kept apart from the file, see save_deleted
+      vector<AtomicWord> deleted;
+      deleted.swap(_deleted);
+      S n_deleted = _n_deleted;
+      unload();
+      bool loaded = load(filename, prefault, error);
+      _deleted.swap(deleted);
+      _n_deleted = _n_uncompacted = n_deleted;
+      return loaded;
+    }
+  }
+
+  void reinitialize() {
+    _fd = 0;
+    _nodes = NULL;
+    _data_offset = 0;
+    _checksum = 0;
+    _aligned = false;
+    _layout_map = NULL;
+    _layout_bytes = 0;
+    _layout_items = NULL;
+    _layout_item_bitmap = NULL;
+    _layout_tree_nodes = NULL;
+    _layout_splits = NULL;
+    _layout_leaf_items = NULL;
+    _layout_leaf_gaps = NULL;
+    _layout_item_norms = NULL;
+    _n_splits = 0;
+    _n_leaf_items = 0;
+    _n_leaf_gaps = 0;
+    _K = _node_K();
+    _loaded = false;
+    _n_items = 0;
+    _n_nodes = 0;
+    _nodes_size = 0;
+    _on_disk = false;
+    _updating = false;
+    _n_item_slots = 0;
+    _free_nodes.clear();
+    _deleted.clear();
+    _n_deleted = 0;
+    _n_uncompacted = 0;
+    _roots.clear();
+    _result_cache.clear();
+    unquantize();
+  }
+
+  void unload() {
+    _join_compaction();
+    if (_on_disk && _fd) {
+      if (_built)
+        _truncate_on_disk(false, NULL);
+      close(_fd);
+      if (_nodes)
+        munmap((char*)_nodes - _data_offset, _data_offset + _s * _nodes_size);
+    } else {
+      if (_fd) {
+        // we have mmapped data
+        close(_fd);
+        if (_nodes)
+          munmap((char*)_nodes - _data_offset, _data_offset + _n_nodes * _s);
+        if (_layout_map)
+          munmap(_layout_map, _layout_bytes);
+      } else if (_nodes) {
+        // We have heap allocated data
+        free(_nodes);
+      }
+    }
+    reinitialize();
+    if (_verbose) showUpdate("unloaded\n");
+  }
+
+  bool load(const char* filename, bool prefault=false, char** error=NULL) {
+    if (!_map_index(filename, false, prefault, error))
+      return false;
+    _loaded = true;
+    _built = true;
+    _size_deleted();
+    return true;
+  }
+
+  bool verify(char** error=NULL) const {
+    // Checks the nodes and roots against the checksum the index was saved
+    // with. This reads all of them, unlike load().
+    SharedLock lock(_tree_lock);
+    if (!_built) {
+      set_error_from_string(error, "You can't verify an index that hasn't been built");
+      return false;
+    }
+    if (_checksum == 0) {
+      set_error_from_string(error, "Index has no checksum");
+      return false;
+    }
+    if (_file_checksum() != _checksum) {
+      set_error_from_string(error, "Index doesn't match its checksum");
+      return false;
+    }
+    return true;
+  }
+
+  bool save_aligned(const char* filename, char** error=NULL) const {
+    // Converts the index to a file in the aligned layout, which load() reads
+    // like any other. The vectors of the items are the rows of a matrix,
+    // each starting on a cache line, and the tree nodes keep their children
+    // (or the place of their items) and the scalar of their split in a
+    // compact array of their own, apart from the split planes. Such a file
+    // can be queried and converted again, but not updated.
+    //
+    // Leaves keep their items in an array of their own too, so they can be
+    // of any size: subtrees of up to set_leaf_size items become one leaf.
+    // The items of a leaf are sorted, and packed as the gaps between them
+    // when these fit in 16 bits. Nodes the trees don't reach are left out.
+    SharedLock lock(_tree_lock);
+    if (!_built) {
+      set_error_from_string(error, "You can't save an index that hasn't been built");
+      return false;
+    }
+    if (!D::alignable()) {
+      set_error_from_string(error, "You can't save an index of this metric in the aligned layout");
+      return false;
+    }
+    S leaf_size = std::max(_K, _leaf_size);
+    vector<S> leaf;
+
+    // The nodes the trees reach, down to the splits of more than leaf_size
+    // items and the subtrees under them that become leaves, keep their order
+    vector<S> ids((size_t)(_n_nodes - _n_items), -1);
+    vector<S> stack(_roots.begin(), _roots.end());
+    while (!stack.empty()) {
+      S i = stack.back();
+      stack.pop_back();
+      if (i < _n_items || ids[i - _n_items] != -1)
+        continue;
+      ids[i - _n_items] = 0;
+      const S* children;
+      if (_tree_node(i, &children, &leaf) > leaf_size) {
+        stack.push_back(children[0]);
+        stack.push_back(children[1]);
+      }
+    }
+    S n_tree_nodes = 0;
+    for (size_t k = 0; k < ids.size(); k++) {
+      if (ids[k] != -1)
+        ids[k] = _n_items + n_tree_nodes++;
+    }
+
+    // Splits get their rows, and leaves their items, in node order
+    vector<LayoutNode<S, T> > tree_nodes((size_t)n_tree_nodes);
+    vector<S> split_nodes, leaf_items, items;
+    vector<uint16_t> leaf_gaps;
+    for (S i = _n_items; i < _n_nodes; i++) {
+      if (ids[i - _n_items] == -1)
+        continue;
+      const S* children;
+      LayoutNode<S, T>& node = tree_nodes[ids[i - _n_items] - _n_items];
+      S n_descendants = _tree_node(i, &children, &leaf);
+      if (n_descendants > leaf_size) {
+        node.n_descendants = n_descendants;
+        for (int side = 0; side < 2; side++)
+          node.children[side] = children[side] < _n_items ? children[side] : ids[children[side] - _n_items];
+        node.offset = (S)split_nodes.size();
+        node.aux = _aligned ? _layout_tree_nodes[i - _n_items].aux : D::template split_aux<T>(_get(i));
+        split_nodes.push_back(i);
+        continue;
+      }
+      // The items of the subtree, in order
+      items.clear();
+      stack.assign(1, i);
+      while (!stack.empty()) {
+        S j = stack.back();
+        stack.pop_back();
+        if (j < _n_items) {
+          items.push_back(j);
+          continue;
+        }
+        S n = _tree_node(j, &children, &leaf);
+        if (n > _K)
+          stack.insert(stack.end(), children, children + 2);
+        else
+          items.insert(items.end(), children, children + n);
+      }
+      std::sort(items.begin(), items.end());
+      bool packed = !items.empty();
+      for (size_t k = 1; k < items.size() && packed; k++)
+        packed = items[k] - items[k - 1] <= numeric_limits<uint16_t>::max();
+      if (leaf_items.size() + items.size() > (size_t)numeric_limits<S>::max() ||
+          leaf_gaps.size() + items.size() > (size_t)numeric_limits<S>::max()) {
+        set_error_from_string(error, "Index has too many items in its leaves for the aligned layout");
+        return false;
+      }
+      node.n_descendants = (S)items.size();
+      node.aux = 0;
+      if (packed) {
+        node.children[0] = 1;
+        node.children[1] = items[0];
+        node.offset = (S)leaf_gaps.size();
+        for (size_t k = 1; k < items.size(); k++)
+          leaf_gaps.push_back((uint16_t)(items[k] - items[k - 1]));
+      } else {
+        node.children[0] = node.children[1] = 0;
+        node.offset = (S)leaf_items.size();
+        leaf_items.insert(leaf_items.end(), items.begin(), items.end());
+      }
+    }
+    vector<S> roots(_roots.size());
+    for (size_t tree = 0; tree < _roots.size(); tree++)
+      roots[tree] = _roots[tree] < _n_items ? _roots[tree] : ids[_roots[tree] - _n_items];
+    vector<uint64_t> item_bitmap(((size_t)_n_items + 63) / 64, 0);
+    for (S j = 0; j < _n_items; j++) {
+      if (_has_item(j))
+        item_bitmap[j / 64] |= (uint64_t)1 << (j % 64);
+    }
+    // Saves the metrics that need them from computing the norms of the items
+    // they score
+    vector<T> item_norms(D::aligned_norms() ? (size_t)_n_items : 0, 0);
+    for (size_t j = 0; j < item_norms.size(); j++) {
+      if (_layout_item_norms)
+        item_norms[j] = _layout_item_norms[j];
+      else if (_has_item((S)j))
+        item_norms[j] = dot(_item_row((S)j), _item_row((S)j), _f);
+    }
+
+    size_t row_bytes = _row_words * sizeof(V);
+    IndexHeader header;
+    _fill_header(&header, index_header_bytes, 0);
+    header.n_nodes = (uint64_t)_n_items + n_tree_nodes;
+    header.leaf_size = leaf_size == _node_K() ? 0 : (uint32_t)leaf_size;
+    header.version = header.leaf_size || !leaf_gaps.empty() ? index_version_leaves : index_version_aligned;
+    header.layout = index_layout_aligned;
+    const uint32_t tags[] = {index_section_item_rows, index_section_item_bitmap, index_section_tree_nodes,
+                             index_section_split_rows, index_section_leaf_items, index_section_leaf_gaps,
+                             index_section_item_norms, index_section_roots};
+    const uint64_t sizes[] = {row_bytes * _n_items, sizeof(uint64_t) * item_bitmap.size(),
+                              sizeof(LayoutNode<S, T>) * tree_nodes.size(), row_bytes * split_nodes.size(),
+                              sizeof(S) * leaf_items.size(), sizeof(uint16_t) * leaf_gaps.size(),
+                              sizeof(T) * item_norms.size(), sizeof(S) * roots.size()};
+    header.n_sections = sizeof(tags) / sizeof(tags[0]);
+    uint64_t offset = index_header_bytes;
+    for (uint32_t k = 0; k < header.n_sections; k++) {
+      offset = (offset + index_alignment - 1) / index_alignment * index_alignment;
+      header.sections[k].tag = tags[k];
+      header.sections[k].offset = offset;
+      header.sections[k].size = sizes[k];
+      offset += sizes[k];
+    }
+
+    unlink(filename);
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    // The sections are checksummed one after another, like _file_checksum
+    // does, and the header is written last, with the checksum
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t position = 0;
+    bool ok = true;
+    vector<char> zeros(index_header_bytes, 0);
+    auto write = [&](const void* data, size_t size, bool checksummed) {
+      if (checksummed)
+        h = checksum64(data, size, h);
+      if (size > 0 && ok)
+        ok = fwrite(data, 1, size, f) == size;
+      position += size;
+    };
+    auto begin_section = [&](uint32_t k) {
+      write(&zeros[0], (size_t)(header.sections[k].offset - position), false);
+    };
+    // Rows are copied layout_chunk_rows at a time, the rows of item i or of
+    // tree node i by row(i)
+    vector<V> rows(_row_words * layout_chunk_rows);
+    auto write_rows = [&](S begin, S end, const std::function<const V*(S)>& row) {
+      for (S first = begin; first < end; first += (S)layout_chunk_rows) {
+        size_t n = 0;
+        std::fill(rows.begin(), rows.end(), V());
+        for (S i = first; i < end && i - first < (S)layout_chunk_rows; i++) {
+          const V* v = row(i);
+          if (v)
+            memcpy(&rows[_row_words * n++], v, _f * sizeof(V));
+        }
+        write(&rows[0], row_bytes * n, true);
+      }
+    };
+
+    write(&zeros[0], index_header_bytes, false);
+    begin_section(0);
+    write_rows(0, _n_items, [&](S i) { return _item_row(i); });
+    begin_section(1);
+    write(item_bitmap.empty() ? NULL : &item_bitmap[0], sizeof(uint64_t) * item_bitmap.size(), true);
+    begin_section(2);
+    write(tree_nodes.empty() ? NULL : &tree_nodes[0], sizeof(LayoutNode<S, T>) * tree_nodes.size(), true);
+    begin_section(3);
+    write_rows(0, (S)split_nodes.size(), [&](S k) -> const V* {
+      S i = split_nodes[k];
+      return _aligned ? _layout_splits + _row_words * _layout_tree_nodes[i - _n_items].offset : node_vector(_get(i));
+    });
+    begin_section(4);
+    write(leaf_items.empty() ? NULL : &leaf_items[0], sizeof(S) * leaf_items.size(), true);
+    begin_section(5);
+    write(leaf_gaps.empty() ? NULL : &leaf_gaps[0], sizeof(uint16_t) * leaf_gaps.size(), true);
+    begin_section(6);
+    write(item_norms.empty() ? NULL : &item_norms[0], sizeof(T) * item_norms.size(), true);
+    begin_section(7);
+    write(roots.empty() ? NULL : &roots[0], sizeof(S) * roots.size(), true);
+
+    header.checksum = h ? h : 1;
+    if (ok)
+      ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    if (!ok) {
+      set_error_from_errno(error, "Unable to write");
+      fclose(f);
+      return false;
+    }
+    if (fclose(f) == EOF) {
+      set_error_from_errno(error, "Unable to close");
+      return false;
+    }
+    return true;
+  }
+
+  T get_distance(S i, S j) const {
+    SharedLock lock(_tree_lock);
+    if (_aligned) {
+      QueryNode* node = (QueryNode*)alloca(_query_s);
+      D::template zero_value<QueryNode>(node);
+      copy_vector(node_vector(node), _item_row(i), _f);
+      D::init_node(node, _f);
+      return D::normalized_distance(_item_distance(node, j));
+    }
+    return D::normalized_distance(D::distance(_get(i), _get(j), _f));
+  }
+
+  void get_nns_by_item(S item, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const {
+    // Finds nothing for an item that isn't in the index, nor caches that
+    SharedLock lock(_tree_lock);
+    if (!_valid_item(item))
+      return;
+    if (_result_cache.enabled()) {
+      _get_nns_by_item_cached(item, n, search_k, [&](const vector<S>& r, const vector<T>& d) {
+        result->insert(result->end(), r.begin(), r.end());
+        if (distances)
+          distances->insert(distances->end(), d.begin(), d.end());
+      });
+      return;
+    }
+    T* buffer = (T*)alloca(sizeof(T) * _f);
+    _get_all_nns(_item_vector(item, buffer), n, search_k, result, distances);
+  }
+
+  void get_nns_by_vector(const T* w, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const {
+    SharedLock lock(_tree_lock);
+    _get_all_nns(w, n, search_k, result, distances);
+  }
+
+  bool get_nns_by_item_limited(S item, size_t n, size_t search_k, int64_t timeout_us, size_t max_distances,
+                               vector<S>* result, vector<T>* distances) const {
+    // Finds nothing for an item that isn't in the index
+    SharedLock lock(_tree_lock);
+    if (!_valid_item(item))
+      return false;
+    T* buffer = (T*)alloca(sizeof(T) * _f);
+    return _get_all_nns(_item_vector(item, buffer), n, search_k, result, distances, timeout_us, max_distances);
+  }
+
+  bool get_nns_by_vector_limited(const T* w, size_t n, size_t search_k, int64_t timeout_us, size_t max_distances,
+                                 vector<S>* result, vector<T>* distances) const {
+    // Like get_nns_by_vector, but stops after timeout_us microseconds or
+    // max_distances distance computations (0 for no limit) with the nearest
+    // items found so far. Returns whether a limit stopped the search early.
+    SharedLock lock(_tree_lock);
+    return _get_all_nns(w, n, search_k, result, distances, timeout_us, max_distances);
+  }
+
+  void get_nns_by_item_filtered(S item, size_t n, size_t search_k, const ItemFilter& filter,
+                                vector<S>* result, vector<T>* distances) const {
+    SharedLock lock(_tree_lock);
+    if (!_valid_item(item))
+      return;
+    T* buffer = (T*)alloca(sizeof(T) * _f);
+    _get_all_nns(_item_vector(item, buffer), n, search_k, result, distances, 0, 0, &filter);
+  }
+
+  void get_nns_by_vector_filtered(const T* w, size_t n, size_t search_k, const ItemFilter& filter,
+                                  vector<S>* result, vector<T>* distances) const {
+    // Like get_nns_by_vector, but only returns items that pass the filter.
+    // Only those count towards search_k, so the search goes on further the
+    // fewer items pass, and when no more than search_k items pass at all
+    // they are simply all scored.
+    SharedLock lock(_tree_lock);
+    _get_all_nns(w, n, search_k, result, distances, 0, 0, &filter);
+  }
+
+  size_t get_nns_by_item_into(S item, size_t n, size_t search_k, S* result, T* distances) const {
+    SharedLock lock(_tree_lock);
+    if (!_valid_item(item))
+      return 0;
+    if (_result_cache.enabled()) {
+      size_t m = 0;
+      _get_nns_by_item_cached(item, n, search_k, [&](const vector<S>& r, const vector<T>& d) {
+        m = r.size();
+        std::copy(r.begin(), r.end(), result);
+        if (distances)
+          std::copy(d.begin(), d.end(), distances);
+      });
+      return m;
+    }
+    T* buffer = (T*)alloca(sizeof(T) * _f);
+    return _get_all_nns_into(_item_vector(item, buffer), n, search_k, result, distances);
+  }
+
+  size_t get_nns_by_vector_into(const T* w, size_t n, size_t search_k, S* result, T* distances) const {
+    // Like get_nns_by_vector, but writes the results to result[0, n) and
+    // distances[0, n), if not NULL, and returns how many there are
+    SharedLock lock(_tree_lock);
+    return _get_all_nns_into(w, n, search_k, result, distances);
+  }
+
+  void get_nns_by_item_radius(S item, T radius, size_t search_k, vector<S>* result, vector<T>* distances) const {
+    SharedLock lock(_tree_lock);
+    if (!_valid_item(item))
+      return;
+    T* buffer = (T*)alloca(sizeof(T) * _f);
+    if (_aligned)
+      _get_all_within<true>(_item_vector(item, buffer), radius, search_k, result, distances);
+    else
+      _get_all_within<false>(_item_vector(item, buffer), radius, search_k, result, distances);
+  }
+
+  void get_nns_by_vector_radius(const T* w, T radius, size_t search_k, vector<S>* result, vector<T>* distances) const {
+    // All the items at a distance of at most radius, nearest first. With
+    // search_k = -1 the result is exact for the metrics whose splits bound
+    // the distance (Angular, Euclidean and Manhattan) and a scan of all the
+    // items otherwise; a search_k instead stops after that many candidates
+    // from all the trees.
+    SharedLock lock(_tree_lock);
+    if (_aligned)
+      _get_all_within<true>(w, radius, search_k, result, distances);
+    else
+      _get_all_within<false>(w, radius, search_k, result, distances);
+  }
+
+  void get_nns_by_items(const S* items, size_t n_queries, size_t n, size_t search_k, S* result, T* distances, int n_threads=1) const {
+    // The results of items that aren't in the index are all -1
+    SharedLock lock(_tree_lock);
+    vector<T> buffer(std::is_same<T, V>::value ? 0 : n_queries * _f);
+    _get_all_nns_batch([&](size_t q) -> const T* {
+                         if (!_valid_item(items[q]))
+                           return NULL;
+                         return _item_vector(items[q], buffer.empty() ? NULL : &buffer[q * _f]);
+                       },
+                       n_queries, n, search_k, result, distances, n_threads);
+  }
+
+  void get_nns_by_vectors(const T* w, size_t n_queries, size_t n, size_t search_k, S* result, T* distances, int n_threads=1) const {
+    SharedLock lock(_tree_lock);
+    _get_all_nns_batch([&](size_t q) { return w + q * _f; },
+                       n_queries, n, search_k, result, distances, n_threads);
+  }
+
+  S get_n_items() const {
+    return _n_items;
+  }
+
+  S get_n_trees() const {
+    return (S)_roots.size();
+  }
+
+  void verbose(bool v) {
+    _verbose = v;
+  }
+
+  void get_item(S item, T* v) const {
+    // TODO: handle OOB
+    SharedLock lock(_tree_lock);
+    copy_vector(v, _item_row(item), _f);
+  }
+
+  void set_seed(int seed) {
+    _random.set_seed(seed);
+  }
+
+  void set_tree_order(TreeOrder order) {
+    // The order in which build numbers the nodes of every tree, once it has
+    // been built. The default post-order keeps the index of earlier versions
+    // for a given seed. The other orders put nodes that a query reads one
+    // after another close together, so that a query reads fewer pages of a
+    // large mmapped index. Nodes added by later updates are placed wherever
+    // there is room.
+    _tree_order = order;
+  }
+
+  void set_leaf_size(S leaf_size) {
+    // The most items build puts in a leaf, which is otherwise as many as fit
+    // in a node, growing with f. Build can only make leaves smaller than
+    // that, as they are kept in nodes. save_aligned, which keeps leaves apart
+    // from the nodes, also makes them larger, merging every subtree of up to
+    // leaf_size items into one leaf. 0 goes back to the default.
+    _leaf_size = leaf_size > 0 ? std::max(leaf_size, (S)2) : 0;
+  }
+
+  bool delete_item(S item, char** error=NULL) {
+    // Marks the item as deleted, so that queries no longer return it. Writable
+    // indexes are compacted once enough items have been deleted, in the
+    // background. Items can be deleted while other threads query the index
+    // or delete other items.
+    {
+      SharedLock lock(_tree_lock);
+      if (item < 0 || item >= _n_items || !_has_item(item)) {
+        set_error_from_string(error, "You can't delete an item that isn't in the index");
+        return false;
+      }
+      if (_is_deleted(item))
+        return true;
+      // Only grows the bitmap before build, when there are no queries reading it
+      _size_deleted();
+      uint64_t bit = (uint64_t)1 << (item % 64);
+      if (_deleted[item / 64].bits.fetch_or(bit) & bit)
+        return true;
+      _n_deleted++;
+      _n_uncompacted++;
+      _result_cache.clear();
+    }
+    if (_built && !_loaded && (size_t)_n_uncompacted * compaction_ratio > (size_t)_n_items &&
+        !_compacting.exchange(true)) {
+      // The last compaction is over, or about to be once it clears _compacting
+      _join_compaction();
+      _compaction = std::thread([this]() {
+        compact();
+        _compacting = false;
+      });
+    }
+    return true;
+  }
+
+  bool is_deleted(S item) const {
+    return _is_deleted(item);
+  }
+
+  S get_n_deleted() const {
+    return _n_deleted;
+  }
+
+  bool compact(char** error=NULL) {
+    // Takes the deleted items out of the trees. Leaves drop them, and split
+    // nodes that are left with at most _K items become leaves again. Queries
+    // wait while this runs, as it moves the nodes they read.
+    if (_loaded) {
+      set_error_from_string(error, "You can't compact a loaded index");
+      return false;
+    }
+    if (!_built) {
+      set_error_from_string(error, "You can't compact an index that hasn't been built");
+      return false;
+    }
+    std::lock_guard<ReadWriteLock> lock(_tree_lock);
+    // Items deleted from now on may be left in the trees
+    S n_uncompacted = _n_uncompacted;
+    if (!_prepare_update(_n_items, error))
+      return false;
+    for (size_t tree = 0; tree < _roots.size(); tree++) {
+      Node* m = _get(_roots[tree]);
+      if (m->n_descendants <= _K)
+        continue; // Root leaves have _n_items descendants whatever their size, queries skip their deleted items
+      // Roots stay split nodes (see _make_tree). A side without items left keeps a deleted item.
+      S n_live;
+      for (int side = 0; side < 2; side++)
+        m->children[side] = _compact_subtree(m->children[side], &n_live);
+    }
+    if (!_place_roots(error))
+      return false;
+    _n_uncompacted -= n_uncompacted;
+    _result_cache.clear();
+    if (_verbose) showUpdate("compacted %d deleted items, has %d nodes\n", _n_deleted.load(), _n_nodes);
+    return true;
+  }
+
+  bool save_deleted(const char* filename, char** error=NULL) const {
+    // The bitmap of deleted items goes to its own file, next to the index
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    vector<uint64_t> words(_deleted.size());
+    for (size_t i = 0; i < words.size(); i++)
+      words[i] = _deleted[i].bits.load();
+    if (!words.empty() && fwrite(&words[0], sizeof(uint64_t), words.size(), f) != words.size()) {
+      set_error_from_errno(error, "Unable to write");
+      fclose(f);
+      return false;
+    }
+    if (fclose(f) == EOF) {
+      set_error_from_errno(error, "Unable to close");
+      return false;
+    }
+    return true;
+  }
+
+  bool load_deleted(const char* filename, char** error=NULL) {
+    _join_compaction();
+    ClearCacheOnExit clear_cache(_result_cache);
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    vector<AtomicWord> deleted;
+    uint64_t word;
+    while (fread(&word, sizeof(uint64_t), 1, f) == 1)
+      deleted.push_back(word);
+    fclose(f);
+    _deleted.swap(deleted);
+    _size_deleted();
+    _n_deleted = 0;
+    for (size_t i = 0; i < _deleted.size(); i++)
+      _n_deleted += popcount(_deleted[i].bits.load());
+    _n_uncompacted = _n_deleted.load();
+    return true;
+  }
+
+  void _join_compaction() {
+    // Waits for the compaction started by delete_item, if any. Changes to the
+    // index other than adding, deleting and compacting items wait for it
+    // this way, and like those it must not run alongside queries.
+    if (_compaction.joinable())
+      _compaction.join();
+  }
+
+  void _size_deleted() {
+    // Gives the deleted bitmap a bit for every item, so that delete_item
+    // doesn't reallocate it under the queries of a built index. Items added
+    // to a built index grow it while holding _tree_lock as a writer.
+    if (_deleted.size() < ((size_t)_n_items + 63) / 64)
+      _deleted.resize(((size_t)_n_items + 63) / 64, 0);
+  }
+
+  void set_result_cache_size(size_t max_entries) {
+    // Keeps the results of up to max_entries item queries, the most recently
+    // used, for get_nns_by_item to return without searching again. 0, the
+    // default, turns the cache off.
+    _result_cache.resize(max_entries);
+  }
+
+  void get_result_cache_stats(uint64_t* hits, uint64_t* misses, size_t* entries) const {
+    _result_cache.get_stats(hits, misses, entries);
+  }
+
+  bool quantize(size_t rerank_multiple=4, char** error=NULL) {
+    // Keeps an int8 code of every item, a quarter of the size of its vector,
+    // and scores the candidates of queries on those. Only the
+    // rerank_multiple * n nearest are then scored again on their vectors.
+    // Every dimension is quantized over the range of the items in it. The
+    // codes live in memory only, and items added later are coded as they are
+    // added, clipped to those ranges. Only a built index can be quantized, and
+    // unbuild drops the codes.
+    if (!D::quantizable()) {
+      set_error_from_string(error, "You can't quantize an index of this metric");
+      return false;
+    }
+    if (!_built) {
+      // Items added before build aren't coded as they are added
+      set_error_from_string(error, "You can't quantize an index that hasn't been built");
+      return false;
+    }
+    _join_compaction();
+    // Drops product-quantized codes, which would otherwise be scored instead
+    unquantize();
+    ClearCacheOnExit clear_cache(_result_cache);
+    vector<T> lo(_f, numeric_limits<T>::max()), hi(_f, numeric_limits<T>::lowest());
+    for (S i = 0; i < _n_items; i++) {
+      if (!_has_item(i))
+        continue;
+      const V* v = _item_row(i);
+      for (int z = 0; z < _f; z++) {
+        lo[z] = std::min(lo[z], (T)v[z]);
+        hi[z] = std::max(hi[z], (T)v[z]);
+      }
+    }
+    // Codes -128 and 127 stand for the ends of the range
+    _code_offset.assign(_f, 0);
+    _code_scale.assign(_f, 0);
+    for (int z = 0; z < _f; z++) {
+      if (hi[z] > lo[z]) {
+        _code_scale[z] = (hi[z] - lo[z]) / 255;
+        _code_offset[z] = lo[z] + 128 * _code_scale[z];
+      } else if (hi[z] == lo[z]) {
+        _code_offset[z] = lo[z];
+      }
+    }
+    _code_words = 1 + (_f + sizeof(T) - 1) / sizeof(T);
+    _codes.clear();
+    for (S i = 0; i < _n_items; i++)
+      _encode_item(i);
+    _rerank_multiple = std::max(rerank_multiple, (size_t)1);
+    return true;
+  }
+
+  bool pq_quantize(size_t n_subvectors, size_t rerank_multiple=4, int n_threads=1, char** error=NULL) {
+    // Product quantization: splits the vectors into n_subvectors parts, and
+    // keeps a byte per part for every item, the nearest of pq_centroids
+    // centroids trained for it. Queries score their candidates on those
+    // codes with a table of the distances from the query to all centroids,
+    // and only the rerank_multiple * n nearest are then read from the nodes,
+    // or none with a rerank_multiple of 0. That way a loaded index only
+    // needs the tree nodes and the codes in memory. Items added later are
+    // coded as they are added. The codes are saved and loaded with save_pq
+    // and load_pq, once the index is built.
+    if (!D::quantizable()) {
+      set_error_from_string(error, "You can't quantize an index of this metric");
+      return false;
+    }
+    if (!_built) {
+      set_error_from_string(error, "You can't quantize an index that hasn't been built");
+      return false;
+    }
+    _join_compaction();
+    if (n_subvectors < 1 || n_subvectors > (size_t)_f) {
+      set_error_from_string(error, "The number of subvectors has to be between 1 and the number of dimensions");
+      return false;
+    }
+    vector<S> sample;
+    for (S i = 0; i < _n_items; i++) {
+      if (_has_item(i))
+        sample.push_back(i);
+    }
+    if (sample.empty()) {
+      set_error_from_string(error, "You can't quantize an index without items");
+      return false;
+    }
+    unquantize();
+    ClearCacheOnExit clear_cache(_result_cache);
+    _pq_m = n_subvectors;
+    _pq_bounds.resize(_pq_m + 1);
+    for (size_t k = 0; k <= _pq_m; k++)
+      _pq_bounds[k] = (int)(k * _f / _pq_m);
+    _rerank_multiple = rerank_multiple;
+
+    // A random sample of the items, the first pq_centroids of which are the
+    // initial centroids (all of them, repeated, when there are fewer)
+    size_t n_sample = std::min(sample.size(), (size_t)pq_train_items);
+    for (size_t i = 0; i < n_sample; i++)
+      std::swap(sample[i], sample[i + _random.index(sample.size() - i)]);
+    sample.resize(n_sample);
+    _pq_centroids.resize(pq_centroids * _f);
+    for (size_t c = 0; c < pq_centroids; c++)
+      _pq_set_centroid(c, _item_row(sample[c % n_sample]));
+
+    _pq_codes.resize(n_sample * _pq_m);
+    for (size_t iteration = 0; iteration < pq_train_iterations; iteration++) {
+      _pq_parallel_chunks(n_sample, n_threads, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+          _pq_encode(_item_row(sample[i]), &_pq_codes[i * _pq_m]);
+      });
+      // Every centroid moves to the mean of its items. Those left without
+      // any move to a random item instead.
+      vector<T> sums(_pq_centroids.size(), 0);
+      vector<size_t> counts(pq_centroids * _pq_m, 0);
+      for (size_t i = 0; i < n_sample; i++) {
+        const V* v = _item_row(sample[i]);
+        for (size_t k = 0; k < _pq_m; k++) {
+          size_t c = _pq_codes[i * _pq_m + k];
+          for (int z = _pq_bounds[k]; z < _pq_bounds[k + 1]; z++)
+            sums[pq_centroids * z + c] += v[z];
+          counts[k * pq_centroids + c]++;
+        }
+      }
+      for (size_t k = 0; k < _pq_m; k++) {
+        for (size_t c = 0; c < pq_centroids; c++) {
+          size_t count = counts[k * pq_centroids + c];
+          const V* v = count == 0 ? _item_row(sample[_random.index(n_sample)]) : NULL;
+          for (int z = _pq_bounds[k]; z < _pq_bounds[k + 1]; z++)
+            _pq_centroids[pq_centroids * z + c] = count == 0 ? (T)v[z] : sums[pq_centroids * z + c] / count;
+        }
+      }
+      if (_verbose) showUpdate("pq iteration %zu of %zu\n", iteration + 1, pq_train_iterations);
+    }
+
+    _pq_codes.assign((size_t)_n_items * _pq_m, 0);
+    _pq_norms.assign(_n_items, -1);
+    _pq_parallel_chunks(_n_items, n_threads, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++)
+        _encode_item(i);
+    });
+    if (_verbose) showUpdate("pq coded %d items in %zu bytes each\n", _n_items, _pq_m);
+    return true;
+  }
+
+  bool save_pq(const char* filename, char** error=NULL) const {
+    // The PQ codebook and codes go to their own file, next to the index
+    if (_pq_m == 0) {
+      set_error_from_string(error, "You can't save PQ codes of an index that isn't quantized with them");
+      return false;
+    }
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    uint64_t header[4] = {(uint64_t)_f, (uint64_t)_pq_m, (uint64_t)_n_items, (uint64_t)_rerank_multiple};
+    bool written = fwrite(header, sizeof(uint64_t), 4, f) == 4 &&
+      fwrite(&_pq_centroids[0], sizeof(T), _pq_centroids.size(), f) == _pq_centroids.size() &&
+      fwrite(&_pq_norms[0], sizeof(T), _pq_norms.size(), f) == _pq_norms.size() &&
+      fwrite(&_pq_codes[0], 1, _pq_codes.size(), f) == _pq_codes.size();
+    if (!written) {
+      set_error_from_errno(error, "Unable to write");
+      fclose(f);
+      return false;
+    }
+    if (fclose(f) == EOF) {
+      set_error_from_errno(error, "Unable to close");
+      return false;
+    }
+    return true;
+  }
+
+  bool load_pq(const char* filename, char** error=NULL) {
+    // Codes saved with save_pq, for the same items. Nothing is read from the
+    // nodes, so the item vectors of a loaded index stay on disk.
+    if (!D::quantizable()) {
+      set_error_from_string(error, "You can't quantize an index of this metric");
+      return false;
+    }
+    if (!_built) {
+      set_error_from_string(error, "You can't quantize an index that hasn't been built");
+      return false;
+    }
+    _join_compaction();
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    uint64_t header[4];
+    if (fread(header, sizeof(uint64_t), 4, f) != 4 || header[0] != (uint64_t)_f || header[1] < 1 ||
+        header[1] > (uint64_t)_f || header[2] != (uint64_t)_n_items) {
+      set_error_from_string(error, "PQ codes don't match the index");
+      fclose(f);
+      return false;
+    }
+    unquantize();
+    ClearCacheOnExit clear_cache(_result_cache);
+    _pq_m = header[1];
+    _pq_bounds.resize(_pq_m + 1);
+    for (size_t k = 0; k <= _pq_m; k++)
+      _pq_bounds[k] = (int)(k * _f / _pq_m);
+    _rerank_multiple = header[3];
+    _pq_centroids.resize(pq_centroids * _f);
+    _pq_norms.resize(_n_items);
+    _pq_codes.resize((size_t)_n_items * _pq_m);
+    bool read = fread(&_pq_centroids[0], sizeof(T), _pq_centroids.size(), f) == _pq_centroids.size() &&
+      fread(&_pq_norms[0], sizeof(T), _pq_norms.size(), f) == _pq_norms.size() &&
+      fread(&_pq_codes[0], 1, _pq_codes.size(), f) == _pq_codes.size();
+    fclose(f);
+    if (!read) {
+      unquantize();
+      set_error_from_string(error, "PQ codes are truncated");
+      return false;
+    }
+    _advise_items(true);
+    return true;
+  }
+
+  void unquantize() {
+    if (_pq_m > 0)
+      _advise_items(false);
+    vector<T>().swap(_codes);
+    _code_offset.clear();
+    _code_scale.clear();
+    _pq_m = 0;
+    _pq_bounds.clear();
+    _pq_centroids.clear();
+    vector<uint8_t>().swap(_pq_codes);
+    vector<T>().swap(_pq_norms);
+    // Queries are exact again, so results cached from the codes are stale
+    _result_cache.clear();
+  }
+
+protected:
+  bool _quantized() const {
+    return !_codes.empty() || _pq_m > 0;
+  }
+
+  void _advise_items(bool random) const {
+    // With PQ codes, the items of a loaded index are only read a few at a
+    // time to rerank, so reading ahead of them would only fill memory
+#ifdef MADV_RANDOM
+    if (_loaded && _fd && _aligned)
+      madvise(_layout_map, _layout_bytes, random ? MADV_RANDOM : MADV_NORMAL); // Mostly the items
+    else if (_loaded && _fd)
+      madvise(_nodes, (size_t)_n_items * _s, random ? MADV_RANDOM : MADV_NORMAL);
+#endif
+  }
+
+  void _pq_set_centroid(size_t c, const V* v) {
+    // Makes v centroid c of every subvector
+    for (int z = 0; z < _f; z++)
+      _pq_centroids[pq_centroids * z + c] = v[z];
+  }
+
+  T _pq_encode(const V* v, uint8_t* code) const {
+    // The nearest centroid of every subvector of v, returning the squared
+    // norm of what they stand for. The distances to all centroids are summed
+    // a dimension at a time, which the layout of _pq_centroids keeps
+    // contiguous.
+    T distances[pq_centroids];
+    T norm = 0;
+    for (size_t k = 0; k < _pq_m; k++) {
+      std::fill(distances, distances + pq_centroids, T(0));
+      for (int z = _pq_bounds[k]; z < _pq_bounds[k + 1]; z++) {
+        const T* centroids = &_pq_centroids[pq_centroids * z];
+        const T x = v[z];
+        for (size_t c = 0; c < pq_centroids; c++)
+          distances[c] += (x - centroids[c]) * (x - centroids[c]);
+      }
+      size_t nearest = std::min_element(distances, distances + pq_centroids) - distances;
+      code[k] = (uint8_t)nearest;
+      for (int z = _pq_bounds[k]; z < _pq_bounds[k + 1]; z++)
+        norm += _pq_centroids[pq_centroids * z + nearest] * _pq_centroids[pq_centroids * z + nearest];
+    }
+    return norm;
+  }
+
+  void _pq_parallel_chunks(size_t n, int n_threads, const std::function<void(size_t, size_t)>& run) {
+    // Runs run(begin, end) over [0, n) in chunks of pq_chunk_items, on
+    // n_threads threads (-1 for all cores)
+    if (n_threads == -1)
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    if (n_threads <= 1 || n <= pq_chunk_items) {
+      run(0, n);
+      return;
+    }
+    WorkStealingPool pool(n_threads);
+    std::deque<WorkStealingPool::Task> tasks;
+    for (size_t begin = 0; begin < n; begin += pq_chunk_items) {
+      tasks.emplace_back(std::bind(run, begin, std::min(n, begin + pq_chunk_items)));
+      pool.spawn(&tasks.back());
+    }
+    for (size_t t = 0; t < tasks.size(); t++)
+      pool.wait(&tasks[t]);
+  }
+
+  void _encode_item(S item) {
+    if (_pq_m > 0) {
+      if ((size_t)item >= _pq_norms.size()) {
+        _pq_codes.resize(((size_t)item + 1) * _pq_m, 0);
+        _pq_norms.resize((size_t)item + 1, -1);
+      }
+      if (_has_item(item))
+        _pq_norms[item] = _pq_encode(_item_row(item), &_pq_codes[(size_t)item * _pq_m]);
+      return;
+    }
+    size_t n_rows = _codes.size() / _code_words;
+    if ((size_t)item >= n_rows) {
+      _codes.resize(((size_t)item + 1) * _code_words, 0);
+      for (size_t i = n_rows; i < (size_t)item; i++)
+        _codes[i * _code_words] = -1;
+    }
+    T* code = &_codes[(size_t)item * _code_words];
+    if (!_has_item(item)) {
+      code[0] = -1;
+      return;
+    }
+    const V* v = _item_row(item);
+    int8_t* c = (int8_t*)(code + 1);
+    T norm = 0;
+    for (int z = 0; z < _f; z++) {
+      int q = 0;
+      if (_code_scale[z] > 0)
+        q = std::max(-128, std::min(127, (int)round((v[z] - _code_offset[z]) / _code_scale[z])));
+      c[z] = (int8_t)q;
+      T x = _code_offset[z] + _code_scale[z] * q;
+      norm += x * x;
+    }
+    code[0] = norm;
+  }
+
+  void _prepare_quantized(const T* v, QuantizedQuery<T>* quantized) const {
+    if (_pq_m > 0) {
+      quantized->table.assign(pq_centroids * _pq_m, 0);
+      for (size_t k = 0; k < _pq_m; k++) {
+        T* table = &quantized->table[k * pq_centroids];
+        for (int z = _pq_bounds[k]; z < _pq_bounds[k + 1]; z++) {
+          const T* centroids = &_pq_centroids[pq_centroids * z];
+          for (size_t c = 0; c < pq_centroids; c++)
+            table[c] += D::adc_term(v[z], centroids[c]);
+        }
+      }
+      quantized->norm = dot(v, v, _f);
+      return;
+    }
+    if (_codes.empty())
+      return;
+    quantized->scale = &_code_scale[0];
+    quantized->shifted.resize(_f);
+    quantized->scaled.resize(_f);
+    quantized->offset_dot = 0;
+    for (int z = 0; z < _f; z++) {
+      quantized->shifted[z] = v[z] - _code_offset[z];
+      quantized->scaled[z] = v[z] * _code_scale[z];
+      quantized->offset_dot += v[z] * _code_offset[z];
+    }
+    quantized->norm = dot(v, v, _f);
+  }
+
+  template<bool aligned>
+  void _prefetch_candidate(S j) const {
+    if (_pq_m > 0)
+      prefetch_node(&_pq_codes[(size_t)j * _pq_m], _pq_m);
+    else if (_codes.empty())
+      _prefetch_item<aligned>(j);
+    else
+      prefetch_node(&_codes[(size_t)j * _code_words], _code_words * sizeof(T));
+  }
+
+  size_t _n_kept(size_t n) const {
+    // Candidates kept while searching for the n nearest
+    return _quantized() && _rerank_multiple > 0 ? n * _rerank_multiple : n;
+  }
+
+  template<bool aligned>
+  void _score_candidate(const QueryNode* v_node, const QuantizedQuery<T>& quantized, S j, size_t n_kept,
+                        vector<pair<T, S> >* top) const {
+    // Keeps j if it is among the n_kept nearest candidates so far, in the
+    // max-heap top. With codes, its distance is the one to its code.
+    T d;
+    if (_pq_m > 0) {
+      if (!(_pq_norms[j] >= 0))
+        return;
+      const uint8_t* code = &_pq_codes[(size_t)j * _pq_m];
+      const T* table = &quantized.table[0];
+      T sum = 0;
+      for (size_t k = 0; k < _pq_m; k++, table += pq_centroids)
+        sum += table[code[k]];
+      d = D::adc_distance(sum, quantized.norm, _pq_norms[j]);
+    } else if (_codes.empty()) {
+      if (!_has_item<aligned>(j))  // This is only to guard a really obscure case, #284
+        return;
+      d = _item_distance<aligned>(v_node, j);
+    } else {
+      const T* code = &_codes[(size_t)j * _code_words];
+      if (!(code[0] >= 0))
+        return;
+      d = D::quantized_distance(quantized, (const int8_t*)(code + 1), code[0], _f);
+    }
+    pair<T, S> candidate(d, j);
+    if (top->size() < n_kept) {
+      top->push_back(candidate);
+      std::push_heap(top->begin(), top->end());
+    } else if (n_kept > 0 && candidate < top->front()) {
+      std::pop_heap(top->begin(), top->end());
+      top->back() = candidate;
+      std::push_heap(top->begin(), top->end());
+    }
+  }
+
+  template<bool aligned>
+  void _sort_top(const QueryNode* v_node, size_t n, vector<pair<T, S> >* top) const {
+    // Sorts the candidates kept, nearest first. Those scored on codes are
+    // scored again on their vectors, and the n nearest of them kept, unless
+    // PQ codes are kept without reranking.
+    if (!_quantized() || _rerank_multiple == 0) {
+      std::sort_heap(top->begin(), top->end());
+      return;
+    }
+    for (size_t i = 0; i < top->size(); i++)
+      (*top)[i].first = _item_distance<aligned>(v_node, (*top)[i].second);
+    std::sort(top->begin(), top->end());
+    if (top->size() > n)
+      top->resize(n);
+  }
+
+  const T* _item_vector(S item, T* buffer) const {
+    // The vector of item to query with: its own, or a copy in buffer (of _f
+    // T's) when it is stored as another type
+    return _as_query(_item_row(item), buffer);
+  }
+
+  const T* _as_query(const T* v, T*) const {
+    return v;
+  }
+
+  template<typename U>
+  const T* _as_query(const U* v, T* buffer) const {
+    copy_vector(buffer, v, _f);
+    return buffer;
+  }
+
+  template<typename Copy>
+  void _get_nns_by_item_cached(S item, size_t n, size_t search_k, const Copy& copy) const {
+    // Taken first, so that a result computed across a clear isn't cached
+    uint64_t generation = _result_cache.generation();
+    if (_result_cache.lookup(item, n, search_k, copy))
+      return;
+    static thread_local vector<S> result;
+    static thread_local vector<T> distances;
+    result.clear();
+    distances.clear();
+    T* buffer = (T*)alloca(sizeof(T) * _f);
+    _get_all_nns(_item_vector(item, buffer), n, search_k, &result, &distances);
+    _result_cache.insert(item, n, search_k, generation, result, distances);
+    copy(result, distances);
+  }
+
+  void _fill_header(IndexHeader* header, size_t header_bytes, uint64_t checksum) const {
+    // The roots follow the nodes
+    memset(header, 0, sizeof(IndexHeader));
+    memcpy(header->magic, index_magic, sizeof(index_magic));
+    header->version = index_version_nodes;
+    header->header_bytes = (uint32_t)header_bytes;
+    strncpy(header->metric, D::name(), sizeof(header->metric) - 1);
+    strncpy(header->vector_type, vector_type_name<V>(), sizeof(header->vector_type) - 1);
+    header->index_bytes = sizeof(S);
+    header->node_bytes = (uint32_t)_s;
+    header->f = _f;
+    header->dimension = _dimension;
+    header->n_items = (uint64_t)_n_items;
+    header->n_nodes = (uint64_t)_n_nodes;
+    header->n_trees = _roots.size();
+    header->checksum = checksum;
+    header->leaf_size = _K == _node_K() ? 0 : (uint32_t)_K;
+    if (header->leaf_size)
+      header->version = index_version_leaves;
+    header->n_sections = 1;
+    header->sections[0].tag = index_section_roots;
+    header->sections[0].offset = header_bytes + _s * (size_t)_n_nodes;
+    header->sections[0].size = sizeof(S) * _roots.size();
+  }
+
+  uint64_t _file_checksum() const {
+    uint64_t h;
+    if (_aligned) {
+      // Of the sections in the order save_aligned writes them
+      h = checksum64(_layout_items, _row_words * sizeof(V) * _n_items);
+      h = checksum64(_layout_item_bitmap, sizeof(uint64_t) * (((size_t)_n_items + 63) / 64), h);
+      h = checksum64(_layout_tree_nodes, sizeof(LayoutNode<S, T>) * (_n_nodes - _n_items), h);
+      h = checksum64(_layout_splits, _row_words * sizeof(V) * _n_splits, h);
+      h = checksum64(_layout_leaf_items, sizeof(S) * _n_leaf_items, h);
+      h = checksum64(_layout_leaf_gaps, sizeof(uint16_t) * _n_leaf_gaps, h);
+      if (_layout_item_norms)
+        h = checksum64(_layout_item_norms, sizeof(T) * _n_items, h);
+    } else {
+      h = checksum64(_nodes, _s * (size_t)_n_nodes);
+    }
+    if (!_roots.empty())
+      h = checksum64(&_roots[0], sizeof(S) * _roots.size(), h);
+    return h ? h : 1; // 0 is for no checksum
+  }
+
+  bool _check_header(const IndexHeader& header, off_t size, char** error) const {
+    if (header.version > index_version || header.layout > index_layout_aligned) {
+      set_error_from_string(error, "Index was saved by a newer version");
+      return false;
+    }
+    if (strncmp(header.metric, D::name(), sizeof(header.metric)) != 0) {
+      set_error_from_string(error, "Index was built with another metric");
+      return false;
+    }
+    const char* vector_type = vector_type_name<V>();
+    if ((header.vector_type[0] && vector_type[0] && strncmp(header.vector_type, vector_type, sizeof(header.vector_type)) != 0) ||
+        header.index_bytes != sizeof(S) || header.node_bytes != _s || header.f != _f) {
+      set_error_from_string(error, "Index has other types or dimension than this one");
+      return false;
+    }
+    if (header.header_bytes < sizeof(IndexHeader) || header.n_sections > index_max_sections ||
+        header.n_nodes > (uint64_t)numeric_limits<S>::max() || header.n_items > header.n_nodes ||
+        header.leaf_size == 1 || header.leaf_size > (uint64_t)numeric_limits<S>::max() ||
+        (header.layout == index_layout_nodes && header.leaf_size > (uint64_t)_node_K()) ||
+        (uint64_t)size < header.header_bytes + (header.layout == index_layout_nodes ? _s * header.n_nodes : 0)) {
+      set_error_from_string(error, "Index header doesn't match the file");
+      return false;
+    }
+    for (uint32_t i = 0; i < header.n_sections; i++) {
+      if (header.sections[i].offset + header.sections[i].size > (uint64_t)size) {
+        set_error_from_string(error, "Index is truncated");
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool _read_roots(const IndexHeader& header, char** error) {
+    // From the section of the header, without looking at the nodes
+    _roots.clear();
+    for (uint32_t i = 0; i < header.n_sections; i++) {
+      const IndexSection& section = header.sections[i];
+      if (section.tag != index_section_roots)
+        continue;
+      if (section.size != sizeof(S) * header.n_trees) {
+        set_error_from_string(error, "Index roots don't match the header");
+        return false;
+      }
+      _roots.resize(header.n_trees);
+      if (header.n_trees > 0 &&
+          (lseek(_fd, (off_t)section.offset, SEEK_SET) != (off_t)section.offset ||
+           read(_fd, &_roots[0], (unsigned)section.size) != (int)section.size)) {
+        set_error_from_errno(error, "Unable to read");
+        return false;
+      }
+      for (size_t tree = 0; tree < _roots.size(); tree++) {
+        if (_roots[tree] < 0 || (uint64_t)_roots[tree] >= header.n_nodes) {
+          set_error_from_string(error, "Index roots are out of range");
+          return false;
+        }
+      }
+      return true;
+    }
+    set_error_from_string(error, "Index has no roots");
+    return false;
+  }
+
+  bool _map_layout(const IndexHeader& header, char** error) {
+    // Points the arrays of the aligned layout at their sections in _layout_map
+    const char* base = (const char*)_layout_map;
+    const IndexSection* sections[index_section_item_norms + 1] = {NULL};
+    for (uint32_t i = 0; i < header.n_sections; i++) {
+      const IndexSection& section = header.sections[i];
+      if (section.tag < index_section_item_rows || section.tag > index_section_item_norms)
+        continue;
+      if (section.offset % index_alignment) {
+        set_error_from_string(error, "Index sections aren't aligned");
+        return false;
+      }
+      sections[section.tag] = &section;
+    }
+    for (uint32_t tag = index_section_item_rows; tag <= index_section_leaf_items; tag++) {
+      if (!sections[tag]) {
+        set_error_from_string(error, "Index is missing a section of the aligned layout");
+        return false;
+      }
+    }
+    size_t row_bytes = _row_words * sizeof(V);
+    uint64_t n_splits = sections[index_section_split_rows]->size / row_bytes;
+    uint64_t n_leaf_items = sections[index_section_leaf_items]->size / sizeof(S);
+    if (sections[index_section_item_rows]->size != row_bytes * header.n_items ||
+        sections[index_section_item_bitmap]->size != sizeof(uint64_t) * ((header.n_items + 63) / 64) ||
+        sections[index_section_tree_nodes]->size != sizeof(LayoutNode<S, T>) * (header.n_nodes - header.n_items) ||
+        sections[index_section_split_rows]->size != row_bytes * n_splits ||
+        sections[index_section_leaf_items]->size != sizeof(S) * n_leaf_items ||
+        (sections[index_section_leaf_gaps] && sections[index_section_leaf_gaps]->size % sizeof(uint16_t)) ||
+        (sections[index_section_item_norms] && sections[index_section_item_norms]->size &&
+         sections[index_section_item_norms]->size != sizeof(T) * header.n_items)) {
+      set_error_from_string(error, "Index sections don't match the header");
+      return false;
+    }
+    _layout_items = (const V*)(base + sections[index_section_item_rows]->offset);
+    _layout_item_bitmap = (const uint64_t*)(base + sections[index_section_item_bitmap]->offset);
+    _layout_tree_nodes = (const LayoutNode<S, T>*)(base + sections[index_section_tree_nodes]->offset);
+    _layout_splits = (const V*)(base + sections[index_section_split_rows]->offset);
+    _layout_leaf_items = (const S*)(base + sections[index_section_leaf_items]->offset);
+    if (sections[index_section_leaf_gaps]) {
+      _layout_leaf_gaps = (const uint16_t*)(base + sections[index_section_leaf_gaps]->offset);
+      _n_leaf_gaps = (size_t)(sections[index_section_leaf_gaps]->size / sizeof(uint16_t));
+    }
+    if (sections[index_section_item_norms] && sections[index_section_item_norms]->size)
+      _layout_item_norms = (const T*)(base + sections[index_section_item_norms]->offset);
+    _n_splits = (S)n_splits;
+    _n_leaf_items = (size_t)n_leaf_items;
+    return true;
+  }
+
+  bool _map_index(const char* filename, bool writable, bool prefault, char** error) {
+    ClearCacheOnExit clear_cache(_result_cache);
+    _fd = open(filename, writable ? O_RDWR : O_RDONLY, writable ? (int)0600 : (int)0400);
+    if (_fd == -1) {
+      set_error_from_errno(error, "Unable to open");
+      _fd = 0;
+      return false;
+    }
+    // Every failure after this closes the file again
+    auto fail = [&]() {
+      close(_fd);
+      _fd = 0;
+      return false;
+    };
+    off_t size = lseek_getsize(_fd);
+    IndexHeader header;
+    bool has_header = size >= (off_t)sizeof(header) && read_index_header(_fd, &header);
+    if (size == -1) {
+      set_error_from_errno(error, "Unable to get size");
+      return fail();
+    } else if (size == 0) {
+      set_error_from_errno(error, "Size of file is zero");
+      return fail();
+    } else if (has_header) {
+      if (!_check_header(header, size, error) || !_read_roots(header, error))
+        return fail();
+      if (header.layout == index_layout_aligned && writable) {
+        set_error_from_string(error, "You can't update an index in the aligned layout");
+        return fail();
+      }
+    } else if (size % _s) {
+      // Something is fishy with this index!
+      set_error_from_errno(error, "Index size is not a multiple of vector size");
+      return fail();
+    }
+
+    int flags = MAP_SHARED;
+    if (prefault) {
+#ifdef MAP_POPULATE
+      flags |= MAP_POPULATE;
+#else
+      showUpdate("prefault is set to true, but MAP_POPULATE is not defined on this platform");
+#endif
+    }
+    if (has_header && header.layout == index_layout_aligned) {
+      void* mapped = mmap(0, size, PROT_READ, flags, _fd, 0);
+      if (mapped == MAP_FAILED) {
+        set_error_from_errno(error, "Unable to mmap");
+        return fail();
+      }
+      _layout_map = mapped;
+      _layout_bytes = size;
+      if (!_map_layout(header, error)) {
+        munmap(_layout_map, _layout_bytes);
+        _layout_map = NULL;
+        _layout_bytes = 0;
+        return fail();
+      }
+      _aligned = true;
+      _n_nodes = (S)header.n_nodes;
+      _n_items = (S)header.n_items;
+      _K = header.leaf_size ? (S)header.leaf_size : _node_K();
+      _checksum = header.checksum;
+      if (_verbose) showUpdate("found %lu roots in the header of the aligned layout\n", _roots.size());
+      return true;
+    }
+    if (has_header) {
+      // The sections after the nodes are read and written apart from them
+      size_t data_offset = header.header_bytes;
+      void* mapped = mmap(0, data_offset + _s * header.n_nodes, writable ? PROT_READ | PROT_WRITE : PROT_READ, flags, _fd, 0);
+      if (mapped == MAP_FAILED) {
+        set_error_from_errno(error, "Unable to mmap");
+        return fail();
+      }
+      _nodes = (char*)mapped + data_offset;
+      _data_offset = data_offset;
+      _n_nodes = (S)header.n_nodes;
+      _n_items = (S)header.n_items;
+      _K = header.leaf_size ? (S)header.leaf_size : _node_K();
+      _checksum = header.checksum;
+      if (_verbose) showUpdate("found %lu roots in the header\n", _roots.size());
+      return true;
+    }
+
+    void* mapped = mmap(0, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, flags, _fd, 0);
+    if (mapped == MAP_FAILED) {
+      set_error_from_errno(error, "Unable to mmap");
+      return fail();
+    }
+    _nodes = (Node*)mapped;
+    _n_nodes = (S)(size / _s);
+
+    // Without a header, find the roots by scanning the end of the file and taking the nodes with most descendants
+    _roots.clear();
+    S m = -1;
+    for (S i = _n_nodes - 1; i >= 0; i--) {
+      S k = _get(i)->n_descendants;
+      if (m == -1 || k == m) {
+        _roots.push_back(i);
+        m = k;
+      } else {
+        break;
+      }
+    }
+    // hacky fix: since the last root precedes the copy of all roots, delete it
+    if (_roots.size() > 1 && _get(_roots.front())->children[0] == _get(_roots.back())->children[0])
+      _roots.pop_back();
+    _n_items = m;
+    if (_verbose) showUpdate("found %lu roots with degree %d\n", _roots.size(), m);
+    return true;
+  }
+
+  bool _allocate_size(S n, char** error=NULL) {
+    // Makes room for n nodes. Only fails on disk, when the file can't grow,
+    // leaving the nodes as they were.
+    if (n > _nodes_size) {
+      const double reallocation_factor = 1.3;
+      S new_nodes_size = std::max(n, (S) ((_nodes_size + 1) * reallocation_factor));
+      void *old = _nodes;
+
+      if (_on_disk) {
+        // Every step truncates the file and remaps all of it, so take big ones
+        size_t step = std::max((size_t) _nodes_size, on_disk_growth_bytes / _s);
+        size_t wanted = std::max((size_t) n, (size_t) _nodes_size + step);
+        new_nodes_size = (S) std::min(wanted, (size_t) numeric_limits<S>::max());
+        if (ftruncate(_fd, _data_offset + _s * new_nodes_size) == -1) {
+          // Mapping past the end of the file would fault on the first write there
+          set_error_from_errno(error, "Unable to truncate");
+          if (_verbose) showUpdate("File truncation error\n");
+          return false;
+        }
+        _remap(_nodes_size, new_nodes_size);
+      } else {
+        _nodes = realloc(_nodes, _s * new_nodes_size);
+        memset((char *) _nodes + (_nodes_size * _s) / sizeof(char), 0, (new_nodes_size - _nodes_size) * _s);
+      }
 
-struct Euclidean : Minkowski {
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return euclidean_distance(x->v, y->v, f);
+      _nodes_size = new_nodes_size;
+      if (_verbose) showUpdate("Reallocating to %d nodes: old_address=%p, new_address=%p\n", new_nodes_size, old, _nodes);
+    }
+    return true;
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Euclidean, Node<S, T> >(nodes, f, random, false, p, q);
 
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
-    n->a = 0.0;
-    for (int z = 0; z < f; z++)
-      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
-  }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return sqrt(std::max(distance, T(0)));
-  }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+  inline Node* _get(const S i) const {
+    return get_node_ptr<S, Node>(_nodes, _s, i);
   }
-  static const char* name() {
-    return "euclidean";
+
+  S _node_K() const {
+    // Max number of descendants to fit into node
+    return (S) (((size_t) (_s - offsetof(Node, children))) / sizeof(S));
   }
 
-};
+  // Queries and quantization read the items and the trees through these,
+  // which work in both layouts. The query paths take the layout as their
+  // aligned template argument, chosen once per query (see _get_all_nns), so
+  // that the node layout pays no branch for the other one. The rest calls
+  // the versions that look at _aligned.
+
+  template<bool aligned>
+  inline const V* _item_row(S j) const {
+    if (aligned)
+      return _layout_items + _row_words * j;
+    return node_vector(_get(j));
+  }
 
-struct Manhattan : Minkowski {
-  template<typename S, typename T>
-  static inline T distance(const Node<S, T>* x, const Node<S, T>* y, int f) {
-    return manhattan_distance(x->v, y->v, f);
+  inline const V* _item_row(S j) const {
+    return _aligned ? _item_row<true>(j) : _item_row<false>(j);
   }
-  template<typename S, typename T, typename Random>
-  static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    Node<S, T>* p = (Node<S, T>*)alloca(s);
-    Node<S, T>* q = (Node<S, T>*)alloca(s);
-    two_means<T, Random, Manhattan, Node<S, T> >(nodes, f, random, false, p, q);
 
-    for (int z = 0; z < f; z++)
-      n->v[z] = p->v[z] - q->v[z];
-    Base::normalize<T, Node<S, T> >(n, f);
-    n->a = 0.0;
-    for (int z = 0; z < f; z++)
-      n->a += -n->v[z] * (p->v[z] + q->v[z]) / 2;
+  template<bool aligned>
+  inline bool _has_item(S j) const {
+    if (aligned)
+      return (_layout_item_bitmap[j / 64] >> (j % 64)) & 1;
+    return _get(j)->n_descendants == 1;
   }
-  template<typename T>
-  static inline T normalized_distance(T distance) {
-    return std::max(distance, T(0));
+
+  inline bool _has_item(S j) const {
+    return _aligned ? _has_item<true>(j) : _has_item<false>(j);
   }
-  template<typename S, typename T>
-  static inline void init_node(Node<S, T>* n, int f) {
+
+  inline bool _valid_item(S j) const {
+    // Whether j can be queried by: an item of the index, not a hole
+    return j >= 0 && j < _n_items && _has_item(j);
   }
-  static const char* name() {
-    return "manhattan";
+
+  template<bool aligned>
+  inline T _item_distance(const QueryNode* v_node, S j) const {
+    if (aligned)
+      return D::aligned_distance(v_node, _item_row<true>(j), _layout_item_norms ? _layout_item_norms[j] : T(0), _f);
+    return D::distance(v_node, _get(j), _f);
   }
-};
 
-template<typename S, typename T>
-class AnnoyIndexInterface {
- public:
-  // Note that the methods with an **error argument will allocate memory and write the pointer to that string if error is non-NULL
-  virtual ~AnnoyIndexInterface() {};
-  virtual bool add_item(S item, const T* w, char** error=NULL) = 0;
-  virtual bool build(int q, char** error=NULL) = 0;
-  virtual bool unbuild(char** error=NULL) = 0;
-  virtual bool save(const char* filename, bool prefault=false, char** error=NULL) = 0;
-  virtual void unload() = 0;
-  virtual bool load(const char* filename, bool prefault=false, char** error=NULL) = 0;
-  virtual T get_distance(S i, S j) const = 0;
-  virtual void get_nns_by_item(S item, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const = 0;
-  virtual void get_nns_by_vector(const T* w, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const = 0;
-  virtual S get_n_items() const = 0;
-  virtual S get_n_trees() const = 0;
-  virtual void verbose(bool v) = 0;
-  virtual void get_item(S item, T* v) const = 0;
-  virtual void set_seed(int q) = 0;
-  virtual bool on_disk_build(const char* filename, char** error=NULL) = 0;
-};
+  inline T _item_distance(const QueryNode* v_node, S j) const {
+    return _aligned ? _item_distance<true>(v_node, j) : _item_distance<false>(v_node, j);
+  }
 
-template<typename S, typename T, typename Distance, typename Random>
-  class AnnoyIndex : public AnnoyIndexInterface<S, T> {
-  /*
-   * We use random projection to build a forest of binary trees of all items.
-   * Basically just split the hyperspace into two sides by a hyperplane,
-   * then recursively split each of those subtrees etc.
-   * We create a tree like this q times. The default q is determined automatically
-   * in such a way that we at most use 2x as much memory as the vectors take.
-   */
-public:
-  typedef Distance D;
-  typedef typename D::template Node<S, T> Node;
+  template<bool aligned>
+  inline void _prefetch_item(S j) const {
+    if (aligned) {
+      prefetch_node(_item_row<true>(j), _f * sizeof(V));
+      if (_layout_item_norms)
+        prefetch_node(&_layout_item_norms[j], sizeof(T));
+    } else {
+      prefetch_node(_get(j), _s);
+    }
+  }
 
-protected:
-  const int _f;
-  size_t _s;
-  S _n_items;
-  Random _random;
-  void* _nodes; // Could either be mmapped, or point to a memory buffer that we reallocate
-  S _n_nodes;
-  S _nodes_size;
-  vector<S> _roots;
-  S _K;
-  bool _loaded;
-  bool _verbose;
-  int _fd;
-  bool _on_disk;
-  bool _built;
-public:
+  template<bool aligned>
+  inline S _tree_node(S i, const S** children, vector<S>* leaf) const {
+    // The n_descendants of tree node i, with the children of a split or the
+    // items of a leaf in *children. The items of packed leaves are unpacked
+    // into leaf.
+    if (aligned) {
+      const LayoutNode<S, T>& node = _layout_tree_nodes[i - _n_items];
+      if (node.n_descendants > _K) {
+        *children = node.children;
+      } else if (!node.children[0]) {
+        *children = _layout_leaf_items + node.offset;
+      } else {
+        if (leaf->size() < (size_t)node.n_descendants)
+          leaf->resize(node.n_descendants);
+        S* items = &(*leaf)[0];
+        const uint16_t* gaps = _layout_leaf_gaps + node.offset;
+        S item = items[0] = node.children[1];
+        for (S j = 1; j < node.n_descendants; j++)
+          items[j] = item += gaps[j - 1];
+        *children = items;
+      }
+      return node.n_descendants;
+    }
+    const Node* node = _get(i);
+    *children = node_children(node);
+    return node->n_descendants;
+  }
 
-   AnnoyIndex(int f) : _f(f), _random() {
-    _s = offsetof(Node, v) + _f * sizeof(T); // Size of each node
-    _verbose = false;
-    _built = false;
-    _K = (S) (((size_t) (_s - offsetof(Node, children))) / sizeof(S)); // Max number of descendants to fit into node
-    reinitialize(); // Reset everything
+  inline S _tree_node(S i, const S** children, vector<S>* leaf) const {
+    return _aligned ? _tree_node<true>(i, children, leaf) : _tree_node<false>(i, children, leaf);
   }
-  ~AnnoyIndex() {
-    unload();
+
+  template<bool aligned>
+  inline T _split_margin(S i, const T* v) const {
+    if (aligned) {
+      const LayoutNode<S, T>& node = _layout_tree_nodes[i - _n_items];
+      return D::aligned_margin(_layout_splits + _row_words * node.offset, node.aux, v, _f);
+    }
+    return D::margin(_get(i), v, _f);
   }
 
-  int get_f() const {
-    return _f;
+  template<bool aligned>
+  inline void _prefetch_tree_node(S i) const {
+    if (aligned)
+      prefetch_node(&_layout_tree_nodes[i - _n_items], sizeof(LayoutNode<S, T>));
+    else
+      prefetch_node(_get(i), _s);
   }
 
-  bool add_item(S item, const T* w, char** error=NULL) {
-    return add_item_impl(item, w, error);
+  S _make_root(const vector<S>& indices, vector<S>& work, Random& random, TreeArena& arena, WorkStealingPool* pool) {
+    // Every tree partitions its own copy of the indices in place. The second
+    // half of work is scratch space for the partitioning.
+    size_t n = indices.size();
+    work.resize(2 * n);
+    std::copy(indices.begin(), indices.end(), work.begin());
+    return _make_tree(n ? &work[0] : NULL, n ? &work[n] : NULL, n, true, random, arena, pool);
   }
 
-  template<typename W>
-  bool add_item_impl(S item, const W& w, char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't add an item to a loaded index");
-      return false;
-    }
-    _allocate_size(item + 1);
-    Node* n = _get(item);
+  S _make_tree(S* indices, S* scratch, size_t n, bool is_root, Random& random, TreeArena& arena, WorkStealingPool* pool) {
+    // The items of this subtree are indices[0], ..., indices[n-1]. They are
+    // partitioned in place between the two children, which then work on the
+    // two halves of the range; scratch[0..n) is temporary space for that.
+    // The basic rule is that if we have <= _K items, then it's a leaf node, otherwise it's a split node.
+    // There's some regrettable complications caused by the problem that root nodes have to be "special":
+    // 1. We identify root nodes by the arguable logic that _n_items == n->n_descendants, regardless of how many descendants they actually have
+    // 2. Root nodes with only 1 child need to be a "dummy" parent
+    // 3. Due to the _n_items "hack", we need to be careful with the cases where _n_items <= _K or _n_items > _K
+    if (n == 1 && !is_root)
+      return indices[0];
 
-    D::zero_value(n);
+    if (n <= (size_t)_K && (!is_root || (size_t)_n_items <= (size_t)_K || n == 1)) {
+      S item = _arena_allocate(arena);
+      Node* m = _arena_get(arena, item);
+      m->n_descendants = is_root ? _n_items : (S)n;
 
-    n->children[0] = 0;
-    n->children[1] = 0;
-    n->n_descendants = 1;
+      // Using std::copy instead of a loop seems to resolve issues #3 and #13,
+      // probably because gcc 4.8 goes overboard with optimizations.
+      // Using memcpy instead of std::copy for MSVC compatibility. #235
+      // Only copy when necessary to avoid crash in MSVC 9. #293
+      if (n > 0)
+        memcpy(m->children, indices, n * sizeof(S));
+      return _n_items + item;
+    }
 
-    for (int z = 0; z < _f; z++)
-      n->v[z] = w[z];
+    // Below this size the subtree is built serially on the current random stream
+    if (n < parallel_subtree_min_items)
+      pool = NULL;
 
-    D::init_node(n, _f);
+    // The split node is written to the arena right away rather than after its
+    // children; _layout_tree puts it in post-order anyway.
+    S item = _arena_allocate(arena);
+    Node* m = _arena_get(arena, item);
+    D::create_split(IndexedNodes<S, Node>(_nodes, _s, indices, n), _f, _s, random, m);
 
-    if (item >= _n_items)
-      _n_items = item + 1;
+    if (pool && n >= parallel_side_min_items) {
+      _parallel_sides(indices, scratch, n, m, random, pool);
+    } else {
+      for (size_t i = 0; i < n; i++)
+        scratch[i] = D::side(m, node_vector(_get(indices[i])), _f, random);
+    }
+    size_t n_left = _partition(indices, scratch, n);
 
-    return true;
-  }
+    // If we didn't find a hyperplane, just randomize sides as a last option
+    while (n_left == 0 || n_left == n) {
+      if (_verbose)
+        showUpdate("\tNo hyperplane found (left has %zu children, right has %zu children)\n",
+          n_left, n - n_left);
+      if (_verbose && n > 100000)
+        showUpdate("Failed splitting %zu items\n", n);
 
-  bool on_disk_build(const char* file, char** error=NULL) {
-    _on_disk = true;
-    _fd = open(file, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
-    if (_fd == -1) {
-      set_error_from_errno(error, "Unable to open");
-      _fd = 0;
-      return false;
+      // Set the vector to 0.0, and the offset of the plane with it, so that
+      // the margin of every point is 0 and queries never prune either side
+      for (int z = 0; z < _f; z++)
+        m->v[z] = 0;
+      D::template zero_value<Node>(m);
+
+      for (size_t i = 0; i < n; i++) {
+        // Just randomize...
+        scratch[i] = random.flip();
+      }
+      n_left = _partition(indices, scratch, n);
     }
-    _nodes_size = 1;
-    if (ftruncate(_fd, _s * _nodes_size) == -1) {
-      set_error_from_errno(error, "Unable to truncate");
-      return false;
+
+    S* children_indices[2] = {indices, indices + n_left};
+    S* children_scratch[2] = {scratch, scratch + n_left};
+    size_t children_size[2] = {n_left, n - n_left};
+    int flip = (children_size[0] > children_size[1]);
+
+    m->n_descendants = is_root ? _n_items : (S)n;
+    if (pool) {
+      // Both subtrees get their own random stream so that the result doesn't
+      // depend on which thread ends up building them. The larger subtree goes
+      // to the pool, where an idle worker can steal it.
+      Random child_random[2] = {Random(random.kiss()), Random(random.kiss())};
+      S child[2];
+      int large = flip ^ 1;
+      WorkStealingPool::Task task([&]() {
+        child[large] = _make_tree(children_indices[large], children_scratch[large], children_size[large],
+                                  false, child_random[large], arena, pool);
+      });
+      pool->spawn(&task);
+      child[flip] = _make_tree(children_indices[flip], children_scratch[flip], children_size[flip],
+                               false, child_random[flip], arena, pool);
+      pool->wait(&task);
+      m->children[0] = child[0];
+      m->children[1] = child[1];
+    } else {
+      for (int side = 0; side < 2; side++) {
+        // run _make_tree for the smallest child first (for cache locality)
+        m->children[side^flip] = _make_tree(children_indices[side^flip], children_scratch[side^flip],
+                                            children_size[side^flip], false, random, arena, NULL);
+      }
     }
-#ifdef MAP_POPULATE
-    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, 0);
-#else
-    _nodes = (Node*) mmap(0, _s * _nodes_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
-#endif
-    return true;
+
+    return _n_items + item;
   }
 
-  bool build(int q, char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't build a loaded index");
-      return false;
+  static size_t _partition(S* indices, S* scratch, size_t n) {
+    // Stable partition of indices by the sides in scratch: the items of side 0
+    // are compacted at the front and the items of side 1 are collected in
+    // scratch, which never overtakes the side being read, then copied after them.
+    size_t n_left = 0, n_right = 0;
+    for (size_t i = 0; i < n; i++) {
+      S j = indices[i];
+      if (scratch[i])
+        scratch[n_right++] = j;
+      else
+        indices[n_left++] = j;
     }
+    if (n_right > 0)
+      memcpy(indices + n_left, scratch, n_right * sizeof(S));
+    return n_left;
+  }
 
-    if (_built) {
-      set_error_from_string(error, "You can't build a built index");
-      return false;
+  void _parallel_sides(const S* indices, S* sides, size_t n, const Node* m, Random& random, WorkStealingPool* pool) {
+    // Computes the side of every item in fixed-size chunks. Ties are broken on
+    // a random stream per chunk, so the split doesn't depend on the scheduling.
+    size_t n_chunks = (n + parallel_side_chunk_items - 1) / parallel_side_chunk_items;
+    vector<Random> chunk_random;
+    for (size_t c = 0; c < n_chunks; c++)
+      chunk_random.push_back(Random(random.kiss()));
+
+    std::deque<WorkStealingPool::Task> tasks;
+    for (size_t c = 0; c < n_chunks; c++) {
+      tasks.emplace_back([&, c]() {
+        size_t end = std::min(n, (c + 1) * parallel_side_chunk_items);
+        for (size_t i = c * parallel_side_chunk_items; i < end; i++)
+          sides[i] = D::side(m, node_vector(_get(indices[i])), _f, chunk_random[c]);
+      });
+      pool->spawn(&tasks.back());
     }
+    for (size_t c = 0; c < n_chunks; c++)
+      pool->wait(&tasks[c]);
+  }
 
-    D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
-
-    _n_nodes = _n_items;
-    while (1) {
-      if (q == -1 && _n_nodes >= _n_items * 2)
-        break;
-      if (q != -1 && _roots.size() >= (size_t)q)
-        break;
-      if (_verbose) showUpdate("pass %zd...\n", _roots.size());
+  bool _build_trees_threaded(int q, int n_threads, const vector<S>& indices, char** error) {
+    // Trees are tasks on the same pool as their subtrees, so a few deep trees
+    // still keep every worker busy. They are built in rounds of one tree per
+    // worker, so that only that many arenas and work arrays are live at a
+    // time. A round is laid out into _nodes once all its tasks are done: the
+    // workers read the item vectors concurrently and a realloc would pull them
+    // from under them. The trees are committed in tree order, so the stopping
+    // rule for q == -1 sees the same sequence of trees whatever the scheduling.
+    WorkStealingPool pool(n_threads);
+    std::function<void(TreeBuild*)> make_tree = [&](TreeBuild* tree) {
+      vector<S> work;
+      tree->root = _make_root(indices, work, tree->random, tree->arena, &pool);
+    };
 
-      vector<S> indices;
-      for (S i = 0; i < _n_items; i++) {
-        if (_get(i)->n_descendants >= 1) // Issue #223
-          indices.push_back(i);
+    while (q == -1 || _roots.size() < (size_t)q) {
+      // For q == -1 anything started past the stopping point is thrown away
+      size_t n_round = pool.size();
+      if (q != -1)
+        n_round = std::min(n_round, (size_t)q - _roots.size());
+      std::deque<TreeBuild> trees;
+      for (size_t tree = 0; tree < n_round; tree++) {
+        if (_verbose) showUpdate("pass %zd...\n", _roots.size() + tree);
+        trees.emplace_back(indices.size(), Random(_random.kiss()), make_tree);
+        pool.spawn(&trees.back().task);
+      }
+      for (size_t tree = 0; tree < trees.size(); tree++)
+        pool.wait(&trees[tree].task);
+
+      for (; !trees.empty(); trees.pop_front()) {
+        if (q == -1 && _n_nodes >= _n_items * 2)
+          return true;
+        S root = _layout_tree(trees.front().arena, trees.front().root, error);
+        if (root == -1)
+          return false;
+        _roots.push_back(root);
       }
+    }
+    return true;
+  }
 
-      _roots.push_back(_make_tree(indices, true));
+  S _arena_allocate(TreeArena& arena) {
+    size_t i = arena.n_nodes++;
+    std::atomic<void*>& block = arena.blocks[i >> TreeArena::block_bits];
+    if (!block.load(std::memory_order_acquire)) {
+      void* nodes = calloc((size_t)1 << TreeArena::block_bits, _s);
+      void* expected = NULL;
+      if (!block.compare_exchange_strong(expected, nodes))
+        free(nodes);
     }
+    return (S)i;
+  }
 
-    // Also, copy the roots into the last segment of the array
-    // This way we can load them faster without reading the whole file
-    _allocate_size(_n_nodes + (S)_roots.size());
-    for (size_t i = 0; i < _roots.size(); i++)
-      memcpy(_get(_n_nodes + (S)i), _get(_roots[i]), _s);
-    _n_nodes += _roots.size();
+  inline Node* _arena_get(const TreeArena& arena, const S i) const {
+    void* block = arena.blocks[(size_t)i >> TreeArena::block_bits].load(std::memory_order_acquire);
+    return get_node_ptr<S, Node>(block, _s, i & (((S)1 << TreeArena::block_bits) - 1));
+  }
 
-    if (_verbose) showUpdate("has %d nodes\n", _n_nodes);
+  S _layout_tree(const TreeArena& arena, S root, char** error) {
+    // Append the tree after the nodes already in _nodes, numbering the nodes in
+    // the post-order of a serial build: smallest child first, then the parent,
+    // or in the _tree_order chosen. Either makes the layout independent of the
+    // order in which concurrent subtrees allocated their arena nodes. Returns
+    // -1 when there is no room for the tree, which is made here at once, so
+    // that the _new_node calls below can't fail.
+    if (!_allocate_size(_n_nodes + (S)arena.n_nodes, error))
+      return -1;
+    if (_tree_order == tree_order_post || root < _n_items)
+      return _layout_subtree(arena, root);
+
+    vector<S> order;
+    if (_tree_order == tree_order_bfs) {
+      order.push_back(root);
+      for (size_t k = 0; k < order.size(); k++)
+        _push_tree_children(arena, order[k], &order);
+    } else {
+      _blocked_order(arena, root, std::max((size_t)1, tree_block_bytes / _s), &order);
+    }
+    vector<S> ids((size_t)arena.n_nodes);
+    for (size_t k = 0; k < order.size(); k++)
+      ids[order[k] - _n_items] = _new_node();
+    for (size_t k = 0; k < order.size(); k++) {
+      const Node* n = _arena_get(arena, order[k] - _n_items);
+      Node* m = _get(ids[order[k] - _n_items]);
+      memcpy(m, n, _s);
+      if (n->n_descendants > _K) {
+        for (int side = 0; side < 2; side++) {
+          if (n->children[side] >= _n_items)
+            m->children[side] = ids[n->children[side] - _n_items];
+        }
+      }
+    }
+    return ids[root - _n_items];
+  }
 
-    if (_on_disk) {
-      _nodes = remap_memory(_nodes, _fd, _s * _nodes_size, _s * _n_nodes);
-      if (ftruncate(_fd, _s * _n_nodes)) {
-        // TODO: this probably creates an index in a corrupt state... not sure what to do
-        set_error_from_errno(error, "Unable to truncate");
-        return false;
+  void _push_tree_children(const TreeArena& arena, S i, vector<S>* nodes) const {
+    // Appends the children of split i that aren't items, the smaller first
+    // like the post-order
+    const Node* n = _arena_get(arena, i - _n_items);
+    if (n->n_descendants <= _K)
+      return;
+    S children[2] = {n->children[0], n->children[1]};
+    S sizes[2];
+    for (int side = 0; side < 2; side++)
+      sizes[side] = children[side] < _n_items ? 1 : _arena_get(arena, children[side] - _n_items)->n_descendants;
+    int flip = (sizes[0] > sizes[1]);
+    for (int side = 0; side < 2; side++) {
+      if (children[side^flip] >= _n_items)
+        nodes->push_back(children[side^flip]);
+    }
+  }
+
+  void _blocked_order(const TreeArena& arena, S top, size_t block_nodes, vector<S>* order) const {
+    // Numbers the top levels of the subtree under top level by level until
+    // block_nodes of them fill a block, then the subtrees below them the same
+    // way, one after another, like a van Emde Boas layout cut at the size of
+    // a page. A query then reads a block for every log2(block_nodes) levels
+    // it goes down, rather than a page per node.
+    size_t begin = order->size();
+    order->push_back(top);
+    vector<S> below;
+    for (size_t k = begin; k < order->size(); k++) {
+      vector<S>* nodes = order->size() - begin < block_nodes ? order : &below;
+      _push_tree_children(arena, (*order)[k], nodes);
+      if (nodes == order && order->size() - begin > block_nodes) {
+        // The second child doesn't fit any more
+        below.push_back(order->back());
+        order->pop_back();
       }
-      _nodes_size = _n_nodes;
     }
-    _built = true;
-    return true;
+    for (size_t k = 0; k < below.size(); k++)
+      _blocked_order(arena, below[k], block_nodes, order);
   }
 
-  bool unbuild(char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't unbuild a loaded index");
-      return false;
+  S _layout_subtree(const TreeArena& arena, S i) {
+    if (i < _n_items)
+      return i;
+    const Node* n = _arena_get(arena, i - _n_items);
+    S children[2] = {n->children[0], n->children[1]};
+    if (n->n_descendants > _K) {
+      S sizes[2];
+      for (int side = 0; side < 2; side++)
+        sizes[side] = children[side] < _n_items ? 1 : _arena_get(arena, children[side] - _n_items)->n_descendants;
+      int flip = (sizes[0] > sizes[1]);
+      for (int side = 0; side < 2; side++)
+        children[side^flip] = _layout_subtree(arena, children[side^flip]);
+    }
+    S item = _new_node();
+    Node* m = _get(item);
+    memcpy(m, n, _s);
+    if (n->n_descendants > _K) {
+      m->children[0] = children[0];
+      m->children[1] = children[1];
     }
+    return item;
+  }
 
-    _roots.clear();
-    _n_nodes = _n_items;
-    _built = false;
+  S _new_node(char** error=NULL) {
+    // Free nodes only exist once the trees are changed, so a build just
+    // appends. Returns -1 when there is no room for another node.
+    if (!_free_nodes.empty()) {
+      S item = _free_nodes.back();
+      _free_nodes.pop_back();
+      memset((void*)_get(item), 0, _s);
+      return item;
+    }
+    if (!_allocate_size(_n_nodes + 1, error))
+      return -1;
+    memset((void*)_get(_n_nodes), 0, _s);
+    return _n_nodes++;
+  }
 
-    return true;
+  void _free_node(S item) {
+    // Unused nodes have no descendants
+    memset((void*)_get(item), 0, _s);
+    if (item == _n_nodes - 1)
+      _n_nodes--;
+    else
+      _free_nodes.push_back(item);
   }
 
-  bool save(const char* filename, bool prefault=false, char** error=NULL) {
-    if (!_built) {
-      set_error_from_string(error, "You can't save an index that hasn't been built");
+  void _remap(S old_nodes_size, S new_nodes_size) {
+    void* mapped = remap_memory((char*)_nodes - _data_offset, _fd,
+                                _data_offset + _s * old_nodes_size, _data_offset + _s * new_nodes_size);
+    _nodes = (char*)mapped + _data_offset;
+  }
+
+  bool _truncate_on_disk(bool checksum, char** error) {
+    // Gives back the room the file was grown by past its last node, then
+    // writes the roots after the nodes and the header before them. Reading
+    // the whole file for a checksum of both is left to save: otherwise the
+    // header keeps the checksum it was loaded with, or none once the trees
+    // have changed. Files without a header are left without one.
+    if (_nodes_size != _n_nodes) {
+      _remap(_nodes_size, _n_nodes);
+      _nodes_size = _n_nodes;
+    }
+    off_t nodes_end = (off_t)(_data_offset + _s * (size_t)_n_nodes);
+    off_t roots_bytes = (off_t)(sizeof(S) * _roots.size());
+    if (ftruncate(_fd, _data_offset ? nodes_end + roots_bytes : nodes_end)) {
+      set_error_from_errno(error, "Unable to truncate");
       return false;
     }
-    if (_on_disk) {
+    if (!_data_offset)
       return true;
-    } else {
-      // Delete file if it already exists (See issue #335)
-      unlink(filename);
-
-      FILE *f = fopen(filename, "wb");
-      if (f == NULL) {
-        set_error_from_errno(error, "Unable to open");
-        return false;
-      }
+    if (roots_bytes > 0 &&
+        (lseek(_fd, nodes_end, SEEK_SET) != nodes_end ||
+         write(_fd, &_roots[0], (unsigned)roots_bytes) != (int)roots_bytes)) {
+      set_error_from_errno(error, "Unable to write");
+      return false;
+    }
+    if (checksum)
+      _checksum = _file_checksum();
+    _fill_header((IndexHeader*)((char*)_nodes - _data_offset), _data_offset, _checksum);
+    return true;
+  }
 
-      if (fwrite(_nodes, _s, _n_nodes, f) != (size_t) _n_nodes) {
-        set_error_from_errno(error, "Unable to write");
+  bool _insert_items(S first_item, S n, const T* w, char** error) {
+    // Adds items to a built index without rebuilding it. Every new item goes
+    // down each tree by the side of the split planes and is appended to the
+    // leaf it ends up in, and leaves that overflow are split again over their
+    // own items. The tree nodes in the way of the new item ids are moved to
+    // the end, so the index only grows at the end and unchanged parts of an
+    // index file stay in place. Items added this way don't go through
+    // D::preprocess. Queries wait while this runs, as it moves the nodes
+    // they read.
+    std::lock_guard<ReadWriteLock> lock(_tree_lock);
+    ClearCacheOnExit clear_cache(_result_cache);
+    for (S i = first_item; i < first_item + n; i++) {
+      if (i < _n_items && _get(i)->n_descendants >= 1) {
+        set_error_from_string(error, "You can't replace an item of a built index");
         return false;
       }
-
-      if (fclose(f) == EOF) {
-        set_error_from_errno(error, "Unable to close");
-        return false;
+    }
+    if (!_prepare_update(first_item + n, error))
+      return false;
+    for (S i = 0; i < n; i++) {
+      _set_item(first_item + i, w + (size_t)i * _f);
+      if (_quantized())
+        _encode_item(first_item + i);
+    }
+    vector<bool> root_leaf(_roots.size());
+    for (size_t tree = 0; tree < _roots.size(); tree++) {
+      // A root leaf holds every item of the index, whatever its n_descendants
+      // says (see _make_tree), so that tree is built again over all of them
+      root_leaf[tree] = _get(_roots[tree])->n_descendants <= _K;
+      if (root_leaf[tree]) {
+        vector<S> items;
+        for (S j = 0; j < _n_items; j++) {
+          if (_has_item(j))
+            items.push_back(j);
+        }
+        if (!_rebuild_subtree(_roots[tree], items, true, error))
+          return false;
       }
-
-      unload();
-      return load(filename, prefault, error);
     }
+    for (S i = first_item; i < first_item + n; i++) {
+      for (size_t tree = 0; tree < _roots.size(); tree++) {
+        if (!root_leaf[tree] && !_insert_into_tree(tree, i, error))
+          return false;
+      }
+    }
+    if (!_place_roots(error))
+      return false;
+    _size_deleted();
+    return true;
   }
 
-  void reinitialize() {
-    _fd = 0;
-    _nodes = NULL;
-    _loaded = false;
-    _n_items = 0;
-    _n_nodes = 0;
-    _nodes_size = 0;
-    _on_disk = false;
-    _roots.clear();
-  }
-
-  void unload() {
-    if (_on_disk && _fd) {
-      close(_fd);
-      munmap(_nodes, _s * _nodes_size);
-    } else {
-      if (_fd) {
-        // we have mmapped data
-        close(_fd);
-        munmap(_nodes, _n_nodes * _s);
-      } else if (_nodes) {
-        // We have heap allocated data
-        free(_nodes);
+  bool _prepare_update(S n, char** error) {
+    // Reserves the nodes below n for items. Moving the tree nodes out of the
+    // way takes a pass over all tree nodes to find their parents; the same
+    // pass collects the unused nodes, starting with the copies of the roots
+    // that build() and load() leave next to the roots in use.
+    if (!_updating)
+      _n_item_slots = _n_items;
+    else if (n <= _n_item_slots)
+      return true;
+    S begin = _n_item_slots;
+    S end = begin;
+    if (n > begin)
+      end = std::max(n, begin + std::max(begin / 64, (S)insert_min_item_slots));
+
+    vector<S> roots(_roots);
+    std::sort(roots.begin(), roots.end());
+    vector<pair<S, int> > links; // Parent and side of the tree nodes below end
+    _free_nodes.clear();
+    for (S i = begin; i < _n_nodes; i++) {
+      Node* m = _get(i);
+      if (std::binary_search(roots.begin(), roots.end(), i))
+        continue;
+      if (m->n_descendants == _n_items) // Only roots have that many descendants
+        m->n_descendants = 0;
+      if (m->n_descendants == 0) {
+        if (i >= end)
+          _free_nodes.push_back(i);
+      } else if (m->n_descendants > _K) {
+        for (int side = 0; side < 2; side++) {
+          if (m->children[side] >= begin && m->children[side] < end)
+            links.push_back(make_pair(i, side));
+        }
+      }
+    }
+    for (size_t tree = 0; tree < roots.size(); tree++) {
+      Node* m = _get(roots[tree]);
+      if (m->n_descendants > _K) {
+        for (int side = 0; side < 2; side++) {
+          if (m->children[side] >= begin && m->children[side] < end)
+            links.push_back(make_pair(roots[tree], side));
+        }
       }
     }
-    reinitialize();
-    if (_verbose) showUpdate("unloaded\n");
-  }
 
-  bool load(const char* filename, bool prefault=false, char** error=NULL) {
-    _fd = open(filename, O_RDONLY, (int)0400);
-    if (_fd == -1) {
-      set_error_from_errno(error, "Unable to open");
-      _fd = 0;
+    // Copy the nodes in the way after everything else, then fix the links
+    vector<S> moved(end - begin, 0);
+    S n_nodes = std::max(_n_nodes, end);
+    if (!_allocate_size(n_nodes + (S)(links.size() + _roots.size()), error))
       return false;
+    _n_nodes = n_nodes;
+    for (size_t l = 0; l < links.size(); l++) {
+      S child = _get(links[l].first)->children[links[l].second];
+      if (!moved[child - begin]) {
+        moved[child - begin] = _n_nodes++;
+        memcpy(_get(moved[child - begin]), _get(child), _s);
+      }
     }
-    off_t size = lseek_getsize(_fd);
-    if (size == -1) {
-      set_error_from_errno(error, "Unable to get size");
-      return false;
-    } else if (size == 0) {
-      set_error_from_errno(error, "Size of file is zero");
-      return false;
-    } else if (size % _s) {
-      // Something is fishy with this index!
-      set_error_from_errno(error, "Index size is not a multiple of vector size");
-      return false;
+    for (size_t tree = 0; tree < _roots.size(); tree++) {
+      if (_roots[tree] < end) {
+        S root = _roots[tree];
+        _roots[tree] = _n_nodes++;
+        memcpy(_get(_roots[tree]), _get(root), _s);
+        if (root >= begin)
+          moved[root - begin] = _roots[tree];
+      }
     }
-
-    int flags = MAP_SHARED;
-    if (prefault) {
-#ifdef MAP_POPULATE
-      flags |= MAP_POPULATE;
-#else
-      showUpdate("prefault is set to true, but MAP_POPULATE is not defined on this platform");
-#endif
+    for (size_t l = 0; l < links.size(); l++) {
+      S parent = links[l].first;
+      if (parent < end)
+        parent = moved[parent - begin];
+      Node* m = _get(parent);
+      m->children[links[l].second] = moved[m->children[links[l].second] - begin];
     }
-    _nodes = (Node*)mmap(0, size, PROT_READ, flags, _fd, 0);
-    _n_nodes = (S)(size / _s);
+    if (end > begin)
+      memset((void*)_get(begin), 0, (size_t)(end - begin) * _s);
+    _n_item_slots = end;
+    _updating = true;
+    return true;
+  }
 
-    // Find the roots by scanning the end of the file and taking the nodes with most descendants
-    _roots.clear();
-    S m = -1;
-    for (S i = _n_nodes - 1; i >= 0; i--) {
-      S k = _get(i)->n_descendants;
-      if (m == -1 || k == m) {
-        _roots.push_back(i);
-        m = k;
+  bool _insert_into_tree(size_t tree, S item, char** error) {
+    S parent = -1;
+    int side = 0;
+    S i = _roots[tree];
+    while (true) {
+      if (i < _n_items) {
+        // A subtree of one item, make a leaf with both
+        S leaf = _new_node(error);
+        if (leaf == -1)
+          return false;
+        Node* m = _get(leaf);
+        m->n_descendants = 2;
+        m->children[0] = i;
+        m->children[1] = item;
+        _get(parent)->children[side] = leaf;
+        return true;
+      }
+      Node* m = _get(i);
+      if (m->n_descendants > _K) {
+        // Roots have _n_items descendants whatever their size, see _make_tree
+        m->n_descendants = parent == -1 ? _n_items : m->n_descendants + 1;
+        parent = i;
+        side = D::side(m, node_vector(_get(item)), _f, _random);
+        i = m->children[side];
+      } else if (m->n_descendants < _K) {
+        // Root leaves are rebuilt by _insert_items instead
+        node_children(m)[m->n_descendants++] = item;
+        return true;
       } else {
-        break;
+        vector<S> items(node_children(m), node_children(m) + m->n_descendants);
+        items.push_back(item);
+        return _rebuild_subtree(i, items, false, error);
       }
     }
-    // hacky fix: since the last root precedes the copy of all roots, delete it
-    if (_roots.size() > 1 && _get(_roots.front())->children[0] == _get(_roots.back())->children[0])
-      _roots.pop_back();
-    _loaded = true;
-    _built = true;
-    _n_items = m;
-    if (_verbose) showUpdate("found %lu roots with degree %d\n", _roots.size(), m);
-    return true;
   }
 
-  T get_distance(S i, S j) const {
-    return D::normalized_distance(D::distance(_get(i), _get(j), _f));
+  bool _rebuild_subtree(S i, vector<S>& items, bool is_root, char** error) {
+    // Builds a new subtree over items and puts its top node in place of node i
+#ifndef NDEBUG
+    vector<S> sorted(items);
+    std::sort(sorted.begin(), sorted.end());
+    assert(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+#endif
+    size_t n = items.size();
+    vector<S> scratch(n);
+    TreeArena arena(n);
+    S top = _make_tree(&items[0], &scratch[0], n, is_root, _random, arena, NULL);
+    top = _layout_tree(arena, top, error);
+    if (top == -1)
+      return false;
+    memcpy(_get(i), _get(top), _s);
+    _free_node(top);
+    return true;
   }
 
-  void get_nns_by_item(S item, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const {
-    // TODO: handle OOB
-    const Node* m = _get(item);
-    _get_all_nns(m->v, n, search_k, result, distances);
+  bool _place_roots(char** error) {
+    // Ends every change to the trees of a built index. Files without a header
+    // have their roots found at their end by load(), so keep them there.
+    _checksum = 0;
+    size_t q = _roots.size();
+    bool at_end = true;
+    for (size_t tree = 0; tree < q; tree++) {
+      if ((size_t)_roots[tree] + q < (size_t)_n_nodes)
+        at_end = false;
+    }
+    if (at_end)
+      return true;
+    S first = _n_nodes;
+    if (!_allocate_size(_n_nodes + (S)q, error))
+      return false;
+    _n_nodes += (S)q;
+    for (size_t tree = 0; tree < q; tree++) {
+      memcpy(_get(first + (S)tree), _get(_roots[tree]), _s);
+      _free_node(_roots[tree]);
+      _roots[tree] = first + (S)tree;
+    }
+    return true;
   }
 
-  void get_nns_by_vector(const T* w, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const {
-    _get_all_nns(w, n, search_k, result, distances);
+  inline bool _is_deleted(S item) const {
+    return (size_t)item / 64 < _deleted.size() && (_deleted[item / 64].bits.load(std::memory_order_relaxed) >> (item % 64)) & 1;
   }
 
-  S get_n_items() const {
-    return _n_items;
+  S _compact_subtree(S i, S* n_live) {
+    // Returns what to put in place of subtree i: itself, one of its subtrees,
+    // or a single item. A subtree without items left becomes one of its
+    // deleted items, which queries skip.
+    if (i < _n_items) {
+      *n_live = _is_deleted(i) ? 0 : 1;
+      return i;
+    }
+    Node* m = _get(i);
+    if (m->n_descendants <= _K) {
+      S* leaf = node_children(m);
+      S deleted = leaf[0];
+      S n = 0;
+      for (S j = 0; j < m->n_descendants; j++) {
+        if (!_is_deleted(leaf[j]))
+          leaf[n++] = leaf[j];
+      }
+      *n_live = n;
+      if (n >= 2) {
+        m->n_descendants = n;
+        return i;
+      }
+      S item = n == 1 ? m->children[0] : deleted;
+      _free_node(i);
+      return item;
+    }
+    S children[2], sizes[2];
+    for (int side = 0; side < 2; side++)
+      children[side] = _compact_subtree(m->children[side], &sizes[side]);
+    *n_live = sizes[0] + sizes[1];
+    if (sizes[0] == 0 || sizes[1] == 0) {
+      _free_node(i);
+      return children[sizes[0] == 0];
+    }
+    if (*n_live <= _K) {
+      vector<S> items;
+      for (int side = 0; side < 2; side++)
+        _take_items(children[side], &items);
+      m->n_descendants = *n_live;
+      memcpy(m->children, &items[0], items.size() * sizeof(S));
+      return i;
+    }
+    m->n_descendants = *n_live;
+    m->children[0] = children[0];
+    m->children[1] = children[1];
+    return i;
   }
 
-  S get_n_trees() const {
-    return (S)_roots.size();
+  void _take_items(S i, vector<S>* items) {
+    // Collects the items of a compacted subtree and frees its nodes
+    if (i < _n_items) {
+      items->push_back(i);
+      return;
+    }
+    Node* m = _get(i);
+    if (m->n_descendants <= _K) {
+      items->insert(items->end(), node_children(m), node_children(m) + m->n_descendants);
+    } else {
+      _take_items(m->children[0], items);
+      _take_items(m->children[1], items);
+    }
+    _free_node(i);
   }
 
-  void verbose(bool v) {
-    _verbose = v;
-  }
+  template<typename Queries>
+  void _get_all_nns_batch(const Queries& queries, size_t n_queries, size_t n, size_t search_k, S* result, T* distances, int n_threads) const {
+    // Answers queries(0), ..., queries(n_queries - 1) on n_threads threads (-1
+    // for all cores). The results of query q go to result[q * n, (q + 1) * n)
+    // and the same range of distances, if not NULL. The rest of the range is
+    // left as it is when fewer than n items are found. A query that is NULL
+    // is skipped, with all its results set to -1.
+    std::function<void(size_t, size_t)> run = [&](size_t begin, size_t end) {
+      if (_aligned)
+        _get_all_nns_interleaved<true>(queries, begin, end, n, search_k, result, distances);
+      else
+        _get_all_nns_interleaved<false>(queries, begin, end, n, search_k, result, distances);
+    };
 
-  void get_item(S item, T* v) const {
-    // TODO: handle OOB
-    Node* m = _get(item);
-    memcpy(v, m->v, (_f) * sizeof(T));
+    if (n_threads == -1)
+      n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    if (n_threads <= 1 || n_queries <= batch_chunk_queries) {
+      run(0, n_queries);
+      return;
+    }
+    std::shared_ptr<WorkStealingPool> pool = _batch_pool(n_threads);
+    std::deque<WorkStealingPool::Task> tasks;
+    for (size_t begin = 0; begin < n_queries; begin += batch_chunk_queries) {
+      size_t end = std::min(n_queries, begin + batch_chunk_queries);
+      tasks.emplace_back(std::bind(run, begin, end));
+      pool->spawn(&tasks.back());
+    }
+    for (size_t t = 0; t < tasks.size(); t++)
+      pool->wait(&tasks[t]);
   }
 
-  void set_seed(int seed) {
-    _random.set_seed(seed);
+  std::shared_ptr<WorkStealingPool> _batch_pool(int n_threads) const {
+    // The pool of the last batch, which the next batches share unless they
+    // ask for another number of threads. A batch still running on a
+    // replaced pool keeps it until it is done.
+    std::lock_guard<std::mutex> lock(_query_pool_mutex);
+    if (!_query_pool || (int)_query_pool->size() != n_threads)
+      _query_pool = std::make_shared<WorkStealingPool>(n_threads);
+    return _query_pool;
   }
 
-protected:
-  void _allocate_size(S n) {
-    if (n > _nodes_size) {
-      const double reallocation_factor = 1.3;
-      S new_nodes_size = std::max(n, (S) ((_nodes_size + 1) * reallocation_factor));
-      void *old = _nodes;
+  template<bool aligned>
+  void _get_all_within(const T* v, T radius, size_t search_k, vector<S>* result, vector<T>* distances) const {
+    // The search of _get_all_nns, but keeping every candidate within radius
+    // instead of the n nearest, and leaving out the nodes whose priority
+    // bounds the distance to all their items above radius. Pruned that way a
+    // single tree already yields every item within radius, so without a
+    // search_k only the first tree is searched, to the end.
+    QueryNode* v_node = (QueryNode*)alloca(_query_s);
+    D::template zero_value<QueryNode>(v_node);
+    copy_vector(node_vector(v_node), v, _f);
+    D::init_node(v_node, _f);
 
-      if (_on_disk) {
-        int rc = ftruncate(_fd, _s * new_nodes_size);
-        if (_verbose && rc) showUpdate("File truncation error\n");
-        _nodes = remap_memory(_nodes, _fd, _s * _nodes_size, _s * new_nodes_size);
+    QueryScratch& scratch = _query_scratch();
+    vector<pair<T, S> >& q = scratch.queue;
+    q.clear();
+    size_t n_roots = search_k == (size_t)-1 ? std::min(_roots.size(), (size_t)1) : _roots.size();
+    for (size_t i = 0; i < n_roots; i++) {
+      q.push_back(make_pair(Distance::template pq_initial_value<T>(), _roots[i]));
+      std::push_heap(q.begin(), q.end());
+    }
+
+    vector<uint64_t>& visited = scratch.visited;
+    if (visited.size() < ((size_t)_n_items + 63) / 64)
+      visited.resize(((size_t)_n_items + 63) / 64, 0);
+    vector<S>& nns = scratch.nns;
+    nns.clear();
+    vector<pair<T, S> >& within = scratch.top;
+    within.clear();
+
+    size_t n_candidates = 0;
+    auto add_candidate = [&](S j) {
+      n_candidates++;
+      uint64_t bit = (uint64_t)1 << (j % 64);
+      if (visited[j / 64] & bit)
+        return;
+      visited[j / 64] |= bit;
+      nns.push_back(j);
+      if (!_has_item<aligned>(j))  // This is only to guard a really obscure case, #284
+        return;
+      T d = _item_distance<aligned>(v_node, j);
+      if (D::normalized_distance(d) <= radius)
+        within.push_back(make_pair(d, j));
+    };
+
+    while (n_candidates < search_k && !q.empty()) {
+      std::pop_heap(q.begin(), q.end());
+      T d = q.back().first;
+      S i = q.back().second;
+      q.pop_back();
+      if (i < _n_items) {
+        if (!_is_deleted(i))
+          add_candidate(i);
+        continue;
+      }
+      const S* dst;
+      S n_descendants = _tree_node<aligned>(i, &dst, &scratch.leaf);
+      if (n_descendants <= _K) {
+        for (S j = 0; j < n_descendants; j++)
+          _prefetch_item<aligned>(dst[j]);
+        for (S j = 0; j < n_descendants; j++) {
+          if (_n_deleted == 0 || !_is_deleted(dst[j]))
+            add_candidate(dst[j]);
+        }
       } else {
-        _nodes = realloc(_nodes, _s * new_nodes_size);
-        memset((char *) _nodes + (_nodes_size * _s) / sizeof(char), 0, (new_nodes_size - _nodes_size) * _s);
+        T margin = _split_margin<aligned>(i, v);
+        for (int side = 1; side >= 0; side--) {
+          T pq = D::pq_distance(d, margin, side);
+          if (!(D::pq_distance_bound(v_node, pq) > radius)) {
+            q.push_back(make_pair(pq, static_cast<S>(dst[side])));
+            std::push_heap(q.begin(), q.end());
+          }
+        }
       }
+    }
 
-      _nodes_size = new_nodes_size;
-      if (_verbose) showUpdate("Reallocating to %d nodes: old_address=%p, new_address=%p\n", new_nodes_size, old, _nodes);
+    for (size_t i = 0; i < nns.size(); i++)
+      visited[nns[i] / 64] &= ~((uint64_t)1 << (nns[i] % 64));
+
+    std::sort(within.begin(), within.end());
+    for (size_t i = 0; i < within.size(); i++) {
+      if (distances)
+        distances->push_back(D::normalized_distance(within[i].first));
+      result->push_back(within[i].second);
     }
   }
 
-  inline Node* _get(const S i) const {
-    return get_node_ptr<S, Node>(_nodes, _s, i);
-  }
+  template<bool aligned, typename Queries>
+  void _get_all_nns_interleaved(const Queries& queries, size_t begin, size_t end, size_t n, size_t search_k,
+                                S* result, T* distances) const {
+    // Answers queries(begin), ..., queries(end - 1) like _get_all_nns, with
+    // the same results, but keeps interleaved_queries of them going at once.
+    // Before a query gives way to the next one, it prefetches the node or the
+    // candidates its next step reads, which have usually reached the cache by
+    // the time its turn comes again. This hides most of the memory latency of
+    // indexes much larger than the cache.
+    static thread_local vector<QueryScratch> scratches(interleaved_queries);
+    InterleavedQuery lanes[interleaved_queries];
+    for (size_t l = 0; l < interleaved_queries; l++)
+      lanes[l].query = (size_t)-1;
 
-  S _make_tree(const vector<S >& indices, bool is_root) {
-    // The basic rule is that if we have <= _K items, then it's a leaf node, otherwise it's a split node.
-    // There's some regrettable complications caused by the problem that root nodes have to be "special":
-    // 1. We identify root nodes by the arguable logic that _n_items == n->n_descendants, regardless of how many descendants they actually have
-    // 2. Root nodes with only 1 child need to be a "dummy" parent
-    // 3. Due to the _n_items "hack", we need to be careful with the cases where _n_items <= _K or _n_items > _K
-    if (indices.size() == 1 && !is_root)
-      return indices[0];
+    if (search_k == (size_t)-1) {
+      search_k = n * _roots.size();
+    }
+
+    size_t next = begin, n_running = 0;
+    do {
+      for (size_t l = 0; l < interleaved_queries; l++) {
+        InterleavedQuery& lane = lanes[l];
+        QueryScratch& scratch = scratches[l];
+        if (lane.query == (size_t)-1) {
+          if (next == end)
+            continue;
+          const T* v = queries(next);
+          if (!v) {
+            std::fill(result + next * n, result + (next + 1) * n, (S)-1);
+            next++;
+            continue;
+          }
+          _start_interleaved<aligned>(next, v, &lane, &scratch);
+          next++;
+          n_running++;
+        } else if (lane.traversing) {
+          _traverse_interleaved<aligned>(search_k, &lane, &scratch);
+        } else if (_score_interleaved<aligned>(n, &lane, &scratch)) {
+          _finish_interleaved<aligned>(n, &lane, &scratch, result + lane.query * n, distances ? distances + lane.query * n : NULL);
+          lane.query = (size_t)-1;
+          n_running--;
+        }
+      }
+    } while (n_running > 0 || next < end);
+  }
 
-    if (indices.size() <= (size_t)_K && (!is_root || (size_t)_n_items <= (size_t)_K || indices.size() == 1)) {
-      _allocate_size(_n_nodes + 1);
-      S item = _n_nodes++;
-      Node* m = _get(item);
-      m->n_descendants = is_root ? _n_items : (S)indices.size();
+  template<bool aligned>
+  void _start_interleaved(size_t query, const T* v, InterleavedQuery* lane, QueryScratch* scratch) const {
+    lane->query = query;
+    lane->v = v;
+    lane->n_candidates = 0;
+    lane->n_scored = 0;
+    lane->traversing = true;
+
+    scratch->query.resize((_query_s + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    QueryNode* v_node = (QueryNode*)&scratch->query[0];
+    D::template zero_value<QueryNode>(v_node);
+    copy_vector(node_vector(v_node), v, _f);
+    D::init_node(v_node, _f);
+    _prepare_quantized(v, &scratch->quantized);
 
-      // Using std::copy instead of a loop seems to resolve issues #3 and #13,
-      // probably because gcc 4.8 goes overboard with optimizations.
-      // Using memcpy instead of std::copy for MSVC compatibility. #235
-      // Only copy when necessary to avoid crash in MSVC 9. #293
-      if (!indices.empty())
-        memcpy(m->children, &indices[0], indices.size() * sizeof(S));
-      return item;
+    vector<pair<T, S> >& q = scratch->queue;
+    q.clear();
+    for (size_t i = 0; i < _roots.size(); i++) {
+      q.push_back(make_pair(Distance::template pq_initial_value<T>(), _roots[i]));
+      std::push_heap(q.begin(), q.end());
     }
+    if (scratch->visited.size() < ((size_t)_n_items + 63) / 64)
+      scratch->visited.resize(((size_t)_n_items + 63) / 64, 0);
+    scratch->nns.clear();
+    scratch->top.clear();
+    if (!q.empty())
+      _prefetch_tree_node<aligned>(q.front().second);
+  }
 
-    vector<Node*> children;
-    for (size_t i = 0; i < indices.size(); i++) {
-      S j = indices[i];
-      Node* n = _get(j);
-      if (n)
-        children.push_back(n);
+  template<bool aligned>
+  void _traverse_interleaved(size_t search_k, InterleavedQuery* lane, QueryScratch* scratch) const {
+    // Visits the nearest node in the queue, which was prefetched by the
+    // previous step
+    vector<pair<T, S> >& q = scratch->queue;
+    if (lane->n_candidates >= search_k || q.empty()) {
+      lane->traversing = false;
+      for (size_t k = 0; k < scratch->nns.size() && k < interleaved_score_step; k++)
+        _prefetch_candidate<aligned>(scratch->nns[k]);
+      return;
     }
 
-    vector<S> children_indices[2];
-    Node* m = (Node*)alloca(_s);
-    D::create_split(children, _f, _s, _random, m);
+    vector<uint64_t>& visited = scratch->visited;
+    auto add_candidate = [&](S j) {
+      lane->n_candidates++;
+      uint64_t bit = (uint64_t)1 << (j % 64);
+      if (visited[j / 64] & bit)
+        return;
+      visited[j / 64] |= bit;
+      scratch->nns.push_back(j);
+    };
 
-    for (size_t i = 0; i < indices.size(); i++) {
-      S j = indices[i];
-      Node* n = _get(j);
-      if (n) {
-        bool side = D::side(m, n->v, _f, _random);
-        children_indices[side].push_back(j);
+    std::pop_heap(q.begin(), q.end());
+    T d = q.back().first;
+    S i = q.back().second;
+    q.pop_back();
+    if (i < _n_items) {
+      // Items only get their node read when scored, which codes may spare
+      if (!_is_deleted(i))
+        add_candidate(i);
+    } else {
+      const S* dst;
+      S n_descendants = _tree_node<aligned>(i, &dst, &scratch->leaf);
+      if (n_descendants <= _K) {
+        for (S j = 0; j < n_descendants; j++) {
+          if (_n_deleted == 0 || !_is_deleted(dst[j]))
+            add_candidate(dst[j]);
+        }
       } else {
-        showUpdate("No node for index %d?\n", j);
+        T margin = _split_margin<aligned>(i, lane->v);
+        q.push_back(make_pair(D::pq_distance(d, margin, 1), static_cast<S>(dst[1])));
+        std::push_heap(q.begin(), q.end());
+        q.push_back(make_pair(D::pq_distance(d, margin, 0), static_cast<S>(dst[0])));
+        std::push_heap(q.begin(), q.end());
       }
     }
+    if (!q.empty() && q.front().second >= _n_items)
+      _prefetch_tree_node<aligned>(q.front().second);
+  }
 
-    // If we didn't find a hyperplane, just randomize sides as a last option
-    while (children_indices[0].size() == 0 || children_indices[1].size() == 0) {
-      if (_verbose)
-        showUpdate("\tNo hyperplane found (left has %ld children, right has %ld children)\n",
-          children_indices[0].size(), children_indices[1].size());
-      if (_verbose && indices.size() > 100000)
-        showUpdate("Failed splitting %lu items\n", indices.size());
-
-      children_indices[0].clear();
-      children_indices[1].clear();
+  template<bool aligned>
+  bool _score_interleaved(size_t n, InterleavedQuery* lane, QueryScratch* scratch) const {
+    // Scores the next interleaved_score_step candidates, prefetched by the
+    // previous step, and prefetches the ones after them. Returns whether all
+    // the candidates have been scored.
+    const vector<S>& nns = scratch->nns;
+    vector<pair<T, S> >& top = scratch->top;
+    const QueryNode* v_node = (const QueryNode*)&scratch->query[0];
+    size_t stop = std::min(nns.size(), lane->n_scored + interleaved_score_step);
+    for (size_t k = stop; k < nns.size() && k < stop + interleaved_score_step; k++)
+      _prefetch_candidate<aligned>(nns[k]);
+    for (; lane->n_scored < stop; lane->n_scored++)
+      _score_candidate<aligned>(v_node, scratch->quantized, nns[lane->n_scored], _n_kept(n), &top);
+    return lane->n_scored == nns.size();
+  }
 
-      // Set the vector to 0.0
-      for (int z = 0; z < _f; z++)
-        m->v[z] = 0;
+  template<bool aligned>
+  void _finish_interleaved(size_t n, InterleavedQuery*, QueryScratch* scratch, S* result, T* distances) const {
+    const vector<S>& nns = scratch->nns;
+    for (size_t i = 0; i < nns.size(); i++)
+      scratch->visited[nns[i] / 64] &= ~((uint64_t)1 << (nns[i] % 64));
 
-      for (size_t i = 0; i < indices.size(); i++) {
-        S j = indices[i];
-        // Just randomize...
-        children_indices[_random.flip()].push_back(j);
-      }
+    vector<pair<T, S> >& top = scratch->top;
+    _sort_top<aligned>((const QueryNode*)&scratch->query[0], n, &top);
+    for (size_t i = 0; i < top.size(); i++) {
+      if (distances)
+        distances[i] = D::normalized_distance(top[i].first);
+      result[i] = top[i].second;
     }
+  }
 
-    int flip = (children_indices[0].size() > children_indices[1].size());
+  static QueryScratch& _query_scratch() {
+    static thread_local QueryScratch scratch;
+    return scratch;
+  }
 
-    m->n_descendants = is_root ? _n_items : (S)indices.size();
-    for (int side = 0; side < 2; side++) {
-      // run _make_tree for the smallest child first (for cache locality)
-      m->children[side^flip] = _make_tree(children_indices[side^flip], false);
+  bool _get_all_nns(const T* v, size_t n, size_t search_k, vector<S>* result, vector<T>* distances,
+                    int64_t timeout_us=0, size_t max_distances=0, const ItemFilter* filter=NULL) const {
+    bool stopped = _aligned ? _search_nns<true>(v, n, search_k, timeout_us, max_distances, filter)
+                            : _search_nns<false>(v, n, search_k, timeout_us, max_distances, filter);
+    const vector<pair<T, S> >& top = _query_scratch().top;
+    for (size_t i = 0; i < top.size(); i++) {
+      if (distances)
+        distances->push_back(D::normalized_distance(top[i].first));
+      result->push_back(top[i].second);
     }
+    return stopped;
+  }
 
-    _allocate_size(_n_nodes + 1);
-    S item = _n_nodes++;
-    memcpy(_get(item), m, _s);
-
-    return item;
+  size_t _get_all_nns_into(const T* v, size_t n, size_t search_k, S* result, T* distances) const {
+    if (_aligned)
+      _search_nns<true>(v, n, search_k, 0, 0, NULL);
+    else
+      _search_nns<false>(v, n, search_k, 0, 0, NULL);
+    const vector<pair<T, S> >& top = _query_scratch().top;
+    for (size_t i = 0; i < top.size(); i++) {
+      if (distances)
+        distances[i] = D::normalized_distance(top[i].first);
+      result[i] = top[i].second;
+    }
+    return top.size();
   }
 
-  void _get_all_nns(const T* v, size_t n, size_t search_k, vector<S>* result, vector<T>* distances) const {
-    Node* v_node = (Node *)alloca(_s);
-    D::template zero_value<Node>(v_node);
-    memcpy(v_node->v, v, sizeof(T) * _f);
+  template<bool aligned>
+  bool _search_nns(const T* v, size_t n, size_t search_k, int64_t timeout_us, size_t max_distances,
+                   const ItemFilter* filter) const {
+    // Leaves the nearest items found, nearest first, in the top of the
+    // thread's scratch. Returns whether a limit stopped the search early.
+    QueryNode* v_node = (QueryNode*)alloca(_query_s);
+    D::template zero_value<QueryNode>(v_node);
+    copy_vector(node_vector(v_node), v, _f);
     D::init_node(v_node, _f);
 
-    std::priority_queue<pair<T, S> > q;
+    QueryScratch& scratch = _query_scratch();
+    // Same order as a std::priority_queue, on a vector that keeps its capacity
+    vector<pair<T, S> >& q = scratch.queue;
+    q.clear();
 
     if (search_k == (size_t)-1) {
       search_k = n * _roots.size();
     }
 
     for (size_t i = 0; i < _roots.size(); i++) {
-      q.push(make_pair(Distance::template pq_initial_value<T>(), _roots[i]));
-    }
-
-    std::vector<S> nns;
-    while (nns.size() < search_k && !q.empty()) {
-      const pair<T, S>& top = q.top();
-      T d = top.first;
-      S i = top.second;
-      Node* nd = _get(i);
-      q.pop();
-      if (nd->n_descendants == 1 && i < _n_items) {
-        nns.push_back(i);
-      } else if (nd->n_descendants <= _K) {
-        const S* dst = nd->children;
-        nns.insert(nns.end(), dst, &dst[nd->n_descendants]);
+      q.push_back(make_pair(Distance::template pq_initial_value<T>(), _roots[i]));
+      std::push_heap(q.begin(), q.end());
+    }
+
+    vector<uint64_t>& visited = scratch.visited;
+    if (visited.size() < ((size_t)_n_items + 63) / 64)
+      visited.resize(((size_t)_n_items + 63) / 64, 0);
+    vector<S>& nns = scratch.nns;
+    nns.clear();
+    vector<pair<T, S> >& top = scratch.top;
+    top.clear();
+    size_t n_kept = _n_kept(n);
+    _prepare_quantized(v, &scratch.quantized);
+
+    // Every candidate counts towards search_k, even one seen before, but
+    // only the first time gets its distance computed. The n nearest so far
+    // stay in a max-heap.
+    size_t n_candidates = 0;
+    size_t n_distances = 0, n_steps = 0;
+    bool stopped = false;
+    std::chrono::steady_clock::time_point deadline;
+    if (timeout_us > 0)
+      deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+    auto over_limits = [&]() {
+      if (max_distances > 0 && n_distances >= max_distances)
+        return true;
+      return timeout_us > 0 && ++n_steps % timeout_check_steps == 0 && std::chrono::steady_clock::now() >= deadline;
+    };
+
+    auto add_candidate = [&](S j) {
+      n_candidates++;
+      uint64_t bit = (uint64_t)1 << (j % 64);
+      if (visited[j / 64] & bit)
+        return;
+      if (over_limits()) {
+        stopped = true;
+        return;
+      }
+      n_distances++;
+      visited[j / 64] |= bit;
+      nns.push_back(j);
+      _score_candidate<aligned>(v_node, scratch.quantized, j, n_kept, &top);
+    };
+
+    // Items left out by the filter are skipped like deleted ones
+    auto skip = [&](S j) {
+      return (_n_deleted > 0 && _is_deleted(j)) || (filter && !filter->passes(j));
+    };
+
+    if (filter && filter->count(_n_items) <= search_k) {
+      // Scoring all the items that pass is no more work than the search
+      q.clear();
+      if (filter->allow()) {
+        for (size_t w = 0; w < filter->n_words(_n_items) && !stopped; w++) {
+          uint64_t word = filter->words()[w];
+          for (size_t b = 0; b < 64 && word >> b && !stopped; b++) {
+            S j = (S)(w * 64 + b);
+            if ((word >> b) & 1 && j < _n_items && !skip(j))
+              add_candidate(j);
+          }
+        }
       } else {
-        T margin = D::margin(nd, v, _f);
-        q.push(make_pair(D::pq_distance(d, margin, 1), static_cast<S>(nd->children[1])));
-        q.push(make_pair(D::pq_distance(d, margin, 0), static_cast<S>(nd->children[0])));
+        for (S j = 0; j < _n_items && !stopped; j++) {
+          if (!skip(j))
+            add_candidate(j);
+        }
       }
     }
 
-    // Get distances for all items
-    // To avoid calculating distance multiple times for any items, sort by id
-    std::sort(nns.begin(), nns.end());
-    vector<pair<T, S> > nns_dist;
-    S last = -1;
-    for (size_t i = 0; i < nns.size(); i++) {
-      S j = nns[i];
-      if (j == last)
+    while (n_candidates < search_k && !q.empty()) {
+      if (over_limits()) {
+        stopped = true;
+        break;
+      }
+      std::pop_heap(q.begin(), q.end());
+      T d = q.back().first;
+      S i = q.back().second;
+      q.pop_back();
+      if (i < _n_items) {
+        // Items only get their node read when scored, which codes may spare
+        if (!skip(i))
+          add_candidate(i);
         continue;
-      last = j;
-      if (_get(j)->n_descendants == 1)  // This is only to guard a really obscure case, #284
-        nns_dist.push_back(make_pair(D::distance(v_node, _get(j), _f), j));
+      }
+      const S* dst;
+      S n_descendants = _tree_node<aligned>(i, &dst, &scratch.leaf);
+      if (n_descendants <= _K) {
+        for (S j = 0; j < n_descendants; j++)
+          _prefetch_candidate<aligned>(dst[j]);
+        for (S j = 0; j < n_descendants && !stopped; j++) {
+          if (!skip(dst[j]))
+            add_candidate(dst[j]);
+        }
+        if (stopped)
+          break;
+      } else {
+        T margin = _split_margin<aligned>(i, v);
+        q.push_back(make_pair(D::pq_distance(d, margin, 1), static_cast<S>(dst[1])));
+        std::push_heap(q.begin(), q.end());
+        q.push_back(make_pair(D::pq_distance(d, margin, 0), static_cast<S>(dst[0])));
+        std::push_heap(q.begin(), q.end());
+      }
     }
 
-    size_t m = nns_dist.size();
-    size_t p = n < m ? n : m; // Return this many items
-    std::partial_sort(nns_dist.begin(), nns_dist.begin() + p, nns_dist.end());
-    for (size_t i = 0; i < p; i++) {
-      if (distances)
-        distances->push_back(D::normalized_distance(nns_dist[i].first));
-      result->push_back(nns_dist[i].second);
-    }
+    for (size_t i = 0; i < nns.size(); i++)
+      visited[nns[i] / 64] &= ~((uint64_t)1 << (nns[i] % 64));
+
+    _sort_top<aligned>(v_node, n, &top);
+    return stopped;
   }
 };
 
-#endif
-
 template<typename Random>
 class HammingWrapper : public AnnoyIndexInterface<int32_t, float> {
   // Wrapper class for Hamming distance, using composition.
@@ -1330,22 +5139,44 @@ private:
       dst[i] = (src[i / 64] >> (i % 64)) & 1;
     }
   };
+  void _copy_batch(const vector<int32_t>& result_internal, const vector<uint64_t>& distances_internal, int32_t* result, float* distances) const {
+    // Only the items found are copied, like _index leaves the rest untouched
+    for (size_t i = 0; i < result_internal.size(); i++) {
+      if (result_internal[i] == -1)
+        continue;
+      result[i] = result_internal[i];
+      if (distances)
+        distances[i] = distances_internal[i];
+    }
+  };
 public:
-  HammingWrapper(int f) : _f_external(f), _f_internal((f + 63) / 64), _index((f + 63) / 64) {};
+  HammingWrapper(int f) : _f_external(f), _f_internal((f + 63) / 64), _index((f + 63) / 64) {
+    _index.set_dimension(f);
+  };
   bool add_item(int32_t item, const float* w, char**error) {
     vector<uint64_t> w_internal(_f_internal, 0);
     _pack(w, &w_internal[0]);
     return _index.add_item(item, &w_internal[0], error);
   };
-  bool build(int q, char** error) { return _index.build(q, error); };
+  bool add_items(int32_t first_item, int32_t n, const float* w, char** error) {
+    vector<uint64_t> w_internal((size_t)n * _f_internal, 0);
+    for (int32_t i = 0; i < n; i++)
+      _pack(w + (size_t)i * _f_external, &w_internal[(size_t)i * _f_internal]);
+    return _index.add_items(first_item, n, w_internal.empty() ? NULL : &w_internal[0], error);
+  };
+  bool reserve_items(int32_t n, char** error) { return _index.reserve_items(n, error); };
+  bool build(int q, int n_threads, char** error) { return _index.build(q, n_threads, error); };
   bool unbuild(char** error) { return _index.unbuild(error); };
   bool save(const char* filename, bool prefault, char** error) { return _index.save(filename, prefault, error); };
   void unload() { _index.unload(); };
   bool load(const char* filename, bool prefault, char** error) { return _index.load(filename, prefault, error); };
+  bool verify(char** error) const { return _index.verify(error); };
+  bool save_aligned(const char* filename, char** error) const { return _index.save_aligned(filename, error); };
   float get_distance(int32_t i, int32_t j) const { return _index.get_distance(i, j); };
   void get_nns_by_item(int32_t item, size_t n, size_t search_k, vector<int32_t>* result, vector<float>* distances) const {
     if (distances) {
-      vector<uint64_t> distances_internal;
+      static thread_local vector<uint64_t> distances_internal;
+      distances_internal.clear();
       _index.get_nns_by_item(item, n, search_k, result, &distances_internal);
       distances->insert(distances->begin(), distances_internal.begin(), distances_internal.end());
     } else {
@@ -1353,16 +5184,118 @@ public:
     }
   };
   void get_nns_by_vector(const float* w, size_t n, size_t search_k, vector<int32_t>* result, vector<float>* distances) const {
-    vector<uint64_t> w_internal(_f_internal, 0);
+    static thread_local vector<uint64_t> w_internal;
+    w_internal.assign(_f_internal, 0);
     _pack(w, &w_internal[0]);
     if (distances) {
-      vector<uint64_t> distances_internal;
+      static thread_local vector<uint64_t> distances_internal;
+      distances_internal.clear();
       _index.get_nns_by_vector(&w_internal[0], n, search_k, result, &distances_internal);
       distances->insert(distances->begin(), distances_internal.begin(), distances_internal.end());
     } else {
       _index.get_nns_by_vector(&w_internal[0], n, search_k, result, NULL);
     }
   };
+  size_t get_nns_by_item_into(int32_t item, size_t n, size_t search_k, int32_t* result, float* distances) const {
+    static thread_local vector<uint64_t> distances_internal;
+    distances_internal.resize(n);
+    size_t m = _index.get_nns_by_item_into(item, n, search_k, result, distances ? distances_internal.data() : NULL);
+    if (distances)
+      std::copy(distances_internal.begin(), distances_internal.begin() + m, distances);
+    return m;
+  };
+  size_t get_nns_by_vector_into(const float* w, size_t n, size_t search_k, int32_t* result, float* distances) const {
+    static thread_local vector<uint64_t> w_internal;
+    w_internal.assign(_f_internal, 0);
+    _pack(w, &w_internal[0]);
+    static thread_local vector<uint64_t> distances_internal;
+    distances_internal.resize(n);
+    size_t m = _index.get_nns_by_vector_into(&w_internal[0], n, search_k, result, distances ? distances_internal.data() : NULL);
+    if (distances)
+      std::copy(distances_internal.begin(), distances_internal.begin() + m, distances);
+    return m;
+  };
+  bool get_nns_by_item_limited(int32_t item, size_t n, size_t search_k, int64_t timeout_us, size_t max_distances,
+                               vector<int32_t>* result, vector<float>* distances) const {
+    static thread_local vector<uint64_t> distances_internal;
+    distances_internal.clear();
+    bool stopped = _index.get_nns_by_item_limited(item, n, search_k, timeout_us, max_distances, result,
+                                                  distances ? &distances_internal : NULL);
+    if (distances)
+      distances->insert(distances->begin(), distances_internal.begin(), distances_internal.end());
+    return stopped;
+  };
+  bool get_nns_by_vector_limited(const float* w, size_t n, size_t search_k, int64_t timeout_us, size_t max_distances,
+                                 vector<int32_t>* result, vector<float>* distances) const {
+    static thread_local vector<uint64_t> w_internal;
+    w_internal.assign(_f_internal, 0);
+    _pack(w, &w_internal[0]);
+    static thread_local vector<uint64_t> distances_internal;
+    distances_internal.clear();
+    bool stopped = _index.get_nns_by_vector_limited(&w_internal[0], n, search_k, timeout_us, max_distances, result,
+                                                    distances ? &distances_internal : NULL);
+    if (distances)
+      distances->insert(distances->begin(), distances_internal.begin(), distances_internal.end());
+    return stopped;
+  };
+  void get_nns_by_item_filtered(int32_t item, size_t n, size_t search_k, const ItemFilter& filter,
+                                vector<int32_t>* result, vector<float>* distances) const {
+    static thread_local vector<uint64_t> distances_internal;
+    distances_internal.clear();
+    _index.get_nns_by_item_filtered(item, n, search_k, filter, result, distances ? &distances_internal : NULL);
+    if (distances)
+      distances->insert(distances->begin(), distances_internal.begin(), distances_internal.end());
+  };
+  void get_nns_by_vector_filtered(const float* w, size_t n, size_t search_k, const ItemFilter& filter,
+                                  vector<int32_t>* result, vector<float>* distances) const {
+    static thread_local vector<uint64_t> w_internal;
+    w_internal.assign(_f_internal, 0);
+    _pack(w, &w_internal[0]);
+    static thread_local vector<uint64_t> distances_internal;
+    distances_internal.clear();
+    _index.get_nns_by_vector_filtered(&w_internal[0], n, search_k, filter, result, distances ? &distances_internal : NULL);
+    if (distances)
+      distances->insert(distances->begin(), distances_internal.begin(), distances_internal.end());
+  };
+  void get_nns_by_item_radius(int32_t item, float radius, size_t search_k, vector<int32_t>* result, vector<float>* distances) const {
+    static thread_local vector<uint64_t> distances_internal;
+    distances_internal.clear();
+    if (radius < 0)
+      return;
+    _index.get_nns_by_item_radius(item, (uint64_t)radius, search_k, result, distances ? &distances_internal : NULL);
+    if (distances)
+      distances->insert(distances->begin(), distances_internal.begin(), distances_internal.end());
+  };
+  void get_nns_by_vector_radius(const float* w, float radius, size_t search_k, vector<int32_t>* result, vector<float>* distances) const {
+    if (radius < 0)
+      return;
+    static thread_local vector<uint64_t> w_internal;
+    w_internal.assign(_f_internal, 0);
+    _pack(w, &w_internal[0]);
+    static thread_local vector<uint64_t> distances_internal;
+    distances_internal.clear();
+    _index.get_nns_by_vector_radius(&w_internal[0], (uint64_t)radius, search_k, result, distances ? &distances_internal : NULL);
+    if (distances)
+      distances->insert(distances->begin(), distances_internal.begin(), distances_internal.end());
+  };
+  void get_nns_by_items(const int32_t* items, size_t n_queries, size_t n, size_t search_k, int32_t* result, float* distances, int n_threads) const {
+    vector<int32_t> result_internal(n_queries * n, -1);
+    vector<uint64_t> distances_internal(distances ? n_queries * n : 0);
+    _index.get_nns_by_items(items, n_queries, n, search_k, result_internal.empty() ? NULL : &result_internal[0],
+                            distances_internal.empty() ? NULL : &distances_internal[0], n_threads);
+    _copy_batch(result_internal, distances_internal, result, distances);
+  };
+  void get_nns_by_vectors(const float* w, size_t n_queries, size_t n, size_t search_k, int32_t* result, float* distances, int n_threads) const {
+    vector<uint64_t> w_internal(n_queries * _f_internal, 0);
+    for (size_t q = 0; q < n_queries; q++)
+      _pack(w + q * _f_external, &w_internal[q * _f_internal]);
+    vector<int32_t> result_internal(n_queries * n, -1);
+    vector<uint64_t> distances_internal(distances ? n_queries * n : 0);
+    _index.get_nns_by_vectors(w_internal.empty() ? NULL : &w_internal[0], n_queries, n, search_k,
+                              result_internal.empty() ? NULL : &result_internal[0],
+                              distances_internal.empty() ? NULL : &distances_internal[0], n_threads);
+    _copy_batch(result_internal, distances_internal, result, distances);
+  };
   int32_t get_n_items() const { return _index.get_n_items(); };
   int32_t get_n_trees() const { return _index.get_n_trees(); };
   void verbose(bool v) { _index.verbose(v); };
@@ -1372,7 +5305,28 @@ public:
     _unpack(&v_internal[0], v);
   };
   void set_seed(int q) { _index.set_seed(q); };
+  void set_tree_order(TreeOrder order) { _index.set_tree_order(order); };
+  void set_leaf_size(int32_t leaf_size) { _index.set_leaf_size(leaf_size); };
   bool on_disk_build(const char* filename, char** error) { return _index.on_disk_build(filename, error); };
+  bool on_disk_update(const char* filename, char** error) { return _index.on_disk_update(filename, error); };
+  bool delete_item(int32_t item, char** error) { return _index.delete_item(item, error); };
+  bool is_deleted(int32_t item) const { return _index.is_deleted(item); };
+  int32_t get_n_deleted() const { return _index.get_n_deleted(); };
+  bool compact(char** error) { return _index.compact(error); };
+  bool save_deleted(const char* filename, char** error) const { return _index.save_deleted(filename, error); };
+  bool load_deleted(const char* filename, char** error) { return _index.load_deleted(filename, error); };
+  bool quantize(size_t rerank_multiple, char** error) { return _index.quantize(rerank_multiple, error); };
+  bool pq_quantize(size_t n_subvectors, size_t rerank_multiple, int n_threads, char** error) {
+    return _index.pq_quantize(n_subvectors, rerank_multiple, n_threads, error);
+  };
+  bool save_pq(const char* filename, char** error) const { return _index.save_pq(filename, error); };
+  bool load_pq(const char* filename, char** error) { return _index.load_pq(filename, error); };
+  void unquantize() { _index.unquantize(); };
+  void set_result_cache_size(size_t max_entries) { _index.set_result_cache_size(max_entries); };
+  void get_result_cache_stats(uint64_t* hits, uint64_t* misses, size_t* entries) const {
+    _index.get_result_cache_stats(hits, misses, entries);
+  };
 };
 
+#endif
 // vim: tabstop=2 shiftwidth=2
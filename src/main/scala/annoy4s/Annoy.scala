@@ -19,21 +19,27 @@ import java.util.UUID
 import annoy4s.Converters.KeyConverter
 import better.files._
 import com.sun.jna._
-
-import scala.io.Source
+import com.sun.jna.ptr.{IntByReference, LongByReference, PointerByReference}
 
 class Annoy[T](
-  idToIndex: Map[T, Int],
-  indexToId: Seq[T],
+  private var idToIndex: Map[T, Int],
+  private var indexToId: Seq[T],
   annoyIndex: Pointer,
   val dimension: Int,
-  val metric: Metric
+  val metric: Metric,
+  annoyDir: String = null,
+  updatable: Boolean = false
 ) {
 
+  // Whether the file of an updatable index has changed since it was loaded
+  private var changed = false
+
   def ids = indexToId
 
+  // Saving a changed index file checksums it, which reads all of it
   def close() = {
-    Annoy.annoyLib.deleteIndex(annoyIndex)
+    try if (changed) Annoy.saveIndex(annoyIndex, (File(annoyDir) / "annoy-index").pathAsString)
+    finally Annoy.annoyLib.deleteIndex(annoyIndex)
   }
 
   def query(vector: Seq[Float], maxReturnSize: Int): Seq[(T, Float)] = query(vector, maxReturnSize, -1)
@@ -41,7 +47,7 @@ class Annoy[T](
   def query(vector: Seq[Float], maxReturnSize: Int, searchK: Int) = {
     val result = Array.fill(maxReturnSize)(-1)
     val distances = Array.fill(maxReturnSize)(-1.0f)
-    Annoy.annoyLib.getNnsByVector(annoyIndex, vector.toArray, maxReturnSize, searchK, result, distances)
+    AnnoyDirectLibrary.getNnsByVector(annoyIndex, vector.toArray, maxReturnSize, searchK, result, distances)
     result.toList.filter(_ != -1).map(indexToId.apply).zip(distances.toSeq)
   }
 
@@ -51,15 +57,252 @@ class Annoy[T](
     idToIndex.get(id).map { index =>
       val result = Array.fill(maxReturnSize)(-1)
       val distances = Array.fill(maxReturnSize)(-1.0f)
-      Annoy.annoyLib.getNnsByItem(annoyIndex, index, maxReturnSize, searchK, result, distances)
+      AnnoyDirectLibrary.getNnsByItem(annoyIndex, index, maxReturnSize, searchK, result, distances)
       result.toList.filter(_ != -1).map(indexToId.apply).zip(distances.toSeq)
     }
   }
 
+  // Off-heap buffers for the query vector and up to maxReturnSize results, which queryInto reuses from query to
+  // query so that it allocates nothing
+  class QueryBuffers(val maxReturnSize: Int) {
+    require(maxReturnSize > 0, "maxReturnSize must be positive.")
+
+    val vector = new Memory(dimension * 4L)
+    val result = new Memory(maxReturnSize * 4L)
+    val distances = new Memory(maxReturnSize * 4L)
+
+    def setVector(v: Array[Float]): Unit = vector.write(0, v, 0, dimension)
+    def index(i: Int): Int = result.getInt(i * 4L)
+    def id(i: Int): T = indexToId(index(i))
+    def distance(i: Int): Float = distances.getFloat(i * 4L)
+  }
+
+  def newQueryBuffers(maxReturnSize: Int): QueryBuffers = new QueryBuffers(maxReturnSize)
+
+  // Queries with buffers.vector and returns the number of results, which are read with buffers.id and
+  // buffers.distance
+  def queryInto(buffers: QueryBuffers, searchK: Int = -1): Int = {
+    AnnoyDirectLibrary.getNnsByVectorInto(
+      annoyIndex, buffers.vector, buffers.maxReturnSize, searchK, buffers.result, buffers.distances
+    )
+  }
+
+  // Returns -1 when the id isn't in the index
+  def queryByIdInto(id: T, buffers: QueryBuffers, searchK: Int = -1): Int = {
+    val index = idToIndex.getOrElse(id, -1)
+    if (index < 0) -1
+    else AnnoyDirectLibrary.getNnsByItemInto(annoyIndex, index, buffers.maxReturnSize, searchK, buffers.result, buffers.distances)
+  }
+
+  // Stops after timeoutMicros microseconds or maxDistances distance computations (0 for no limit) with the nearest
+  // items found so far, and tells whether it stopped early
+  def queryWithLimits(
+    vector: Seq[Float],
+    maxReturnSize: Int,
+    searchK: Int = -1,
+    timeoutMicros: Long = 0,
+    maxDistances: Int = 0
+  ): (Seq[(T, Float)], Boolean) = {
+    val result = Array.fill(maxReturnSize)(-1)
+    val distances = Array.fill(maxReturnSize)(-1.0f)
+    val stopped = Annoy.annoyLib.getNnsByVectorLimited(
+      annoyIndex, vector.toArray, maxReturnSize, searchK, timeoutMicros, maxDistances, result, distances
+    )
+    (result.toList.filter(_ != -1).map(indexToId.apply).zip(distances.toSeq), stopped)
+  }
+
+  def queryWithLimitsById(
+    id: T,
+    maxReturnSize: Int,
+    searchK: Int = -1,
+    timeoutMicros: Long = 0,
+    maxDistances: Int = 0
+  ): Option[(Seq[(T, Float)], Boolean)] = {
+    idToIndex.get(id).map { index =>
+      val result = Array.fill(maxReturnSize)(-1)
+      val distances = Array.fill(maxReturnSize)(-1.0f)
+      val stopped = Annoy.annoyLib.getNnsByItemLimited(
+        annoyIndex, index, maxReturnSize, searchK, timeoutMicros, maxDistances, result, distances
+      )
+      (result.toList.filter(_ != -1).map(indexToId.apply).zip(distances.toSeq), stopped)
+    }
+  }
+
+  // An allowlist of the given ids for queryFiltered, or a denylist with allow = false. Items inserted later are
+  // left out by an allowlist and let through by a denylist.
+  def filter(ids: Iterable[T], allow: Boolean = true): ItemFilter = {
+    val words = new Array[Long]((indexToId.size + 63) / 64)
+    ids.flatMap(idToIndex.get).foreach(index => words(index / 64) |= 1L << (index % 64))
+    new ItemFilter(words, allow)
+  }
+
+  // Only returns items that pass the filter. The fewer items pass, the further the search goes to find them.
+  def queryFiltered(vector: Seq[Float], maxReturnSize: Int, filter: ItemFilter, searchK: Int = -1): Seq[(T, Float)] = {
+    val result = Array.fill(maxReturnSize)(-1)
+    val distances = Array.fill(maxReturnSize)(-1.0f)
+    Annoy.annoyLib.getNnsByVectorFiltered(
+      annoyIndex, vector.toArray, maxReturnSize, searchK, filter.words, filter.nWords, filter.nMarked, filter.allow,
+      result, distances
+    )
+    result.toList.filter(_ != -1).map(indexToId.apply).zip(distances.toSeq)
+  }
+
+  def queryFilteredById(id: T, maxReturnSize: Int, filter: ItemFilter, searchK: Int = -1): Option[Seq[(T, Float)]] = {
+    idToIndex.get(id).map { index =>
+      val result = Array.fill(maxReturnSize)(-1)
+      val distances = Array.fill(maxReturnSize)(-1.0f)
+      Annoy.annoyLib.getNnsByItemFiltered(
+        annoyIndex, index, maxReturnSize, searchK, filter.words, filter.nWords, filter.nMarked, filter.allow,
+        result, distances
+      )
+      result.toList.filter(_ != -1).map(indexToId.apply).zip(distances.toSeq)
+    }
+  }
+
+  // All the items within radius of the vector, nearest first
+  def queryRadius(vector: Seq[Float], radius: Float, searchK: Int = -1): Seq[(T, Float)] = {
+    val result = new PointerByReference()
+    val distances = new PointerByReference()
+    val n = Annoy.annoyLib.getNnsByVectorRadius(annoyIndex, vector.toArray, radius, searchK, result, distances)
+    radiusResults(n, result, distances)
+  }
+
+  def queryRadiusById(id: T, radius: Float, searchK: Int = -1): Option[Seq[(T, Float)]] = {
+    idToIndex.get(id).map { index =>
+      val result = new PointerByReference()
+      val distances = new PointerByReference()
+      val n = Annoy.annoyLib.getNnsByItemRadius(annoyIndex, index, radius, searchK, result, distances)
+      radiusResults(n, result, distances)
+    }
+  }
+
+  private def radiusResults(n: Int, result: PointerByReference, distances: PointerByReference) = {
+    try result.getValue.getIntArray(0, n).toList.map(indexToId.apply).zip(distances.getValue.getFloatArray(0, n).toSeq)
+    finally {
+      Annoy.annoyLib.freeBuffer(result.getValue)
+      Annoy.annoyLib.freeBuffer(distances.getValue)
+    }
+  }
+
+  // Answers all the queries in one native call, on numOfThreads threads (-1 uses all available cores)
+  def queryBatch(vectors: Seq[Seq[Float]], maxReturnSize: Int, searchK: Int = -1, numOfThreads: Int = 1): Seq[Seq[(T, Float)]] = {
+    val result = Array.fill(vectors.size * maxReturnSize)(-1)
+    val distances = Array.fill(vectors.size * maxReturnSize)(-1.0f)
+    if (vectors.nonEmpty) {
+      Annoy.annoyLib.getNnsByVectorBatch(
+        annoyIndex, vectors.flatten.toArray, vectors.size, maxReturnSize, searchK, result, distances, numOfThreads
+      )
+    }
+    batchResults(result, distances, vectors.size, maxReturnSize)
+  }
+
+  def queryBatchByIds(ids: Seq[T], maxReturnSize: Int, searchK: Int = -1, numOfThreads: Int = 1): Seq[Option[Seq[(T, Float)]]] = {
+    val indices = ids.map(idToIndex.get)
+    val items = indices.flatten.toArray
+    val result = Array.fill(items.length * maxReturnSize)(-1)
+    val distances = Array.fill(items.length * maxReturnSize)(-1.0f)
+    if (items.nonEmpty) {
+      Annoy.annoyLib.getNnsByItemBatch(
+        annoyIndex, items, items.length, maxReturnSize, searchK, result, distances, numOfThreads
+      )
+    }
+    val results = batchResults(result, distances, items.length, maxReturnSize).iterator
+    indices.map(_.map(_ => results.next()))
+  }
+
+  private def batchResults(result: Array[Int], distances: Array[Float], numOfQueries: Int, maxReturnSize: Int) = {
+    (0 until numOfQueries).map { q =>
+      val from = q * maxReturnSize
+      val until = from + maxReturnSize
+      result.slice(from, until).toList.filter(_ != -1).map(indexToId.apply).zip(distances.slice(from, until).toSeq)
+    }
+  }
+
+  // Keeps an int8 copy of every vector in memory and scores the candidates of a query on it, so that only the
+  // n * rerankMultiple closest ones are read at full precision. Not saved with the index; Angular, Euclidean and
+  // Manhattan only. Replaces the product-quantized codes, if any.
+  def quantize(rerankMultiple: Int = 4): Unit = {
+    require(Annoy.annoyLib.quantize(annoyIndex, rerankMultiple), "Quantization is not supported for this metric.")
+    if (annoyDir != null) {
+      (File(annoyDir) / "pq").delete(swallowIOExceptions = true)
+    }
+  }
+
+  // Keeps a product-quantized code of every vector, numOfSubvectors bytes long, and scores the candidates of a query on
+  // those, so that only the n * rerankMultiple closest (none for 0) are read at full precision. In disk mode the codes
+  // are saved next to the index and loaded with it, and the vectors of the loaded index are then only read to rerank.
+  def productQuantize(numOfSubvectors: Int, rerankMultiple: Int = 4, numOfThreads: Int = 1): Unit = {
+    require(Annoy.annoyLib.pqQuantize(annoyIndex, numOfSubvectors, rerankMultiple, numOfThreads),
+      "Unable to quantize the index.")
+    savePq()
+  }
+
+  def unquantize(): Unit = {
+    Annoy.annoyLib.unquantize(annoyIndex)
+    if (annoyDir != null) {
+      (File(annoyDir) / "pq").delete(swallowIOExceptions = true)
+    }
+  }
+
+  private def savePq(): Unit = {
+    if (annoyDir != null) {
+      require(Annoy.annoyLib.savePq(annoyIndex, (File(annoyDir) / "pq").pathAsString),
+        s"Unable to save the product-quantized codes in $annoyDir.")
+    }
+  }
+
+  // Keeps the results of the maxEntries most recently used query(id, ...) calls, so that repeating one doesn't search
+  // the trees again. 0 turns the cache off. The cache is emptied whenever the index changes.
+  def setResultCacheSize(maxEntries: Int): Unit = Annoy.annoyLib.setResultCacheSize(annoyIndex, maxEntries)
+
+  def resultCacheStats: ResultCacheStats = {
+    val stats = new Array[Long](3)
+    Annoy.annoyLib.getResultCacheStats(annoyIndex, stats)
+    ResultCacheStats(stats(0), stats(1), stats(2).toInt)
+  }
+
+  // Adds items to the index without rebuilding it. An index in disk mode has to be loaded with updatable = true.
+  def insert(items: Seq[(T, Seq[Float])]): Unit = {
+    val newIds = items.map(_._1)
+    require(newIds.distinct.size == newIds.size && !newIds.exists(idToIndex.contains), "Ids are already in the index.")
+    require(items.forall(_._2.size == dimension), s"Vectors should have dimension $dimension.")
+    val startIndex = indexToId.size
+    val inserted = Annoy.annoyLib.addItems(annoyIndex, startIndex, items.size, items.flatMap(_._2).toArray)
+    require(inserted, "Unable to add items to the index.")
+    if (annoyDir != null) {
+      (File(annoyDir) / "ids").appendLines(newIds.map(_.toString): _*)
+      changed = updatable
+    }
+    indexToId = indexToId.toVector ++ newIds
+    idToIndex = idToIndex ++ newIds.zipWithIndex.map { case (id, i) => id -> (startIndex + i) }
+    if (annoyDir != null && (File(annoyDir) / "pq").exists) {
+      savePq()
+    }
+  }
+
+  // Removes items from the query results. In disk mode the deleted items are saved next to the index. Ids that aren't
+  // in the index are ignored.
+  def delete(ids: Seq[T]): Unit = {
+    val deleted = ids.flatMap(idToIndex.get).count(index => Annoy.annoyLib.deleteItem(annoyIndex, index))
+    if (annoyDir != null && deleted > 0) {
+      require(Annoy.annoyLib.saveDeleted(annoyIndex, (File(annoyDir) / "deleted").pathAsString),
+        s"Unable to save the deleted items in $annoyDir.")
+      // Enough deletes compact the trees of an updatable index in its file
+      changed = updatable
+    }
+  }
+
+  def getDistance(id1: T, id2: T): Option[Float] = {
+    for {
+      i <- idToIndex.get(id1)
+      j <- idToIndex.get(id2)
+    } yield AnnoyDirectLibrary.getDistance(annoyIndex, i, j)
+  }
+
   def getItem(id: T): Option[Seq[Float]] = {
     idToIndex.get(id).flatMap { index =>
       val result = Array.fill(dimension)(Float.NegativeInfinity)
-      Annoy.annoyLib.getItem(annoyIndex, index, result)
+      AnnoyDirectLibrary.getItem(annoyIndex, index, result)
       result
         .find(_ != Float.NegativeInfinity)
         .map(_ => result.toSeq)
@@ -104,54 +347,86 @@ object Annoy {
     numOfTrees: Int,
     outputDir: String = null,
     metric: Metric = Angular,
-    verbose: Boolean = false
+    verbose: Boolean = false,
+    numOfThreads: Int = 1,
+    onDiskBuild: Boolean = false,
+    precision: Precision = Float32,
+    treeOrder: TreeOrder = PostOrder,
+    leafSize: Int = 0
   )(implicit converter: KeyConverter[T]): Annoy[T] = {
     val diskMode = outputDir != null
+    require(diskMode || !onDiskBuild, "onDiskBuild requires an outputDir.")
+    require(metric != Hamming || precision == Float32, "Hamming indexes are stored as bits already.")
 
     if (diskMode) {
       require(File(outputDir).notExists || File(outputDir).isEmpty, "Output directory is not empty.")
       File(outputDir).createIfNotExists(true)
     }
 
-    def inputLines = Source.fromFile(inputFile).getLines
+    // Input files are parsed natively; .fvecs files have no ids, their items are numbered in file order
+    val fvecsInput = inputFile.endsWith(".fvecs")
+    val dimension =
+      if (fvecsInput) annoyLib.fvecsInputDimension(inputFile) else annoyLib.textInputDimension(inputFile)
+    require(dimension > 0, s"Unable to read the dimension of $inputFile.")
 
-    val dimension = inputLines.next.split(" ").tail.size
-    val annoyIndex = metric match {
-      case Angular => annoyLib.createAngular(dimension)
-      case Euclidean => annoyLib.createEuclidean(dimension)
-      case Manhattan => annoyLib.createManhattan(dimension)
-      case Hamming => annoyLib.createHamming(dimension)
-    }
+    val annoyIndex = createIndex(metric, precision, dimension)
 
     annoyLib.verbose(annoyIndex, verbose)
+    annoyLib.setTreeOrder(annoyIndex, treeOrder match {
+      case PostOrder => 0
+      case BlockedOrder => 2
+    })
+    annoyLib.setLeafSize(annoyIndex, leafSize)
+
+    // Build the index straight into its file, so the items and trees don't need to fit in memory
+    if (onDiskBuild) {
+      val error = new PointerByReference()
+      if (!annoyLib.onDiskBuild(annoyIndex, (File(outputDir) / "annoy-index").pathAsString, error)) {
+        annoyLib.deleteIndex(annoyIndex)
+        throw new IllegalArgumentException(s"Unable to build the index in $outputDir: ${errorMessage(error)}.")
+      }
+    }
 
-    inputLines
-      .map(_.split(" "))
-      .zipWithIndex
-      .foreach {
-        case (seq, index) =>
-          val vector = seq.tail.map(_.toFloat)
-          annoyLib.addItem(annoyIndex, index, vector)
+    val rawIds: Seq[String] = if (fvecsInput) {
+      val n = annoyLib.loadFvecsInput(annoyIndex, dimension, inputFile, numOfThreads)
+      if (n < 0) {
+        annoyLib.deleteIndex(annoyIndex)
+        throw new IllegalArgumentException(s"Unable to load $inputFile.")
+      }
+      (0 until n).map(_.toString)
+    } else {
+      val idsBuffer = new PointerByReference()
+      val idsSize = new LongByReference()
+      val n = annoyLib.loadTextInput(annoyIndex, dimension, inputFile, numOfThreads, idsBuffer, idsSize)
+      // The index is only kept once there is an id for every item
+      var loaded = false
+      try {
+        require(n >= 0, s"Unable to load $inputFile.")
+        val ids = readIds(idsBuffer.getValue, idsSize.getValue)
+        require(ids.size == n, s"Unable to read the ids of $inputFile.")
+        loaded = true
+        ids
+      } finally {
+        annoyLib.freeBuffer(idsBuffer.getValue)
+        if (!loaded) annoyLib.deleteIndex(annoyIndex)
       }
+    }
 
-    annoyLib.build(annoyIndex, numOfTrees)
+    // Fails when an index built on disk can't grow its file
+    if (!annoyLib.build(annoyIndex, numOfTrees, numOfThreads)) {
+      annoyLib.deleteIndex(annoyIndex)
+      throw new IllegalArgumentException("Unable to build the index.")
+    }
 
     if (diskMode) {
-      (File(outputDir) / "ids").printLines(inputLines.map(_.split(" ").head))
-      (File(outputDir) / "dimension").overwrite(dimension.toString)
-      (File(outputDir) / "metric").overwrite {
-        metric match {
-          case Angular => "Angular"
-          case Euclidean => "Euclidean"
-          case Manhattan => "Manhattan"
-          case Hamming => "Hamming"
-        }
-      }
-      annoyLib.save(annoyIndex, (File(outputDir) / "annoy-index").pathAsString)
-      annoyLib.deleteIndex(annoyIndex)
+      (File(outputDir) / "ids").printLines(rawIds)
+      // The dimension, metric and precision are in the header of the index file. Indexes built on disk are already
+      // in their file, saving them writes its checksum
+      try saveIndex(annoyIndex, (File(outputDir) / "annoy-index").pathAsString)
+      finally annoyLib.deleteIndex(annoyIndex)
       load[T](outputDir)
     } else {
-      val keys = inputLines.map(entry => converter.convert(entry.split(" ").head)).toSeq
+      val keys = rawIds.map(converter.convert)
       new Annoy[T](
         keys.zipWithIndex.toMap,
         keys,
@@ -162,25 +437,168 @@ object Annoy {
     }
   }
 
-  def load[T](annoyDir: String)(implicit converter: KeyConverter[T]): Annoy[T] = {
+  // Splits the newline-separated ids in a native buffer of size bytes a chunk at a time, as the ids of a large input
+  // can take more bytes than a single array or String holds
+  private def readIds(buffer: Pointer, size: Long): Vector[String] = {
+    val ids = Vector.newBuilder[String]
+    val id = new java.io.ByteArrayOutputStream()
+    var offset = 0L
+    while (offset < size) {
+      val chunk = buffer.getByteArray(offset, math.min(size - offset, idsChunkBytes).toInt)
+      var start = 0
+      for (i <- chunk.indices if chunk(i) == '\n') {
+        id.write(chunk, start, i - start)
+        ids += id.toString("UTF-8")
+        id.reset()
+        start = i + 1
+      }
+      id.write(chunk, start, chunk.length - start)
+      offset += chunk.length
+    }
+    if (id.size > 0) ids += id.toString("UTF-8")
+    ids.result()
+  }
+
+  private val idsChunkBytes = 1L << 24
+
+  // Throws with the reason the native side gives when saving fails
+  private[annoy4s] def saveIndex(annoyIndex: Pointer, indexFile: String): Unit = {
+    val error = new PointerByReference()
+    if (!annoyLib.save(annoyIndex, indexFile, error)) {
+      throw new IllegalArgumentException(s"Unable to save the index to $indexFile: ${errorMessage(error)}.")
+    }
+  }
+
+  // The message the native side left in error, which is freed
+  private def errorMessage(error: PointerByReference): String =
+    Option(error.getValue).map { value =>
+      try value.getString(0) finally annoyLib.freeBuffer(value)
+    }.getOrElse("unknown error")
+
+  def load[T](annoyDir: String, updatable: Boolean = false, verify: Boolean = false)(
+    implicit converter: KeyConverter[T]
+  ): Annoy[T] = {
     val ids = File(annoyDir) / "ids"
     val keys = ids.lineIterator.toSeq.map(converter.convert)
     val idToIndex: Map[T, Int] = keys.zipWithIndex.toMap
     val indexToId: Seq[T] = keys
+    val indexFile = (File(annoyDir) / "annoy-index").pathAsString
+    val (dimension, metric, precision) = readHeader(indexFile).getOrElse(readDescriptionFiles(annoyDir))
+    val annoyIndex = createIndex(metric, precision, dimension)
+    // An updatable index is mapped writable, items inserted into it go straight to its file
+    val loaded =
+      if (updatable) annoyLib.onDiskUpdate(annoyIndex, indexFile) else annoyLib.load(annoyIndex, indexFile)
+    // Verifying reads the whole index, to check it against the checksum it was saved with
+    if (!loaded || (verify && !annoyLib.verify(annoyIndex))) {
+      annoyLib.deleteIndex(annoyIndex)
+      throw new IllegalArgumentException(s"Unable to load the index in $annoyDir.")
+    }
+    // Deleted items that aren't loaded would otherwise show up in the results again
+    if ((File(annoyDir) / "deleted").exists && !annoyLib.loadDeleted(annoyIndex, (File(annoyDir) / "deleted").pathAsString)) {
+      annoyLib.deleteIndex(annoyIndex)
+      throw new IllegalArgumentException(s"Unable to load the deleted items in $annoyDir.")
+    }
+    // Codes that don't match the index would otherwise leave it answering exactly, at the cost of the vectors
+    if ((File(annoyDir) / "pq").exists && !annoyLib.loadPq(annoyIndex, (File(annoyDir) / "pq").pathAsString)) {
+      annoyLib.deleteIndex(annoyIndex)
+      throw new IllegalArgumentException(s"Unable to load the product-quantized codes in $annoyDir.")
+    }
+    new Annoy[T](idToIndex, indexToId, annoyIndex, dimension, metric, annoyDir, updatable)
+  }
+
+  // Rewrites the index file in annoyDir in the aligned layout, where the vectors are the rows of a matrix with every
+  // row starting on a cache line, and the trees keep their nodes in compact arrays apart from the split planes. The
+  // index answers queries the same way but can no longer be loaded as updatable. Not for Hamming indexes. Subtrees of
+  // up to leafSize items become single leaves, whose items are packed apart from the nodes; 0 keeps the leaves built.
+  def alignLayout(annoyDir: String, leafSize: Int = 0): Unit = {
+    val indexFile = File(annoyDir) / "annoy-index"
+    val alignedFile = File(annoyDir) / "annoy-index.aligned"
+    val (dimension, metric, precision) = readHeader(indexFile.pathAsString).getOrElse(readDescriptionFiles(annoyDir))
+    val annoyIndex = createIndex(metric, precision, dimension)
+    annoyLib.setLeafSize(annoyIndex, leafSize)
+    val aligned =
+      try annoyLib.load(annoyIndex, indexFile.pathAsString) && annoyLib.saveAligned(annoyIndex, alignedFile.pathAsString)
+      finally annoyLib.deleteIndex(annoyIndex)
+    if (!aligned) {
+      alignedFile.delete(swallowIOExceptions = true)
+      throw new IllegalArgumentException(s"Unable to align the index in $annoyDir.")
+    }
+    alignedFile.moveTo(indexFile)(File.CopyOptions(overwrite = true))
+  }
+
+  private def readHeader(indexFile: String): Option[(Int, Metric, Precision)] = {
+    val dimension = new IntByReference()
+    val metricName = new Array[Byte](16)
+    val vectorType = new Array[Byte](16)
+    if (!annoyLib.indexHeader(indexFile, dimension, metricName, vectorType)) {
+      None
+    } else {
+      val metric = Native.toString(metricName) match {
+        case "angular" => Angular
+        case "euclidean" => Euclidean
+        case "manhattan" => Manhattan
+        case "hamming" => Hamming
+        case other => throw new IllegalArgumentException(s"Unsupported metric $other in $indexFile.")
+      }
+      val precision = Native.toString(vectorType) match {
+        case "float16" => Float16
+        case "bfloat16" => BFloat16
+        case _ => Float32
+      }
+      Some((dimension.getValue, metric, precision))
+    }
+  }
+
+  // Index files of earlier versions have no header, their directories describe them in text files instead
+  private def readDescriptionFiles(annoyDir: String): (Int, Metric, Precision) = {
     val dimension = (File(annoyDir) / "dimension").lines.head.toInt
-    val (metric, annoyIndex) = (File(annoyDir) / "metric").lines.head match {
-      case "Angular" => (Angular, annoyLib.createAngular(dimension))
-      case "Euclidean" => (Euclidean, annoyLib.createEuclidean(dimension))
-      case "Manhattan" => (Manhattan, annoyLib.createManhattan(dimension))
-      case "Hamming" => (Hamming, annoyLib.createHamming(dimension))
+    val metric = (File(annoyDir) / "metric").lines.head match {
+      case "Angular" => Angular
+      case "Euclidean" => Euclidean
+      case "Manhattan" => Manhattan
+      case "Hamming" => Hamming
     }
-    annoyLib.load(annoyIndex, (File(annoyDir) / "annoy-index").pathAsString)
-    new Annoy[T](idToIndex, indexToId, annoyIndex, dimension, metric)
+    (dimension, metric, Float32)
+  }
+
+  private def createIndex(metric: Metric, precision: Precision, dimension: Int): Pointer = (metric, precision) match {
+    case (Angular, Float32) => annoyLib.createAngular(dimension)
+    case (Euclidean, Float32) => annoyLib.createEuclidean(dimension)
+    case (Manhattan, Float32) => annoyLib.createManhattan(dimension)
+    case (Hamming, _) => annoyLib.createHamming(dimension)
+    case (Angular, Float16) => annoyLib.createAngularF16(dimension)
+    case (Euclidean, Float16) => annoyLib.createEuclideanF16(dimension)
+    case (Manhattan, Float16) => annoyLib.createManhattanF16(dimension)
+    case (Angular, BFloat16) => annoyLib.createAngularBF16(dimension)
+    case (Euclidean, BFloat16) => annoyLib.createEuclideanBF16(dimension)
+    case (Manhattan, BFloat16) => annoyLib.createManhattanBF16(dimension)
   }
 }
 
+case class ResultCacheStats(hits: Long, misses: Long, entries: Int)
+
+// The bitmap is copied off-heap and its marks counted once, so queries pass it to the native side as it is
+class ItemFilter private[annoy4s] (bitmap: Array[Long], val allow: Boolean) {
+  private[annoy4s] val nWords = bitmap.length
+  private[annoy4s] val nMarked = bitmap.map(java.lang.Long.bitCount).sum
+  private[annoy4s] val words = new Memory(math.max(nWords, 1) * 8L)
+  words.write(0, bitmap, 0, nWords)
+}
+
 sealed trait Metric
 case object Angular extends Metric
 case object Euclidean extends Metric
 case object Manhattan extends Metric
 case object Hamming extends Metric
+
+// How the vectors of an index are stored, which the distances are computed on
+sealed trait Precision
+case object Float32 extends Precision
+case object Float16 extends Precision
+case object BFloat16 extends Precision
+
+// The order of the nodes of every tree in the index. BlockedOrder keeps the nodes a query goes through together in
+// page-sized blocks, so that queries on a large index read fewer of its pages.
+sealed trait TreeOrder
+case object PostOrder extends TreeOrder
+case object BlockedOrder extends TreeOrder
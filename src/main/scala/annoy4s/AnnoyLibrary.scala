@@ -15,22 +15,75 @@
 package annoy4s
 
 import com.sun.jna._
+import com.sun.jna.ptr.{IntByReference, LongByReference, PointerByReference}
 
 trait AnnoyLibrary extends Library {
   def createAngular(f: Int): Pointer
   def createEuclidean(f: Int): Pointer
   def createManhattan(f: Int): Pointer
   def createHamming(f: Int): Pointer
+  def createAngularF16(f: Int): Pointer
+  def createEuclideanF16(f: Int): Pointer
+  def createManhattanF16(f: Int): Pointer
+  def createAngularBF16(f: Int): Pointer
+  def createEuclideanBF16(f: Int): Pointer
+  def createManhattanBF16(f: Int): Pointer
   def deleteIndex(ptr: Pointer): Unit
   def addItem(ptr: Pointer, item: Int, w: Array[Float]): Unit
-  def build(ptr: Pointer, q: Int): Unit
-  def save(ptr: Pointer, filename: String): Boolean
+  def addItems(ptr: Pointer, startItem: Int, n: Int, w: Array[Float]): Boolean
+  def textInputDimension(filename: String): Int
+  def fvecsInputDimension(filename: String): Int
+  def loadTextInput(ptr: Pointer, f: Int, filename: String, nThreads: Int, ids: PointerByReference, idsSize: LongByReference): Int
+  def loadFvecsInput(ptr: Pointer, f: Int, filename: String, nThreads: Int): Int
+  def freeBuffer(buffer: Pointer): Unit
+  def onDiskBuild(ptr: Pointer, filename: String, error: PointerByReference): Boolean
+  def onDiskUpdate(ptr: Pointer, filename: String): Boolean
+  def build(ptr: Pointer, q: Int, nThreads: Int): Boolean
+  def save(ptr: Pointer, filename: String, error: PointerByReference): Boolean
   def unload(ptr: Pointer): Unit
   def load(ptr: Pointer, filename: String): Boolean
+  def verify(ptr: Pointer): Boolean
+  def saveAligned(ptr: Pointer, filename: String): Boolean
+  def indexHeader(filename: String, dimension: IntByReference, metric: Array[Byte], vectorType: Array[Byte]): Boolean
+  def deleteItem(ptr: Pointer, item: Int): Boolean
+  def getNDeleted(ptr: Pointer): Int
+  def compact(ptr: Pointer): Boolean
+  def saveDeleted(ptr: Pointer, filename: String): Boolean
+  def loadDeleted(ptr: Pointer, filename: String): Boolean
   def getDistance(ptr: Pointer, i: Int, j: Int): Float
   def getNnsByItem(ptr: Pointer, item: Int, n: Int, searchK: Int, result: Array[Int], distances: Array[Float]): Unit
   def getNnsByVector(ptr: Pointer, w: Array[Float], n: Int, searchK: Int, result: Array[Int], distances: Array[Float]): Unit
+  def getNnsByItemLimited(ptr: Pointer, item: Int, n: Int, searchK: Int, timeoutMicros: Long, maxDistances: Int, result: Array[Int], distances: Array[Float]): Boolean
+  def getNnsByVectorLimited(ptr: Pointer, w: Array[Float], n: Int, searchK: Int, timeoutMicros: Long, maxDistances: Int, result: Array[Int], distances: Array[Float]): Boolean
+  def getNnsByItemFiltered(ptr: Pointer, item: Int, n: Int, searchK: Int, filter: Pointer, filterWords: Int, filterMarked: Int, allow: Boolean, result: Array[Int], distances: Array[Float]): Unit
+  def getNnsByVectorFiltered(ptr: Pointer, w: Array[Float], n: Int, searchK: Int, filter: Pointer, filterWords: Int, filterMarked: Int, allow: Boolean, result: Array[Int], distances: Array[Float]): Unit
+  def getNnsByItemRadius(ptr: Pointer, item: Int, radius: Float, searchK: Int, result: PointerByReference, distances: PointerByReference): Int
+  def getNnsByVectorRadius(ptr: Pointer, w: Array[Float], radius: Float, searchK: Int, result: PointerByReference, distances: PointerByReference): Int
+  def getNnsByItemBatch(ptr: Pointer, items: Array[Int], nq: Int, n: Int, searchK: Int, results: Array[Int], distances: Array[Float], threads: Int): Unit
+  def getNnsByVectorBatch(ptr: Pointer, queries: Array[Float], nq: Int, n: Int, searchK: Int, results: Array[Int], distances: Array[Float], threads: Int): Unit
+  def quantize(ptr: Pointer, rerankMultiple: Int): Boolean
+  def pqQuantize(ptr: Pointer, nSubvectors: Int, rerankMultiple: Int, nThreads: Int): Boolean
+  def savePq(ptr: Pointer, filename: String): Boolean
+  def loadPq(ptr: Pointer, filename: String): Boolean
+  def unquantize(ptr: Pointer): Unit
+  def setResultCacheSize(ptr: Pointer, maxEntries: Int): Unit
+  def getResultCacheStats(ptr: Pointer, stats: Array[Long]): Unit
   def getNItems(ptr: Pointer): Int
   def verbose(ptr: Pointer, v: Boolean): Unit
+  def setTreeOrder(ptr: Pointer, order: Int): Unit
+  def setLeafSize(ptr: Pointer, leafSize: Int): Unit
   def getItem(ptr: Pointer, item: Int, v: Array[Float]): Unit
 }
+
+// Direct-mapped bindings of the calls made once per query, which skip the reflective proxy and argument conversion
+// of AnnoyLibrary
+object AnnoyDirectLibrary {
+  Native.register(getClass, "annoy")
+
+  @native def getDistance(ptr: Pointer, i: Int, j: Int): Float
+  @native def getNnsByItem(ptr: Pointer, item: Int, n: Int, searchK: Int, result: Array[Int], distances: Array[Float]): Unit
+  @native def getNnsByVector(ptr: Pointer, w: Array[Float], n: Int, searchK: Int, result: Array[Int], distances: Array[Float]): Unit
+  @native def getNnsByItemInto(ptr: Pointer, item: Int, n: Int, searchK: Int, result: Pointer, distances: Pointer): Int
+  @native def getNnsByVectorInto(ptr: Pointer, w: Pointer, n: Int, searchK: Int, result: Pointer, distances: Pointer): Int
+  @native def getItem(ptr: Pointer, item: Int, v: Array[Float]): Unit
+}
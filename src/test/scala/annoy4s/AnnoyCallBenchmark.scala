@@ -0,0 +1,60 @@
+// Copyright (c) 2016 pishen
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package annoy4s
+
+import scala.util.Random
+
+// Per-call time of the interface-mapped and the direct-mapped bindings, on calls that do almost no work natively.
+// Run with sbt "Test/runMain annoy4s.AnnoyCallBenchmark".
+object AnnoyCallBenchmark {
+
+  def main(args: Array[String]): Unit = {
+    val dimension = 16
+    val numOfItems = 1000
+    val lib = Annoy.annoyLib
+    val index = lib.createEuclidean(dimension)
+    val random = new Random(0)
+    (0 until numOfItems).foreach(i => lib.addItem(index, i, Array.fill(dimension)(random.nextFloat())))
+    lib.build(index, 1, 1)
+
+    val vector = Array.fill(dimension)(random.nextFloat())
+    val result = new Array[Int](1)
+    val distances = new Array[Float](1)
+    val item = new Array[Float](dimension)
+
+    val calls = Seq[(String, Int => Unit)](
+      "getDistance (interface)" -> (i => lib.getDistance(index, i % numOfItems, 0)),
+      "getDistance (direct)" -> (i => AnnoyDirectLibrary.getDistance(index, i % numOfItems, 0)),
+      "getItem (interface)" -> (i => lib.getItem(index, i % numOfItems, item)),
+      "getItem (direct)" -> (i => AnnoyDirectLibrary.getItem(index, i % numOfItems, item)),
+      "getNnsByItem (interface)" -> (i => lib.getNnsByItem(index, i % numOfItems, 1, 1, result, distances)),
+      "getNnsByItem (direct)" -> (i => AnnoyDirectLibrary.getNnsByItem(index, i % numOfItems, 1, 1, result, distances)),
+      "getNnsByVector (interface)" -> (_ => lib.getNnsByVector(index, vector, 1, 1, result, distances)),
+      "getNnsByVector (direct)" -> (_ => AnnoyDirectLibrary.getNnsByVector(index, vector, 1, 1, result, distances))
+    )
+
+    val warmUpCalls = 200000
+    val measuredCalls = 1000000
+    calls.foreach { case (name, call) =>
+      (0 until warmUpCalls).foreach(call)
+      val start = System.nanoTime()
+      (0 until measuredCalls).foreach(call)
+      val nanosPerCall = (System.nanoTime() - start).toDouble / measuredCalls
+      println(f"$name%-28s $nanosPerCall%8.1f ns/call")
+    }
+
+    lib.deleteIndex(index)
+  }
+}
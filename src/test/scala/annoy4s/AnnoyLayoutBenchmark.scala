@@ -0,0 +1,61 @@
+// Copyright (c) 2016 pishen
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package annoy4s
+
+import better.files._
+
+import scala.util.Random
+
+// Query throughput and size of the same index saved in the node layout, converted to the aligned one and converted
+// with leaves of 64 items, see Annoy.alignLayout. Run with
+// sbt "Test/runMain annoy4s.AnnoyLayoutBenchmark [numOfItems] [dimension]".
+object AnnoyLayoutBenchmark {
+
+  def main(args: Array[String]): Unit = {
+    val numOfItems = args.headOption.map(_.toInt).getOrElse(200000)
+    val dimension = args.drop(1).headOption.map(_.toInt).getOrElse(64)
+    val random = new Random(0)
+
+    val inputFile = File.newTemporaryFile()
+    inputFile.printLines((0 until numOfItems).map { i =>
+      (i +: Seq.fill(dimension)(random.nextFloat() - 0.5f)).mkString(" ")
+    })
+    val nodesDir = File.newTemporaryDirectory()
+    Annoy.create[Int](inputFile.pathAsString, 20, nodesDir.pathAsString, Euclidean, numOfThreads = -1).close()
+    val alignedDir = File.newTemporaryDirectory()
+    nodesDir.list.foreach(file => file.copyTo(alignedDir / file.name))
+    Annoy.alignLayout(alignedDir.pathAsString)
+    val leavesDir = File.newTemporaryDirectory()
+    nodesDir.list.foreach(file => file.copyTo(leavesDir / file.name))
+    Annoy.alignLayout(leavesDir.pathAsString, leafSize = 64)
+
+    val queries = Seq.fill(2000)(Seq.fill(dimension)(random.nextFloat() - 0.5f))
+    Seq("nodes" -> nodesDir, "aligned" -> alignedDir, "leaves64" -> leavesDir).foreach { case (name, dir) =>
+      val annoy = Annoy.load[Int](dir.pathAsString)
+      queries.take(200).foreach(annoy.query(_, 10, 4000))
+      val start = System.nanoTime()
+      queries.foreach(annoy.query(_, 10, 4000))
+      val queriesPerSecond = queries.size / ((System.nanoTime() - start) / 1e9)
+      val megabytes = (dir / "annoy-index").size / 1e6
+      println(f"$name%-8s $queriesPerSecond%10.0f queries/s $megabytes%8.1f MB")
+      annoy.close()
+    }
+
+    inputFile.delete()
+    nodesDir.delete()
+    alignedDir.delete()
+    leavesDir.delete()
+  }
+}
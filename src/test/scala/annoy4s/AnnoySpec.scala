@@ -14,6 +14,8 @@
 
 package annoy4s
 
+import java.nio.{ByteBuffer, ByteOrder}
+
 import annoy4s.Converters.KeyConverter
 import better.files._
 import org.scalatest._
@@ -78,6 +80,24 @@ class AnnoySpec extends FlatSpec with Matchers {
     inputFile
   }
 
+  // Enough random items for the trees to split, ids from 0
+  private def getRandomInputLines(numOfItems: Int, dimension: Int, seed: Int = 0): InputVectors = {
+    val random = new Random(seed)
+    (0 until numOfItems).map(id => (id +: Seq.fill(dimension)(random.nextFloat() - 0.5f)).mkString(" "))
+  }
+
+  // The share of the 10 Euclidean nearest neighbours of the first 100 items that the index finds for their vectors
+  private def getEuclideanRecall(annoy: Annoy[Int], inputVectors: InputVectors): Double = {
+    val vectors = inputVectors.map(_.split(" ")).map(tokens => tokens.head.toInt -> tokens.tail.map(_.toFloat).toSeq)
+    val found = vectors.take(100).map { case (_, vector) =>
+      val exact = vectors.sortBy { case (_, other) =>
+        other.zip(vector).map { case (a, b) => (a - b) * (a - b) }.sum
+      }.take(10).map(_._1)
+      annoy.query(vector, 10).map(_._1).intersect(exact).size
+    }
+    found.sum / 1000.0
+  }
+
 
   def checkEuclideanResult(res: Option[Seq[(Int, Float)]]) = {
     res.get.map(_._1) shouldBe Seq(10, 11, 12, 13)
@@ -105,6 +125,67 @@ class AnnoySpec extends FlatSpec with Matchers {
     outputDir.delete()
   }
 
+  it should "load a Euclidean file index described by the header of its index file" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val outputDir = File.newTemporaryDirectory()
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, outputDir.pathAsString, Euclidean)
+    annoy.close()
+    outputDir.list.map(_.name).toSet shouldBe Set("ids", "annoy-index")
+
+    val annoyReload = Annoy.load[Int](outputDir.pathAsString, verify = true)
+    checkAnnoy(annoyReload, euclideanInputLines, Euclidean)
+    checkEuclideanResult(annoyReload.query(10, 4))
+    annoyReload.close()
+
+    val indexFile = outputDir / "annoy-index"
+    val bytes = indexFile.byteArray
+    // A byte of the last nodes, before the roots of the 10 trees
+    bytes(bytes.length - 64) = (bytes(bytes.length - 64) ^ 1).toByte
+    indexFile.writeByteArray(bytes)
+    an[IllegalArgumentException] should be thrownBy Annoy.load[Int](outputDir.pathAsString, verify = true)
+
+    outputDir.delete()
+  }
+
+  it should "load and query a Euclidean file index converted to the aligned layout" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val outputDir = File.newTemporaryDirectory()
+
+    Annoy.create[Int](inputFile.pathAsString, 10, outputDir.pathAsString, Euclidean).close()
+    Annoy.alignLayout(outputDir.pathAsString)
+    outputDir.list.map(_.name).toSet shouldBe Set("ids", "annoy-index")
+
+    val annoyReload = Annoy.load[Int](outputDir.pathAsString, verify = true)
+    checkAnnoy(annoyReload, euclideanInputLines, Euclidean)
+    checkEuclideanResult(annoyReload.query(10, 4))
+    annoyReload.close()
+
+    an[IllegalArgumentException] should be thrownBy Annoy.load[Int](outputDir.pathAsString, updatable = true)
+
+    outputDir.delete()
+  }
+
+  it should "create/load and query Euclidean file index built on disk" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val outputDir = File.newTemporaryDirectory()
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, outputDir.pathAsString, Euclidean, onDiskBuild = true)
+    checkEuclideanResult(annoy.query(10, 4))
+    checkAnnoy(annoy, euclideanInputLines, Euclidean)
+
+    annoy.close()
+
+    val annoyReload = Annoy.load[Int](outputDir.pathAsString)
+    checkEuclideanResult(annoyReload.query(10, 4))
+
+    annoyReload.close()
+    outputDir.delete()
+  }
+
   it should "create and query Euclidean memory index" in {
     val inputFile = getTestInputFile(euclideanInputLines)
 
@@ -112,6 +193,464 @@ class AnnoySpec extends FlatSpec with Matchers {
     checkEuclideanResult(annoy.query(10, 4))
   }
 
+  it should "insert items into a built Euclidean memory index" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    annoy.insert(Seq(14 -> Seq(3.0f, 3.0f), 15 -> Seq(0.0f, -2.0f)))
+    annoy.ids shouldBe Seq(10, 11, 12, 13, 14, 15)
+    annoy.query(14, 2).get.map(_._1) shouldBe Seq(14, 13)
+    annoy.query(15, 2).get.map(_._1) shouldBe Seq(15, 10)
+    checkEuclideanResult(annoy.query(10, 4))
+  }
+
+  it should "insert items into a Euclidean file index loaded for update" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val outputDir = File.newTemporaryDirectory()
+
+    Annoy.create[Int](inputFile.pathAsString, 10, outputDir.pathAsString, Euclidean).close()
+
+    val annoy = Annoy.load[Int](outputDir.pathAsString, updatable = true)
+    annoy.insert(Seq(14 -> Seq(3.0f, 3.0f)))
+    annoy.close()
+
+    val annoyReload = Annoy.load[Int](outputDir.pathAsString)
+    annoyReload.ids shouldBe Seq(10, 11, 12, 13, 14)
+    annoyReload.query(14, 2).get.map(_._1) shouldBe Seq(14, 13)
+    checkEuclideanResult(annoyReload.query(10, 4))
+
+    annoyReload.close()
+    outputDir.delete()
+  }
+
+  it should "verify a Euclidean file index built on disk and updated in place" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val outputDir = File.newTemporaryDirectory()
+
+    Annoy.create[Int](inputFile.pathAsString, 10, outputDir.pathAsString, Euclidean, onDiskBuild = true).close()
+    Annoy.load[Int](outputDir.pathAsString, verify = true).close()
+
+    val annoy = Annoy.load[Int](outputDir.pathAsString, updatable = true)
+    annoy.insert(Seq(14 -> Seq(3.0f, 3.0f)))
+    annoy.delete(Seq(12))
+    annoy.close()
+
+    val annoyReload = Annoy.load[Int](outputDir.pathAsString, verify = true)
+    annoyReload.query(14, 2).get.map(_._1) shouldBe Seq(14, 13)
+    annoyReload.query(10, 4).get.map(_._1) shouldBe Seq(10, 11, 13, 14)
+
+    annoyReload.close()
+    outputDir.delete()
+  }
+
+  it should "not return deleted items from a Euclidean file index" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val outputDir = File.newTemporaryDirectory()
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, outputDir.pathAsString, Euclidean)
+    annoy.delete(Seq(11))
+    annoy.query(10, 4).get.map(_._1) shouldBe Seq(10, 12, 13)
+    annoy.close()
+
+    val annoyReload = Annoy.load[Int](outputDir.pathAsString)
+    annoyReload.query(10, 4).get.map(_._1) shouldBe Seq(10, 12, 13)
+    annoyReload.query(Seq(2.0f, 1.0f), 1).map(_._1) shouldBe Seq(10)
+
+    annoyReload.close()
+    outputDir.delete()
+  }
+
+  it should "create and query Euclidean memory index built with multiple threads" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean, numOfThreads = 4)
+    checkEuclideanResult(annoy.query(10, 4))
+  }
+
+  it should "answer batches of queries on a Euclidean memory index" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    val byVector = annoy.queryBatch(Seq(Seq(1.0f, 1.0f), Seq(3.0f, 2.0f)), 4, numOfThreads = 2)
+    byVector shouldBe Seq(annoy.query(Seq(1.0f, 1.0f), 4), annoy.query(Seq(3.0f, 2.0f), 4))
+    checkEuclideanResult(Some(byVector.head))
+
+    val byId = annoy.queryBatchByIds(Seq(10, 99, 13), 4, numOfThreads = 2)
+    byId shouldBe Seq(annoy.query(10, 4), None, annoy.query(13, 4))
+  }
+
+  it should "answer batches of many queries on several threads as one query at a time" in {
+    val inputFile = getTestInputFile(getRandomInputLines(1000, 10))
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    // Several chunks of queries answered together, per thread
+    val random = new Random(1)
+    val vectors = Seq.fill(100)(Seq.fill(10)(random.nextFloat() - 0.5f))
+    annoy.queryBatch(vectors, 10, numOfThreads = 4) shouldBe vectors.map(annoy.query(_, 10))
+
+    val ids = (0 until 1000 by 9) :+ 1000
+    annoy.queryBatchByIds(ids, 10, numOfThreads = 4) shouldBe ids.map(annoy.query(_, 10))
+    annoy.close()
+  }
+
+  it should "stop a query on a Euclidean memory index at its distance budget" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    val (unlimited, unlimitedStopped) = annoy.queryWithLimits(Seq(1.0f, 1.0f), 4, timeoutMicros = 1000000L)
+    unlimited shouldBe annoy.query(Seq(1.0f, 1.0f), 4)
+    unlimitedStopped shouldBe false
+
+    val (limited, limitedStopped) = annoy.queryWithLimitsById(10, 4, maxDistances = 2).get
+    limited.size shouldBe 2
+    limitedStopped shouldBe true
+  }
+
+  it should "only return the items that pass a filter from a Euclidean memory index" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    annoy.queryFiltered(Seq(1.0f, 1.0f), 4, annoy.filter(Seq(11, 13))).map(_._1) shouldBe Seq(11, 13)
+    annoy.queryFilteredById(10, 4, annoy.filter(Seq(10, 11), allow = false)).get.map(_._1) shouldBe Seq(12, 13)
+
+    val filter = annoy.filter(Seq(10, 12))
+    annoy.queryFilteredById(13, 4, filter).get.map(_._1) shouldBe Seq(12, 10)
+    annoy.queryFilteredById(11, 4, filter).get.map(_._1).toSet shouldBe Set(10, 12)
+
+    annoy.close()
+  }
+
+  it should "return all the items within a radius from a Euclidean memory index" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    annoy.queryRadius(Seq(1.0f, 1.0f), 1.5f).map(_._1) shouldBe Seq(10, 11, 12)
+    annoy.queryRadiusById(13, 1.0f).get.map(_._1) shouldBe Seq(13, 12)
+    annoy.queryRadius(Seq(10.0f, 10.0f), 1.0f) shouldBe empty
+
+    annoy.close()
+  }
+
+  it should "return all the items within a radius of near-duplicate points that the trees can't split" in {
+    // Points that differ only by rounding leave the hyperplanes without a side, so items are split at random
+    val xs = Seq("1000.0", "1000.00006", "1000.00012", "1000.00018")
+    val inputLines = (0 until 300).map { i =>
+      s"$i ${if (i % 3 == 0) xs(0) else xs(i % 4)} ${if (i % 2 == 0 && i % 5 == 0) xs(1) else xs(0)}"
+    }
+    val inputFile = getTestInputFile(inputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    (0 until 300).foreach { id =>
+      annoy.queryRadiusById(id, 0.001f).get.size shouldBe 300
+    }
+
+    annoy.close()
+  }
+
+  it should "query a Euclidean memory index into reusable buffers" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    val buffers = annoy.newQueryBuffers(4)
+    buffers.setVector(Array(1.0f, 1.0f))
+    val n = annoy.queryInto(buffers)
+    (0 until n).map(i => (buffers.id(i), buffers.distance(i))) shouldBe annoy.query(Seq(1.0f, 1.0f), 4)
+    annoy.queryByIdInto(13, buffers) shouldBe 4
+    buffers.id(1) shouldBe 12
+    annoy.queryByIdInto(99, buffers) shouldBe -1
+    an[IllegalArgumentException] should be thrownBy annoy.newQueryBuffers(0)
+
+    annoy.close()
+  }
+
+  it should "get the distance between two items of a Euclidean memory index" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    annoy.getDistance(10, 11) shouldBe Some(1.0f)
+    annoy.getDistance(10, 99) shouldBe None
+
+    annoy.close()
+  }
+
+  it should "cache the results of item queries on a Euclidean memory index" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    annoy.setResultCacheSize(2)
+    checkEuclideanResult(annoy.query(10, 4))
+    checkEuclideanResult(annoy.query(10, 4))
+    annoy.query(11, 4)
+    annoy.query(12, 4)
+    annoy.resultCacheStats shouldBe ResultCacheStats(hits = 1, misses = 3, entries = 2)
+
+    annoy.delete(Seq(13))
+    annoy.resultCacheStats.entries shouldBe 0
+    annoy.query(10, 4).get.map(_._1) shouldBe Seq(10, 11, 12)
+
+    annoy.close()
+  }
+
+  it should "query Euclidean memory index on quantized vectors" in {
+    val inputLines = getRandomInputLines(500, 10)
+    val inputFile = getTestInputFile(inputLines)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    val exactRecall = getEuclideanRecall(annoy, inputLines)
+    exactRecall should be > 0.8
+    // Only the 10 candidates closest by their codes are reranked, so the codes pick the results
+    annoy.quantize(rerankMultiple = 1)
+    getEuclideanRecall(annoy, inputLines) should be >= exactRecall - 0.05
+    annoy.unquantize()
+    getEuclideanRecall(annoy, inputLines) shouldBe exactRecall
+
+    annoy.close()
+  }
+
+  it should "only quantize an index once it is built" in {
+    val lib = Annoy.annoyLib
+    val index = lib.createEuclidean(2)
+    (0 until 300).foreach(i => lib.addItem(index, i, Array(i.toFloat, (i % 7).toFloat)))
+    // Items added before build aren't coded as they are added
+    lib.quantize(index, 1) shouldBe false
+    lib.pqQuantize(index, 1, 1, 1) shouldBe false
+    lib.build(index, 10, 1)
+    lib.quantize(index, 1) shouldBe true
+    // Items added to the built index are
+    lib.addItem(index, 300, Array(1000.0f, 0.0f))
+    val result = Array.fill(1)(-1)
+    lib.getNnsByVector(index, Array(1000.0f, 0.0f), 1, -1, result, Array.fill(1)(-1.0f))
+    result.head shouldBe 300
+
+    lib.deleteIndex(index)
+  }
+
+  it should "create/load and query Euclidean file index on product-quantized vectors" in {
+    // 256 centroids per subvector for 1000 items, so the codes lose some of every vector
+    val inputLines = getRandomInputLines(1000, 8)
+    val inputFile = getTestInputFile(inputLines)
+
+    val outputDir = File.newTemporaryDirectory()
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, outputDir.pathAsString, Euclidean)
+    annoy.productQuantize(numOfSubvectors = 4, rerankMultiple = 0)
+    val recall = getEuclideanRecall(annoy, inputLines)
+    recall should be > 0.7
+    // Without reranking the distances are the ones of the codes
+    val vector = inputLines.head.split(" ").tail.map(_.toFloat).toSeq
+    annoy.query(vector, 10).exists { case (id, distance) =>
+      math.abs(distance - annoy.getDistance(0, id).get) > 1e-4
+    } shouldBe true
+    annoy.close()
+
+    (outputDir / "pq").exists shouldBe true
+    val annoyReload = Annoy.load[Int](outputDir.pathAsString)
+    getEuclideanRecall(annoyReload, inputLines) shouldBe recall
+
+    annoyReload.close()
+
+    (outputDir / "pq").writeByteArray(Array.fill[Byte](16)(1))
+    an[IllegalArgumentException] should be thrownBy Annoy.load[Int](outputDir.pathAsString)
+
+    outputDir.delete()
+  }
+
+  it should "replace product-quantized codes with int8 ones" in {
+    val inputLines = getRandomInputLines(1000, 8)
+    val inputFile = getTestInputFile(inputLines)
+
+    val outputDir = File.newTemporaryDirectory()
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, outputDir.pathAsString, Euclidean)
+    annoy.productQuantize(numOfSubvectors = 4, rerankMultiple = 0)
+    val vector = inputLines.head.split(" ").tail.map(_.toFloat).toSeq
+    def exactDistances = annoy.query(vector, 10).forall { case (id, distance) =>
+      math.abs(distance - annoy.getDistance(0, id).get) <= 1e-4
+    }
+    exactDistances shouldBe false
+    // int8 codes always rerank, so the distances are the exact ones again
+    annoy.quantize(rerankMultiple = 1)
+    exactDistances shouldBe true
+    (outputDir / "pq").exists shouldBe false
+    annoy.close()
+
+    outputDir.delete()
+  }
+
+  it should "create/load and query Euclidean file index stored as 16-bit floats" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    Seq(Float16, BFloat16).foreach { precision =>
+      val outputDir = File.newTemporaryDirectory()
+
+      val annoy = Annoy.create[Int](inputFile.pathAsString, 10, outputDir.pathAsString, Euclidean, precision = precision)
+      checkEuclideanResult(annoy.query(10, 4))
+      annoy.close()
+
+      val annoyReload = Annoy.load[Int](outputDir.pathAsString)
+      checkAnnoy(annoyReload, euclideanInputLines, Euclidean)
+      checkEuclideanResult(annoyReload.query(10, 4))
+      annoyReload.getItem(11).get shouldBe Seq(2.0f, 1.0f)
+
+      annoyReload.close()
+      outputDir.delete()
+    }
+  }
+
+  it should "query 16-bit float indexes with the query as given, and refuse values out of their range" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    Seq(Float16, BFloat16).foreach { precision =>
+      val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean, precision = precision)
+      // Both round 1.0001 to 1.0, the items are stored exactly
+      val result = annoy.query(Seq(1.0001f, 1.0f), 1)
+      result.map(_._1) shouldBe Seq(10)
+      result.head._2 shouldBe 0.0001f +- 1e-6f
+      annoy.close()
+    }
+
+    val outOfRangeFile = getTestInputFile(Seq("0 70000.0 1.0", "1 1.0 1.0"))
+    an[IllegalArgumentException] should be thrownBy
+      Annoy.create[Int](outOfRangeFile.pathAsString, 10, metric = Euclidean, precision = Float16)
+    val annoy = Annoy.create[Int](outOfRangeFile.pathAsString, 10, metric = Euclidean, precision = BFloat16)
+    annoy.getItem(0).get shouldBe Seq(70144.0f, 1.0f)
+    annoy.close()
+  }
+
+  it should "answer the same from an index with splits converted to the aligned layout" in {
+    val inputLines = getRandomInputLines(1000, 10)
+    val inputFile = getTestInputFile(inputLines)
+
+    val nodesDir = File.newTemporaryDirectory()
+    Annoy.create[Int](inputFile.pathAsString, 10, nodesDir.pathAsString, Euclidean).close()
+    val alignedDir = File.newTemporaryDirectory()
+    nodesDir.list.foreach(file => file.copyTo(alignedDir / file.name))
+    Annoy.alignLayout(alignedDir.pathAsString)
+
+    val nodes = Annoy.load[Int](nodesDir.pathAsString)
+    val aligned = Annoy.load[Int](alignedDir.pathAsString, verify = true)
+    (0 until 1000).foreach { id =>
+      aligned.query(id, 10) shouldBe nodes.query(id, 10)
+      aligned.getItem(id) shouldBe nodes.getItem(id)
+    }
+    val vector = Seq.fill(10)(0.1f)
+    aligned.query(vector, 10) shouldBe nodes.query(vector, 10)
+    aligned.queryRadius(vector, 0.8f) shouldBe nodes.queryRadius(vector, 0.8f)
+
+    nodes.close()
+    aligned.close()
+    nodesDir.delete()
+    alignedDir.delete()
+  }
+
+  it should "answer the same from an index with splits with its trees in blocked order" in {
+    val inputLines = getRandomInputLines(1000, 10)
+    val inputFile = getTestInputFile(inputLines)
+
+    val postDir = File.newTemporaryDirectory()
+    Annoy.create[Int](inputFile.pathAsString, 10, postDir.pathAsString, Euclidean).close()
+    val blockedDir = File.newTemporaryDirectory()
+    Annoy.create[Int](inputFile.pathAsString, 10, blockedDir.pathAsString, Euclidean, treeOrder = BlockedOrder).close()
+
+    // The first node of the first tree follows the 1000 items of 16 + 4 * 10 bytes after the header: a leaf in post
+    // order, the root, which holds all the items, in blocked order
+    def firstTreeNodeSize(dir: File): Int =
+      ByteBuffer.wrap((dir / "annoy-index").byteArray).order(ByteOrder.LITTLE_ENDIAN).getInt(4096 + 1000 * (16 + 4 * 10))
+    firstTreeNodeSize(postDir) should be <= 10
+    firstTreeNodeSize(blockedDir) shouldBe 1000
+
+    val post = Annoy.load[Int](postDir.pathAsString)
+    val blocked = Annoy.load[Int](blockedDir.pathAsString, verify = true)
+    (0 until 1000).foreach { id =>
+      blocked.query(id, 10) shouldBe post.query(id, 10)
+    }
+    val vector = Seq.fill(10)(0.1f)
+    blocked.query(vector, 10) shouldBe post.query(vector, 10)
+    blocked.queryRadius(vector, 0.8f) shouldBe post.queryRadius(vector, 0.8f)
+
+    post.close()
+    blocked.close()
+    postDir.delete()
+    blockedDir.delete()
+  }
+
+  it should "create/load and query Euclidean file index with small leaves, aligned with large ones" in {
+    val inputFile = getTestInputFile(euclideanInputLines)
+
+    val outputDir = File.newTemporaryDirectory()
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, outputDir.pathAsString, Euclidean, leafSize = 2)
+    checkEuclideanResult(annoy.query(10, 4))
+    annoy.close()
+
+    val annoyReload = Annoy.load[Int](outputDir.pathAsString, verify = true)
+    checkAnnoy(annoyReload, euclideanInputLines, Euclidean)
+    checkEuclideanResult(annoyReload.query(10, 4))
+    annoyReload.close()
+
+    Annoy.alignLayout(outputDir.pathAsString, leafSize = 100)
+    val annoyAligned = Annoy.load[Int](outputDir.pathAsString, verify = true)
+    checkAnnoy(annoyAligned, euclideanInputLines, Euclidean)
+    checkEuclideanResult(annoyAligned.query(10, 4))
+    annoyAligned.close()
+
+    outputDir.delete()
+  }
+
+  it should "answer the same from an index with splits aligned with large leaves, packed or not" in {
+    // Items 66000 apart are at the same point, so the leaves around them hold items further apart than their packed
+    // gaps can, and keep their items unpacked
+    val inputLines = (0 until 70000).map { id =>
+      val point = id % 66000
+      s"$id ${point / 1000.0f} ${point % 7 / 1000.0f}"
+    }
+    val inputFile = getTestInputFile(inputLines)
+
+    val nodesDir = File.newTemporaryDirectory()
+    Annoy.create[Int](inputFile.pathAsString, 10, nodesDir.pathAsString, Euclidean).close()
+    val nodes = Annoy.load[Int](nodesDir.pathAsString)
+
+    Seq(0, 16).foreach { leafSize =>
+      val alignedDir = File.newTemporaryDirectory()
+      nodesDir.list.foreach(file => file.copyTo(alignedDir / file.name))
+      Annoy.alignLayout(alignedDir.pathAsString, leafSize)
+      val aligned = Annoy.load[Int](alignedDir.pathAsString, verify = true)
+      if (leafSize == 0) {
+        (0 until 70000 by 7).foreach { id =>
+          aligned.query(id, 10) shouldBe nodes.query(id, 10)
+        }
+      } else {
+        // Larger leaves spend the default searchK differently, so compare searches of every item
+        (0 until 70000 by 701).foreach { id =>
+          aligned.query(id, 10, 1000000) shouldBe nodes.query(id, 10, 1000000)
+        }
+      }
+      aligned.close()
+      alignedDir.delete()
+    }
+
+    nodes.close()
+    nodesDir.delete()
+  }
+
+  it should "create and query Euclidean memory index from an fvecs file" in {
+    val inputFile = File.newTemporaryFile(suffix = ".fvecs")
+    inputFile.toJava.deleteOnExit()
+    val buffer = ByteBuffer.allocate(euclideanInputLines.size * (4 + 2 * 4)).order(ByteOrder.LITTLE_ENDIAN)
+    euclideanInputLines.map(_.split(" ").tail.map(_.toFloat)).foreach { vector =>
+      buffer.putInt(vector.length)
+      vector.foreach(buffer.putFloat)
+    }
+    inputFile.writeByteArray(buffer.array)
+
+    val annoy = Annoy.create[Int](inputFile.pathAsString, 10, metric = Euclidean)
+    annoy.ids shouldBe Seq(0, 1, 2, 3)
+    checkEuclideanResult(annoy.query(0, 4).map(_.map { case (id, distance) => (id + 10, distance) }))
+  }
+
   def checkAngularResult(res: Option[Seq[(Int, Float)]]) = {
     res.get.map(_._1) shouldBe Seq(10, 11, 12, 13)
     res.get.map(_._2).zip(Seq(0.0f, 0.765f, 1.414f, 2.0f)).foreach {